@@ -0,0 +1,56 @@
+#include "Assembler.h"
+
+#include <cstdio>
+
+Assembler::label_t Assembler::label()
+{
+  _labels.push_back(UNBOUND);
+  return _labels.size() - 1;
+}
+
+void Assembler::bind(label_t label)
+{
+  assert(label < _labels.size() && _labels[label] == UNBOUND);
+  _labels[label] = u32(_code.size());
+}
+
+void Assembler::load(u8 a, s32 value)
+{
+  imm16(Opcode::Ldi, a, value);
+
+  if (value != s16(value))
+    imm16(Opcode::Lui, a, s32(u32(value) >> 16));
+}
+
+void Assembler::branch(Opcode opcode, u8 a, label_t target)
+{
+  assert(opcode == Opcode::Jmp || opcode == Opcode::Jz || opcode == Opcode::Jnz || opcode == Opcode::Call);
+  _fixups.push_back({ _code.size(), target });
+  imm16(opcode, a, 0);
+}
+
+bool Assembler::assemble(std::vector<u32>& code) const
+{
+  if (_code.size() > size_t(Specs::CODE_SIZE_IN_INSTRUCTIONS))
+  {
+    printf("Program of %zu instructions doesn't fit in %d.\n", _code.size(), Specs::CODE_SIZE_IN_INSTRUCTIONS);
+    return false;
+  }
+
+  code = _code;
+
+  for (const Fixup& fixup : _fixups)
+  {
+    const u32 target = _labels[fixup.label];
+
+    if (target == UNBOUND)
+    {
+      printf("Label %zu is used but never bound.\n", fixup.label);
+      return false;
+    }
+
+    code[fixup.instruction] = (code[fixup.instruction] & 0xFFFF) | target << 16;
+  }
+
+  return true;
+}
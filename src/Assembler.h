@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Cpu.h"
+
+#include <vector>
+
+/*
+  Builds programs for the Cpu from code, with labels resolved once everything is emitted.
+  Branch targets are absolute instruction indices, so programs are always loaded at Address::CODE.
+*/
+class Assembler
+{
+public:
+  using label_t = size_t;
+
+private:
+  static constexpr u32 UNBOUND = ~u32(0);
+
+  struct Fixup
+  {
+    size_t instruction;
+    label_t label;
+  };
+
+  std::vector<u32> _code;
+  std::vector<u32> _labels;
+  std::vector<Fixup> _fixups;
+
+public:
+  /* a label is created unbound, bind() attaches it to the next emitted instruction */
+  label_t label();
+  void bind(label_t label);
+  label_t here() { label_t l = label(); bind(l); return l; }
+
+  void op(Opcode opcode, u8 a = 0, u8 b = 0, u8 c = 0) { _code.push_back(Instruction::encode(opcode, a, b, c)); }
+  void imm16(Opcode opcode, u8 a, s32 value) { _code.push_back(Instruction::encodeImm16(opcode, a, value)); }
+  void imm8(Opcode opcode, u8 a, u8 b, s32 value) { _code.push_back(Instruction::encodeImm8(opcode, a, b, value)); }
+
+  /* Ldi alone when value fits 16 signed bits, followed by Lui otherwise */
+  void load(u8 a, s32 value);
+  /* Jmp, Jz, Jnz or Call to a label, a is ignored by Jmp and Call */
+  void branch(Opcode opcode, u8 a, label_t target);
+
+  size_t size() const { return _code.size(); }
+
+  /* resolves labels into code, fails if any is still unbound or the program is too large */
+  bool assemble(std::vector<u32>& code) const;
+};
@@ -0,0 +1,274 @@
+#include "Cartridge.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MINIATURE_MAPPED_FILES 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  using Entry = CartridgeHeader::Entry;
+
+  size_t alignUp(size_t value, size_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
+
+#if defined(MINIATURE_MAPPED_FILES)
+  /* large sections are read ahead in one go instead of faulting a page at a time */
+  constexpr size_t READ_AHEAD_SIZE = KB1 * 16;
+
+  void willNeed(const u8* data, size_t size)
+  {
+    if (size < READ_AHEAD_SIZE)
+      return;
+
+    const uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    const uintptr_t start = uintptr_t(data) & ~(page - 1);
+    madvise(reinterpret_cast<void*>(start), uintptr_t(data) + size - start, MADV_WILLNEED);
+  }
+#endif
+}
+
+Cartridge::Region Cartridge::region(CartridgeSection section)
+{
+  switch (section)
+  {
+    case CartridgeSection::Code: return { Address::CODE, Specs::CODE_SIZE_IN_BYTES };
+    case CartridgeSection::SpriteMap: return { Address::SPRITE_MAP, Specs::SPRITE_MAP_SIZE_IN_BYTES * Specs::SPRITE_MAPS_COUNT };
+    case CartridgeSection::Palettes: return { Address::PALETTES, Specs::PALETTES_SIZE_IN_BYTES };
+    case CartridgeSection::TileMap: return { Address::TILE_MAP, Specs::TILE_MAP_SIZE_IN_BYTES * Specs::TILE_MAPS_COUNT };
+    case CartridgeSection::TileMapInfos: return { Address::TILE_MAP_INFOS, Specs::TILE_MAP_INFOS_SIZE_IN_BYTES };
+    case CartridgeSection::SpriteInfos: return { Address::SPRITE_INFOS, Specs::SPRITE_INFOS_SIZE_IN_BYTES };
+    default: return { 0, 0 };
+  }
+}
+
+const char* Cartridge::name(CartridgeSection section)
+{
+  static const char* names[] = { "code", "sprite map", "palettes", "tile map", "tile map infos", "sprite infos" };
+  static_assert(sizeof(names) / sizeof(names[0]) == size_t(CartridgeSection::Count));
+  return section < CartridgeSection::Count ? names[size_t(section)] : "unknown";
+}
+
+bool Cartridge::open(const path& fileName)
+{
+  close();
+
+#if defined(MINIATURE_MAPPED_FILES)
+  const int fd = ::open(fileName.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    printf("Unable to open cartridge %s: %s\n", fileName.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(CartridgeHeader))
+  {
+    printf("Cartridge %s is too small to contain a header.\n", fileName.c_str());
+    ::close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    printf("Unable to map cartridge %s: %s\n", fileName.c_str(), strerror(errno));
+    return false;
+  }
+
+  /* sections are read in whatever order they are applied, reading ahead around the header would only load unused ones */
+  madvise(data, info.st_size, MADV_RANDOM);
+
+  _data = static_cast<const u8*>(data);
+  _size = info.st_size;
+#else
+  FILE* in = fopen(fileName.c_str(), "rb");
+
+  if (!in)
+  {
+    printf("Unable to open cartridge %s.\n", fileName.c_str());
+    return false;
+  }
+
+  fseek(in, 0, SEEK_END);
+  _buffer.resize(size_t(ftell(in)));
+  fseek(in, 0, SEEK_SET);
+
+  const bool success = fread(_buffer.data(), 1, _buffer.size(), in) == _buffer.size();
+  fclose(in);
+
+  if (!success || _buffer.size() < sizeof(CartridgeHeader))
+  {
+    printf("Cartridge %s is too small to contain a header.\n", fileName.c_str());
+    _buffer.clear();
+    return false;
+  }
+
+  _data = _buffer.data();
+  _size = _buffer.size();
+#endif
+
+  if (!validate(fileName))
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void Cartridge::close()
+{
+#if defined(MINIATURE_MAPPED_FILES)
+  if (_data)
+    munmap(const_cast<u8*>(_data), _size);
+#endif
+
+  _data = nullptr;
+  _size = 0;
+  _buffer.clear();
+  _entries = nullptr;
+  _index.fill(NONE);
+}
+
+/* only the table is read here, section contents are left alone until they are applied */
+bool Cartridge::validate(const path& fileName)
+{
+  const CartridgeHeader& header = *reinterpret_cast<const CartridgeHeader*>(_data);
+
+  if (header.magic != CartridgeHeader::MAGIC || header.version != CartridgeHeader::VERSION)
+  {
+    printf("Cartridge %s has an unknown format.\n", fileName.c_str());
+    return false;
+  }
+
+  if (header.sections > _index.size() || sizeof(CartridgeHeader) + header.sections * sizeof(Entry) > _size)
+  {
+    printf("Cartridge %s has a truncated section table.\n", fileName.c_str());
+    return false;
+  }
+
+  _entries = reinterpret_cast<const Entry*>(_data + sizeof(CartridgeHeader));
+
+  for (u32 i = 0; i < header.sections; ++i)
+  {
+    const Entry& entry = _entries[i];
+    const CartridgeSection section = CartridgeSection(entry.section);
+
+    if (section >= CartridgeSection::Count || has(section))
+    {
+      printf("Cartridge %s has an unknown or repeated section %u.\n", fileName.c_str(), entry.section);
+      return false;
+    }
+
+    const Region region = Cartridge::region(section);
+
+    if (u64(entry.offset) + entry.size > region.size || entry.fileOffset > _size || entry.size > _size - entry.fileOffset)
+    {
+      printf("Cartridge %s has a %s section out of bounds.\n", fileName.c_str(), name(section));
+      return false;
+    }
+
+    /* programs are read as whole instructions and always start at the beginning of the code region */
+    if (section == CartridgeSection::Code && (entry.offset || entry.size % sizeof(u32) || entry.fileOffset % sizeof(u32)))
+    {
+      printf("Cartridge %s has misaligned code.\n", fileName.c_str());
+      return false;
+    }
+
+    _index[size_t(section)] = i;
+  }
+
+  return true;
+}
+
+void Cartridge::apply(Machine& machine, CartridgeSection section) const
+{
+  if (!has(section))
+    return;
+
+  const Entry& entry = this->entry(section);
+  const u8* source = _data + entry.fileOffset;
+
+#if defined(MINIATURE_MAPPED_FILES)
+  willNeed(source, entry.size);
+#endif
+
+  if (section == CartridgeSection::Code)
+    machine.load(reinterpret_cast<const u32*>(source), entry.size / sizeof(u32));
+  else
+    machine.memory().write(region(section).address + entry.offset, source, entry.size);
+}
+
+void Cartridge::load(Machine& machine) const
+{
+  machine.reset();
+
+  for (size_t i = 0; i < _index.size(); ++i)
+    apply(machine, CartridgeSection(i));
+}
+
+bool Cartridge::save(const path& fileName, const Machine& machine)
+{
+  const Memory& memory = machine.memory();
+  std::vector<Source> sources;
+
+  for (size_t i = 0; i < size_t(CartridgeSection::Count); ++i)
+  {
+    const CartridgeSection section = CartridgeSection(i);
+    const Region region = Cartridge::region(section);
+    const u8* data = memory.addr<u8>(region.address);
+
+    /* code is trimmed a whole instruction at a time */
+    const addr_t unit = section == CartridgeSection::Code ? sizeof(u32) : 1;
+    addr_t size = region.size;
+
+    while (size && std::all_of(data + size - unit, data + size, [](u8 byte) { return byte == 0; }))
+      size -= unit;
+
+    if (size)
+      sources.push_back({ section, 0, data, size });
+  }
+
+  return save(fileName, sources);
+}
+
+bool Cartridge::save(const path& fileName, const std::vector<Source>& sources)
+{
+  std::vector<Entry> entries;
+  size_t fileOffset = alignUp(sizeof(CartridgeHeader) + sources.size() * sizeof(Entry), CartridgeHeader::SECTION_ALIGNMENT);
+
+  for (const Source& source : sources)
+  {
+    assert(source.section < CartridgeSection::Count && source.offset + source.size <= region(source.section).size);
+
+    entries.push_back({ u32(source.section), source.offset, source.size, 0, fileOffset });
+    fileOffset = alignUp(fileOffset + source.size, CartridgeHeader::SECTION_ALIGNMENT);
+  }
+
+  FILE* out = fopen(fileName.c_str(), "wb");
+
+  if (!out)
+  {
+    printf("Unable to create cartridge %s.\n", fileName.c_str());
+    return false;
+  }
+
+  const CartridgeHeader header = { CartridgeHeader::MAGIC, CartridgeHeader::VERSION, u32(entries.size()), 0 };
+  bool success = fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(entries.data(), sizeof(Entry), entries.size(), out) == entries.size();
+
+  for (size_t i = 0; i < entries.size(); ++i)
+    success = success && fseek(out, long(entries[i].fileOffset), SEEK_SET) == 0 && fwrite(sources[i].data, 1, entries[i].size, out) == entries[i].size;
+
+  fclose(out);
+  return success;
+}
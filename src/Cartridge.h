@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <vector>
+
+/* regions of Memory a cartridge can fill, each stored at most once */
+enum class CartridgeSection : u32
+{
+  Code,
+  SpriteMap,
+  Palettes,
+  TileMap,
+  TileMapInfos,
+  SpriteInfos,
+
+  Count
+};
+
+/*
+  Layout of a cartridge file: this header, a table of sections and then their data, each section
+  aligned to SECTION_ALIGNMENT. Section data is stored exactly as it is laid out in Memory, so it
+  can be read straight from the file without being decoded.
+*/
+struct CartridgeHeader
+{
+  static constexpr u32 MAGIC = 0x5243494D; // "MICR"
+  static constexpr u32 VERSION = 1;
+  static constexpr u32 SECTION_ALIGNMENT = 64;
+
+  struct Entry
+  {
+    u32 section; // a CartridgeSection
+    u32 offset; // from the start of the region of the section in Memory
+    u32 size;
+    u32 reserved;
+    u64 fileOffset;
+  };
+
+  u32 magic;
+  u32 version;
+  u32 sections; // entries in the table right after the header
+  u32 reserved;
+};
+
+/*
+  A cartridge mapped read only in memory. Opening it only checks the header and the section table,
+  section data is paged in by the os the first time it is read, so sections never applied cost nothing.
+  The mapping is shared by everything reading from it, any number of machines can be loaded from it.
+*/
+class Cartridge
+{
+public:
+  struct Region
+  {
+    addr_t address;
+    addr_t size;
+  };
+
+  /* contents of a section to save, laid out as in Memory starting offset bytes into its region */
+  struct Source
+  {
+    CartridgeSection section;
+    addr_t offset;
+    const void* data;
+    addr_t size;
+  };
+
+private:
+  static constexpr u32 NONE = ~u32(0);
+
+  const u8* _data;
+  size_t _size;
+  std::vector<u8> _buffer; // file contents when it can't be mapped
+  const CartridgeHeader::Entry* _entries;
+  std::array<u32, size_t(CartridgeSection::Count)> _index; // entry of every section, NONE if missing
+
+  bool validate(const path& fileName);
+
+public:
+  Cartridge() : _data(nullptr), _size(0), _entries(nullptr) { _index.fill(NONE); }
+  ~Cartridge() { close(); }
+
+  Cartridge(const Cartridge&) = delete;
+  Cartridge& operator=(const Cartridge&) = delete;
+
+  bool open(const path& fileName);
+  void close();
+
+  operator bool() const { return _data != nullptr; }
+
+  bool has(CartridgeSection section) const { return _index[size_t(section)] != NONE; }
+  const CartridgeHeader::Entry& entry(CartridgeSection section) const { return _entries[_index[size_t(section)]]; }
+  /* contents of a section straight from the file, valid until the cartridge is closed */
+  const u8* data(CartridgeSection section) const { return has(section) ? _data + entry(section).fileOffset : nullptr; }
+
+  /* copies a single section into memory, code is loaded as a program which starts on the next frame */
+  void apply(Machine& machine, CartridgeSection section) const;
+  /* resets the machine and applies every section */
+  void load(Machine& machine) const;
+
+  /* stores every region of machine, trailing zeroes are dropped since they're what a reset leaves there */
+  static bool save(const path& fileName, const Machine& machine);
+  /* stores sections built without a machine, like by tools which import assets */
+  static bool save(const path& fileName, const std::vector<Source>& sources);
+
+  static Region region(CartridgeSection section);
+  static const char* name(CartridgeSection section);
+};
@@ -0,0 +1,80 @@
+#include "ColorLUT.h"
+
+bool ColorLUT::build(u32 key, size_t bytesPerPixel, bool fullBrightness, const map_t& map)
+{
+  /* keys are tagged so that a caller supplied key never matches a HostFormat one */
+  return build((u64(1) << 32) | key, bytesPerPixel, fullBrightness, map);
+}
+
+bool ColorLUT::build(u64 key, size_t bytesPerPixel, bool fullBrightness, const map_t& map)
+{
+  if (_table && _key == key && _fullBrightness == fullBrightness)
+    return false;
+
+  if (!_table)
+    _table.reset(new u32[SIZE]);
+
+  for (u32 i = 0; i < SIZE; ++i)
+  {
+    const color_t c = Color::ccc(u16(i), fullBrightness);
+    _table[i] = map(c.r, c.g, c.b);
+  }
+
+  _key = key;
+  _bytesPerPixel = bytesPerPixel;
+  _fullBrightness = fullBrightness;
+
+  return true;
+}
+
+bool ColorLUT::build(HostFormat format, bool fullBrightness)
+{
+  map_t map;
+
+  switch (format)
+  {
+    case HostFormat::ARGB8888: map = [](u8 r, u8 g, u8 b) { return 0xFF000000 | (r << 16) | (g << 8) | b; }; break;
+    case HostFormat::ABGR8888: map = [](u8 r, u8 g, u8 b) { return 0xFF000000 | (b << 16) | (g << 8) | r; }; break;
+    case HostFormat::RGB565: map = [](u8 r, u8 g, u8 b) { return u32(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)); }; break;
+    default: return false;
+  }
+
+  return build(u64(format), PixelConverter::bytesPerPixel(format), fullBrightness, map);
+}
+
+void ColorLUT::convert(const col_t* src, void* dest, size_t count) const
+{
+  switch (_bytesPerPixel)
+  {
+    case sizeof(u16):
+    {
+      u16* out = static_cast<u16*>(dest);
+      for (size_t i = 0; i < count; ++i)
+        out[i] = u16((*this)[src[i]]);
+      break;
+    }
+    /* packed 24 bit pixels, the low three bytes of every entry in little endian order */
+    case 3:
+    {
+      u8* out = static_cast<u8*>(dest);
+      for (size_t i = 0; i < count; ++i, out += 3)
+      {
+        const u32 pixel = (*this)[src[i]];
+        out[0] = u8(pixel);
+        out[1] = u8(pixel >> 8);
+        out[2] = u8(pixel >> 16);
+      }
+      break;
+    }
+    case sizeof(u32):
+    {
+      u32* out = static_cast<u32*>(dest);
+      for (size_t i = 0; i < count; ++i)
+        out[i] = (*this)[src[i]];
+      break;
+    }
+    default:
+      assert(false && "unsupported bytes per pixel");
+      break;
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "PixelConverter.h"
+
+#include <functional>
+#include <memory>
+
+/* maps every 15 bit col_t to its host pixel, the opaque flag is ignored */
+class ColorLUT
+{
+public:
+  static constexpr size_t SIZE = 1 << (Specs::BITS_PER_COLOR_COMPONENT * 3);
+
+  using map_t = std::function<u32(u8 r, u8 g, u8 b)>;
+
+private:
+  std::unique_ptr<u32[]> _table;
+  size_t _bytesPerPixel;
+  u64 _key;
+  bool _fullBrightness;
+
+  bool build(u64 key, size_t bytesPerPixel, bool fullBrightness, const map_t& map);
+
+public:
+  ColorLUT() : _bytesPerPixel(0), _key(0), _fullBrightness(false) { }
+
+  operator bool() const { return _table != nullptr; }
+
+  bool fullBrightness() const { return _fullBrightness; }
+  size_t bytesPerPixel() const { return _bytesPerPixel; }
+
+  /* rebuilds the table through map only if key or brightness mode changed, returns true when it did */
+  bool build(u32 key, size_t bytesPerPixel, bool fullBrightness, const map_t& map);
+  bool build(HostFormat format, bool fullBrightness);
+
+  u32 operator[](col_t color) const { return _table[color & (SIZE - 1)]; }
+
+  /* pixels of 2, 3 or 4 bytes, as given when the table was built */
+  void convert(const col_t* src, void* dest, size_t count) const;
+};
@@ -0,0 +1,179 @@
+#include "Cpu.h"
+
+namespace
+{
+  /* in BLOCK mode execution also stops after any instruction which changes the flow of the program */
+  template<bool BLOCK>
+  SEPARATE_DISPATCH u32 interpret(Machine& machine, u32 budget, bool& yielded)
+  {
+    using I = Instruction;
+
+    CpuRegisters& cpu = machine.cpu();
+    yielded = false;
+
+    if (cpu.status != CpuStatus::Running)
+      return 0;
+
+    Memory& memory = machine.memory();
+    const Memory& view = memory;
+    Screen& screen = machine.screen();
+
+    /* code is fetched from memory every time, so programs can modify themselves */
+    const u32* code = view.addr<u32>(Address::CODE);
+    s32* const r = cpu.r.data();
+
+    u32 pc = cpu.pc;
+    int64_t remaining = budget;
+    u32 i;
+
+#define RA r[I::a(i)]
+#define RB r[I::b(i)]
+#define RC r[I::c(i)]
+#define RN(k) r[(I::a(i) + (k)) & (Specs::CPU_REGISTER_COUNT - 1)]
+#define IMM8 I::imm8(i)
+#define IMM16 I::imm16(i)
+#define UPPER (u32(I::imm16(i)) << 16)
+#define CHARGE(n) remaining -= (n)
+#define FAULT(f) { cpu.fault = (f); goto fault; }
+#define WROTE(address) (void)(address)
+/* a block, not a do while, continue has to reach the loop of the switch */
+#define BRANCHED() { if (BLOCK) goto done; NEXT(); }
+
+#if defined(MINIATURE_COMPUTED_GOTO)
+#define OP(name) op_##name:
+#define NEXT() do { if (--remaining < 0) goto exhausted; i = code[pc++ & Cpu::PC_MASK]; goto *labels[i & I::OPCODE_MASK]; } while (0)
+
+    static const void* const labels[] = {
+      &&op_Halt, &&op_Yield, &&op_Nop,
+      &&op_Ldi, &&op_Lui, &&op_Mov,
+      &&op_Add, &&op_Sub, &&op_Mul, &&op_Div, &&op_Mod, &&op_And, &&op_Or, &&op_Xor, &&op_Shl, &&op_Shr, &&op_Sar, &&op_Addi,
+      &&op_Slt, &&op_Sltu, &&op_Seq,
+      &&op_Jmp, &&op_Jz, &&op_Jnz, &&op_Call, &&op_Ret,
+      &&op_Push, &&op_Pop,
+      &&op_Ldb, &&op_Ldh, &&op_Ldw, &&op_Stb, &&op_Sth, &&op_Stw,
+      &&op_Cls, &&op_Pset, &&op_Line, &&op_Rect, &&op_Circ, &&op_Fcirc,
+      &&op_SprPos, &&op_SprTile, &&op_SprFlags, &&op_Pal,
+      &&op_Btn, &&op_Mouse, &&op_Frame,
+      /* unassigned opcodes */
+      &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid,
+      &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid, &&invalid,
+      &&invalid
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == I::OPCODE_MASK + 1);
+    static_assert(size_t(Opcode::Frame) == 46, "labels must follow the order of Opcode");
+
+    NEXT();
+#else
+#define OP(name) case Opcode::name:
+#define NEXT() continue
+
+    for (;;)
+    {
+      if (--remaining < 0)
+        goto exhausted;
+
+      i = code[pc++ & Cpu::PC_MASK];
+
+      switch (I::opcode(i))
+      {
+#endif
+
+    OP(Halt)
+      cpu.status = CpuStatus::Halted;
+      goto done;
+    OP(Yield)
+      yielded = true;
+      goto done;
+
+    OP(Jmp) pc = u16(i >> 16); BRANCHED();
+    OP(Jz) if (!RA) pc = u16(i >> 16); BRANCHED();
+    OP(Jnz) if (RA) pc = u16(i >> 16); BRANCHED();
+    OP(Call)
+      if (cpu.depth >= Specs::CPU_CALL_DEPTH)
+        FAULT(CpuFault::StackOverflow);
+      cpu.calls[cpu.depth++] = u16(pc & Cpu::PC_MASK);
+      pc = u16(i >> 16);
+      BRANCHED();
+    OP(Ret)
+      if (!cpu.depth)
+        FAULT(CpuFault::StackUnderflow);
+      /* the depth is in memory like every register, a program can leave it past the call stack */
+      if (cpu.depth > Specs::CPU_CALL_DEPTH)
+        FAULT(CpuFault::StackOverflow);
+      pc = cpu.calls[--cpu.depth];
+      BRANCHED();
+
+#include "CpuOps.inl"
+
+#if !defined(MINIATURE_COMPUTED_GOTO)
+        default:
+          goto invalid;
+      }
+    }
+#endif
+
+#undef OP
+#undef NEXT
+#undef RA
+#undef RB
+#undef RC
+#undef RN
+#undef IMM8
+#undef IMM16
+#undef UPPER
+#undef CHARGE
+#undef FAULT
+#undef WROTE
+#undef BRANCHED
+
+  invalid:
+    cpu.fault = CpuFault::InvalidOpcode;
+
+  fault:
+    cpu.status = CpuStatus::Fault;
+    goto done;
+
+  exhausted:
+    /* the instruction which didn't fit is not spent */
+    ++remaining;
+
+  done:
+    cpu.pc = pc & Cpu::PC_MASK;
+    return u32(int64_t(budget) - remaining);
+  }
+}
+
+u32 Cpu::run(Machine& machine, u32 budget)
+{
+  bool yielded;
+  return interpret<false>(machine, budget, yielded);
+}
+
+u32 Cpu::step(Machine& machine, u32 budget, bool& yielded)
+{
+  return interpret<true>(machine, budget, yielded);
+}
+
+const char* Cpu::mnemonic(Opcode opcode)
+{
+  static const char* names[] = {
+    "halt", "yield", "nop",
+    "ldi", "lui", "mov",
+    "add", "sub", "mul", "div", "mod", "and", "or", "xor", "shl", "shr", "sar", "addi",
+    "slt", "sltu", "seq",
+    "jmp", "jz", "jnz", "call", "ret",
+    "push", "pop",
+    "ldb", "ldh", "ldw", "stb", "sth", "stw",
+    "cls", "pset", "line", "rect", "circ", "fcirc",
+    "sprpos", "sprtile", "sprflags", "pal",
+    "btn", "mouse", "frame"
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == size_t(Opcode::Count));
+  return opcode < Opcode::Count ? names[size_t(opcode)] : "invalid";
+}
+
+const char* Cpu::name(CpuFault fault)
+{
+  static const char* names[] = { "none", "invalid opcode", "divide by zero", "stack overflow", "stack underflow" };
+  return size_t(fault) < sizeof(names) / sizeof(names[0]) ? names[size_t(fault)] : "unknown";
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "Machine.h"
+
+/* labels as values let every handler jump straight to the next one, other compilers get a switch in a loop */
+#if defined(__GNUC__) || defined(__clang__)
+#define MINIATURE_COMPUTED_GOTO 1
+#endif
+
+/* gcc merges the dispatch at the end of every handler back into a single indirect jump unless told not to */
+#if defined(__GNUC__) && !defined(__clang__)
+#define SEPARATE_DISPATCH __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define SEPARATE_DISPATCH
+#endif
+
+/*
+  Instructions are 32 bits: the opcode in the low byte, then up to three register operands a, b and c
+  of a byte each. Immediate forms replace b and c with a signed 16 bit value, or just c with a signed
+  8 bit one. Register operands and the opcode are masked, so every word is a valid instruction to decode.
+  Operands listed as a.. take their arguments from consecutive registers starting at a.
+*/
+enum class Opcode : u8
+{
+  Halt,     // stops the program until it's loaded again
+  Yield,    // ends the frame, execution continues from the next instruction on the next one
+  Nop,
+
+  Ldi,      // a = imm16
+  Lui,      // a = imm16 << 16 | (a & 0xFFFF)
+  Mov,      // a = b
+
+  Add,      // a = b + c
+  Sub,      // a = b - c
+  Mul,      // a = b * c
+  Div,      // a = b / c, faults on 0
+  Mod,      // a = b % c, faults on 0
+  And,      // a = b & c
+  Or,       // a = b | c
+  Xor,      // a = b ^ c
+  Shl,      // a = b << (c & 31)
+  Shr,      // a = b >> (c & 31), logical
+  Sar,      // a = b >> (c & 31), arithmetic
+  Addi,     // a = b + imm8
+
+  Slt,      // a = b < c, signed
+  Sltu,     // a = b < c, unsigned
+  Seq,      // a = b == c
+
+  Jmp,      // pc = imm16
+  Jz,       // pc = imm16 if a == 0
+  Jnz,      // pc = imm16 if a != 0
+  Call,     // pushes the return address on the call stack, pc = imm16
+  Ret,
+
+  Push,     // pushes a on the data stack
+  Pop,      // pops the data stack into a
+
+  Ldb,      // a = [b + imm8], zero extended
+  Ldh,      // a = [b + imm8], zero extended
+  Ldw,      // a = [b + imm8]
+  Stb,      // [b + imm8] = a
+  Sth,      // [b + imm8] = a
+  Stw,      // [b + imm8] = a
+
+  Cls,      // fills the screen with color a
+  Pset,     // pixel at a, b of color c
+  Line,     // a.. = x0, y0, x1, y1, color
+  Rect,     // a.. = x, y, w, h, color
+  Circ,     // a.. = cx, cy, radius, color
+  Fcirc,    // a.. = cx, cy, radius, color
+
+  SprPos,   // sprite info a moves to b, c
+  SprTile,  // sprite info a shows sprite b
+  SprFlags, // sprite info a gets flags b
+  Pal,      // palette entry a, counting across palettes, becomes color b
+
+  Btn,      // a = pressed buttons
+  Mouse,    // a.. = mouse x, y and buttons
+  Frame,    // a = frames since reset
+
+  Count
+};
+
+struct Instruction
+{
+  /* opcodes use 6 bits, the other 2 of the first byte are ignored */
+  static constexpr u32 OPCODE_MASK = 0x3F;
+  static_assert(size_t(Opcode::Count) <= OPCODE_MASK + 1);
+
+  static constexpr u32 encode(Opcode opcode, u8 a = 0, u8 b = 0, u8 c = 0) { return u32(opcode) | u32(a) << 8 | u32(b) << 16 | u32(c) << 24; }
+  static constexpr u32 encodeImm16(Opcode opcode, u8 a, s32 imm) { return u32(opcode) | u32(a) << 8 | u32(u16(imm)) << 16; }
+  static constexpr u32 encodeImm8(Opcode opcode, u8 a, u8 b, s32 imm) { return encode(opcode, a, b, u8(imm)); }
+
+  static constexpr Opcode opcode(u32 i) { return Opcode(i & OPCODE_MASK); }
+  static constexpr u32 a(u32 i) { return (i >> 8) & (Specs::CPU_REGISTER_COUNT - 1); }
+  static constexpr u32 b(u32 i) { return (i >> 16) & (Specs::CPU_REGISTER_COUNT - 1); }
+  static constexpr u32 c(u32 i) { return (i >> 24) & (Specs::CPU_REGISTER_COUNT - 1); }
+  static constexpr s32 imm16(u32 i) { return s16(i >> 16); }
+  static constexpr s32 imm8(u32 i) { return int8_t(i >> 24); }
+};
+
+/*
+  Interpreter for the programs loaded in Memory. It keeps no state of its own: registers, stacks and the
+  budget all live in CpuRegisters. Every instruction costs a cycle, drawing ones cost DRAW_CYCLES more.
+*/
+class Cpu
+{
+public:
+  static constexpr u32 DRAW_CYCLES = 16;
+  static constexpr u32 PC_MASK = Specs::CODE_SIZE_IN_INSTRUCTIONS - 1;
+
+  /* executes until the program yields, stops or spends budget cycles, returns the cycles spent */
+  static u32 run(Machine& machine, u32 budget);
+  /* the same but also returns right after the first branch, call or return, yielded tells if it stopped on a Yield */
+  static u32 step(Machine& machine, u32 budget, bool& yielded);
+
+  static constexpr bool isControl(Opcode opcode) { return opcode <= Opcode::Yield || (opcode >= Opcode::Jmp && opcode <= Opcode::Ret); }
+  static constexpr bool isDraw(Opcode opcode) { return opcode >= Opcode::Cls && opcode <= Opcode::Fcirc; }
+  static constexpr u32 cycles(Opcode opcode) { return isDraw(opcode) ? 1 + DRAW_CYCLES : 1; }
+
+  /* unaligned accesses are rounded down, addresses past the end wrap around, the sum wraps in unsigned arithmetic */
+  template<typename T> static constexpr addr_t effective(s32 base, s32 offset) { return (u32(base) + u32(offset)) & (Specs::MEMORY_SIZE - sizeof(T)); }
+
+  static const char* mnemonic(Opcode opcode);
+  static const char* name(CpuFault fault);
+};
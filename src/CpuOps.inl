@@ -0,0 +1,121 @@
+/*
+  Handlers shared by the interpreter and the translated blocks, everything but control flow. They are
+  pasted in the dispatch loop of both, which define how operands are fetched and what happens around them:
+
+    OP(name)      starts the handler of an opcode
+    NEXT()        moves on to the next instruction
+    RA, RB, RC    registers of operands a, b and c
+    RN(k)         register k places after a, wrapping around
+    IMM8, IMM16   sign extended immediates
+    UPPER         immediate of Lui already shifted in the upper half
+    CHARGE(n)     cycles spent by drawing on top of the one of the instruction
+    FAULT(f)      stops the program with fault f
+    WROTE(addr)   called after every store with its effective address
+
+  and the locals cpu, r, machine, memory, view and screen.
+*/
+
+  OP(Nop) NEXT();
+
+  OP(Ldi) RA = IMM16; NEXT();
+  OP(Lui) RA = s32(UPPER | (u32(RA) & 0xFFFF)); NEXT();
+  OP(Mov) RA = RB; NEXT();
+
+  /* wrapping arithmetic is done on unsigned values, signed overflow would be undefined */
+  OP(Add) RA = s32(u32(RB) + u32(RC)); NEXT();
+  OP(Sub) RA = s32(u32(RB) - u32(RC)); NEXT();
+  OP(Mul) RA = s32(u32(RB) * u32(RC)); NEXT();
+  OP(Div)
+    if (!RC)
+      FAULT(CpuFault::DivideByZero);
+    RA = RC == -1 ? s32(0u - u32(RB)) : RB / RC;
+    NEXT();
+  OP(Mod)
+    if (!RC)
+      FAULT(CpuFault::DivideByZero);
+    RA = RC == -1 ? 0 : RB % RC;
+    NEXT();
+  OP(And) RA = RB & RC; NEXT();
+  OP(Or) RA = RB | RC; NEXT();
+  OP(Xor) RA = RB ^ RC; NEXT();
+  OP(Shl) RA = s32(u32(RB) << (RC & 31)); NEXT();
+  OP(Shr) RA = s32(u32(RB) >> (RC & 31)); NEXT();
+  OP(Sar) RA = RB >> (RC & 31); NEXT();
+  OP(Addi) RA = s32(u32(RB) + u32(IMM8)); NEXT();
+
+  OP(Slt) RA = RB < RC; NEXT();
+  OP(Sltu) RA = u32(RB) < u32(RC); NEXT();
+  OP(Seq) RA = RB == RC; NEXT();
+
+  /* the data stack is kept between the code and the registers, which would be overwritten otherwise */
+  OP(Push)
+    if (cpu.sp - (Address::RAM + sizeof(u32)) > Address::CPU_REGISTERS - (Address::RAM + sizeof(u32)))
+      FAULT(CpuFault::StackOverflow);
+    cpu.sp -= sizeof(u32);
+    memory.dword(Cpu::effective<u32>(cpu.sp, 0)) = u32(RA);
+    NEXT();
+  OP(Pop)
+    if (cpu.sp - Address::RAM > Address::CPU_REGISTERS - sizeof(u32) - Address::RAM)
+      FAULT(CpuFault::StackUnderflow);
+    RA = s32(view.dword(Cpu::effective<u32>(cpu.sp, 0)));
+    cpu.sp += sizeof(u32);
+    NEXT();
+
+  OP(Ldb) RA = view.byte(Cpu::effective<u8>(RB, IMM8)); NEXT();
+  OP(Ldh) RA = view.word(Cpu::effective<u16>(RB, IMM8)); NEXT();
+  OP(Ldw) RA = s32(view.dword(Cpu::effective<u32>(RB, IMM8))); NEXT();
+  OP(Stb)
+  {
+    const addr_t address = Cpu::effective<u8>(RB, IMM8);
+    memory.byte(address) = u8(RA);
+    WROTE(address);
+    NEXT();
+  }
+  OP(Sth)
+  {
+    const addr_t address = Cpu::effective<u16>(RB, IMM8);
+    memory.word(address) = u16(RA);
+    WROTE(address);
+    NEXT();
+  }
+  OP(Stw)
+  {
+    const addr_t address = Cpu::effective<u32>(RB, IMM8);
+    memory.dword(address) = u32(RA);
+    WROTE(address);
+    NEXT();
+  }
+
+  OP(Cls) CHARGE(Cpu::DRAW_CYCLES); screen.fill(pix_t(RA)); NEXT();
+  OP(Pset) CHARGE(Cpu::DRAW_CYCLES); screen.set(RA, RB, pix_t(RC)); NEXT();
+  OP(Line) CHARGE(Cpu::DRAW_CYCLES); screen.line(RN(0), RN(1), RN(2), RN(3), pix_t(RN(4))); NEXT();
+  OP(Rect) CHARGE(Cpu::DRAW_CYCLES); screen.rect(RN(0), RN(1), RN(2), RN(3), pix_t(RN(4))); NEXT();
+  OP(Circ) CHARGE(Cpu::DRAW_CYCLES); screen.circle(RN(0), RN(1), RN(2), pix_t(RN(3))); NEXT();
+  OP(Fcirc) CHARGE(Cpu::DRAW_CYCLES); screen.fillCircle(RN(0), RN(1), RN(2), pix_t(RN(3))); NEXT();
+
+  OP(SprPos)
+  {
+    SpriteInfo& info = machine.spriteInfo(RA & (Specs::SPRITE_INFO_SIZE - 1));
+    info.x = s16(RB);
+    info.y = s16(RC);
+    NEXT();
+  }
+  OP(SprTile) machine.spriteInfo(RA & (Specs::SPRITE_INFO_SIZE - 1)).index = u8(RB); NEXT();
+  OP(SprFlags) machine.spriteInfo(RA & (Specs::SPRITE_INFO_SIZE - 1)).flags = flag_set<SpriteFlag>(u32(RB)); NEXT();
+  OP(Pal)
+  {
+    const u32 entry = u32(RA) % (Specs::PALETTE_COUNT * Specs::PALETTE_SIZE);
+    machine.palettes()[entry / Specs::PALETTE_SIZE][entry % Specs::PALETTE_SIZE] = col_t(RB);
+    NEXT();
+  }
+
+  OP(Btn) RA = static_cast<const Machine&>(machine).input().buttons; NEXT();
+  OP(Mouse)
+  {
+    const InputState& input = static_cast<const Machine&>(machine).input();
+    RN(0) = input.mouseX;
+    RN(1) = input.mouseY;
+    RN(2) = input.mouseButtons;
+    NEXT();
+  }
+  OP(Frame) RA = s32(machine.frames()); NEXT();
@@ -0,0 +1,192 @@
+#include "Demo.h"
+#include "Assembler.h"
+
+#include <cstddef>
+
+void demo::setup(Machine& machine)
+{
+  machine.reset();
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  /* background and paint are entries of palette 1, drawn pixels keep following them */
+  machine.palettes()[1][1] = Color::ccc(27, 89, 156);
+  machine.palettes()[1][2] = Color::WHITE;
+  machine.screen().fill(Color::indexed(1, 1));
+#else
+  machine.screen().fill(Color::ccc(27, 89, 156));
+#endif
+
+  auto& info = machine.spriteInfo(0);
+  info.flags |= SpriteFlag::Enabled;
+  info.flags |= SpriteFlag::FlippedY;
+  info.x = 10;
+  info.y = 10;
+  info.width = SpriteSize::_16;
+  info.height = SpriteSize::_16;
+
+  machine.palettes()[0][1] = Color::ccc(200, 76, 12);
+  machine.palettes()[0][2] = Color::ccc(252, 188, 176);
+  machine.palettes()[0][3] = Color::ccc(0, 0, 0);
+
+  SpriteRef sprite = machine.sprite(0);
+  sprite.setRow(0, { 0, 0, 0, 0, 0, 0, 1, 1 });
+  sprite.setRow(1, { 0, 0, 0, 0, 0, 1, 1, 1 });
+  sprite.setRow(2, { 0, 0, 0, 0, 1, 1, 1, 1 });
+  sprite.setRow(3, { 0, 0, 0, 3, 3, 1, 1, 1 });
+  sprite.setRow(4, { 0, 0, 1, 1, 2, 3, 1, 1 });
+  sprite.setRow(5, { 0, 1, 1, 1, 2, 3, 1, 1 });
+  sprite.setRow(6, { 0, 1, 1, 1, 2, 3, 3, 3 });
+  sprite.setRowString(7, "11112321");
+
+  SpriteRef sprite1 = machine.sprite(1);
+  sprite1.setRowString(0, "11000000");
+  sprite1.setRowString(1, "11100000");
+  sprite1.setRowString(2, "11110000");
+  sprite1.setRowString(3, "11133000");
+  sprite1.setRowString(4, "11321100");
+  sprite1.setRowString(5, "11321110");
+  sprite1.setRowString(6, "33321110");
+  sprite1.setRowString(7, "12321111");
+
+  SpriteRef sprite2 = machine.sprite(16);
+  sprite2.setString("11112221" "11111111" "01111222" "00002222" "00002222" "00033222" "00033322" "00003330");
+
+  SpriteRef sprite3 = machine.sprite(17);
+  sprite3.setString("12221111" "11111111" "22211110" "22220000" "22223300" "22333330" "23333330" "03333300" );
+}
+
+void demo::update(Machine& machine)
+{
+  const u64 counter = machine.frames();
+
+  if (counter % 4 == 0)
+  {
+    machine.spriteInfo(0).flags.flip(SpriteFlag::FlippedY);
+    ++machine.spriteInfo(0).x;
+  }
+
+  /* the d-pad nudges the sprite and the left mouse button paints, so recorded sessions change what is drawn */
+  const InputState& input = static_cast<const Machine&>(machine).input();
+
+  if (input.buttons && Button::Up) --machine.spriteInfo(0).y;
+  if (input.buttons && Button::Down) ++machine.spriteInfo(0).y;
+  if (input.buttons && Button::Left) --machine.spriteInfo(0).x;
+  if (input.buttons && Button::Right) ++machine.spriteInfo(0).x;
+
+  /* A plays a tone which rises as the sprite goes down */
+  SoundChannel& tone = machine.sound().channel(SoundChannelType::Square);
+  tone.frequency = u16(220 + 4 * (machine.spriteInfo(0).y & 0x7F));
+  tone.volume = input.buttons && Button::A ? 8 : 0;
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  if (input.mouseButtons & 0x01)
+    machine.screen().set(input.mouseX, input.mouseY, Color::indexed(1, 2));
+
+  /* pixels can't be blended anymore, the background pulses by changing its palette entry instead of redrawing */
+  if (counter % 16 == 0)
+  {
+    const u8 level = u8(counter / 16 % 32);
+    const u8 pulse = level < 16 ? level : 31 - level;
+    machine.palettes()[1][1] = Color::ccc(27 + pulse * 4, 89, 156);
+  }
+#else
+  if (input.mouseButtons & 0x01)
+    machine.screen().set(input.mouseX, input.mouseY, Color::WHITE);
+
+  if (counter % 16 == 0)
+  {
+    constexpr addr_t count = Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT;
+    col_t* buffer = machine.memory().span<col_t>(Address::VRAM, count);
+
+    for (addr_t i = 0; i < count; ++i)
+    {
+      color_t c = Color::ccc(buffer[i]);
+      color_t d = { 27, 89, 156, 0xFF };
+
+      buffer[i] = Color::ccc((c.r + d.r) / 2, (c.g + d.g) / 2, (c.b + d.b) / 2);
+    }
+  }
+#endif
+}
+
+std::vector<u32> demo::program()
+{
+  /* registers kept across frames: sprite info, its x, y and flags */
+  enum : u8 { SPRITE = 1, X, Y, FLAGS, FRAME, TMP, BUTTONS, TEST, MOUSE_X, MOUSE_Y, MOUSE_BUTTONS, PAINT, TONE, SOUND };
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  const s32 paint = Color::indexed(1, 2);
+#else
+  const s32 paint = Color::WHITE;
+#endif
+
+  Assembler a;
+
+  a.load(SPRITE, 0);
+  a.load(X, 10);
+  a.load(Y, 10);
+  a.load(FLAGS, u32(SpriteFlag::Enabled) | u32(SpriteFlag::FlippedY));
+  a.load(PAINT, paint);
+  a.load(SOUND, Address::SOUND_REGISTERS + offsetof(SoundRegisters, channels) + size_t(SoundChannelType::Square) * sizeof(SoundChannel));
+
+  const auto loop = a.here();
+
+  /* every 4 frames the sprite flips and steps right */
+  const auto still = a.label();
+  a.op(Opcode::Frame, FRAME);
+  a.load(TMP, 3);
+  a.op(Opcode::And, FRAME, FRAME, TMP);
+  a.branch(Opcode::Jnz, FRAME, still);
+  a.load(TMP, s32(SpriteFlag::FlippedY));
+  a.op(Opcode::Xor, FLAGS, FLAGS, TMP);
+  a.op(Opcode::SprFlags, SPRITE, FLAGS);
+  a.imm8(Opcode::Addi, X, X, 1);
+  a.bind(still);
+
+  /* the d-pad nudges it */
+  a.op(Opcode::Btn, BUTTONS);
+  const auto nudge = [&](Button button, u8 coordinate, s32 delta) {
+    const auto skip = a.label();
+    a.load(TMP, s32(button));
+    a.op(Opcode::And, TEST, BUTTONS, TMP);
+    a.branch(Opcode::Jz, TEST, skip);
+    a.imm8(Opcode::Addi, coordinate, coordinate, delta);
+    a.bind(skip);
+  };
+  nudge(Button::Up, Y, -1);
+  nudge(Button::Down, Y, 1);
+  nudge(Button::Left, X, -1);
+  nudge(Button::Right, X, 1);
+  a.op(Opcode::SprPos, SPRITE, X, Y);
+
+  /* A plays a tone which rises as the sprite goes down, its bit shifted down once is the volume */
+  static_assert(u32(Button::A) >> 1 == 8);
+  a.load(TMP, 0x7F);
+  a.op(Opcode::And, TONE, Y, TMP);
+  a.load(TMP, 2);
+  a.op(Opcode::Shl, TONE, TONE, TMP);
+  a.load(TMP, 220);
+  a.op(Opcode::Add, TONE, TONE, TMP);
+  a.imm8(Opcode::Sth, TONE, SOUND, offsetof(SoundChannel, frequency));
+  a.load(TMP, s32(Button::A));
+  a.op(Opcode::And, TEST, BUTTONS, TMP);
+  a.load(TMP, 1);
+  a.op(Opcode::Shr, TEST, TEST, TMP);
+  a.imm8(Opcode::Stb, TEST, SOUND, offsetof(SoundChannel, volume));
+
+  /* and the left mouse button paints */
+  const auto idle = a.label();
+  a.op(Opcode::Mouse, MOUSE_X);
+  a.load(TMP, 1);
+  a.op(Opcode::And, MOUSE_BUTTONS, MOUSE_BUTTONS, TMP);
+  a.branch(Opcode::Jz, MOUSE_BUTTONS, idle);
+  a.op(Opcode::Pset, MOUSE_X, MOUSE_Y, PAINT);
+  a.bind(idle);
+
+  a.op(Opcode::Yield);
+  a.branch(Opcode::Jmp, 0, loop);
+
+  std::vector<u32> code;
+  a.assemble(code);
+  return code;
+}
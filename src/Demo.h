@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <vector>
+
+namespace demo
+{
+  /* loads the sample sprites and palettes on a freshly reset machine */
+  void setup(Machine& machine);
+
+  /* advances the sample scene, called once after each Machine::frame() */
+  void update(Machine& machine);
+
+  /* update() as a program for the Cpu, to be loaded after setup() in place of calling update() */
+  std::vector<u32> program();
+}
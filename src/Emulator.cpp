@@ -0,0 +1,154 @@
+#include "Emulator.h"
+#include "Profiler.h"
+#include "Replay.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+  static_assert(sizeof(InputState) == sizeof(u64), "input is exchanged as a single atomic word");
+
+  /* field by field, InputState isn't trivial because of its flag_set and its padding isn't part of the state */
+  u64 pack(const InputState& input)
+  {
+    return u64(u16(input.buttons)) | u64(u16(input.mouseX)) << 16 | u64(u16(input.mouseY)) << 32 | u64(input.mouseButtons) << 48;
+  }
+
+  InputState unpack(u64 value)
+  {
+    InputState input = InputState();
+    input.buttons = flag_set<Button>(u16(value));
+    input.mouseX = s16(u16(value >> 16));
+    input.mouseY = s16(u16(value >> 32));
+    input.mouseButtons = u8(value >> 48);
+    return input;
+  }
+}
+
+Emulator::Emulator(double rate) : _rate(rate), _running(false), _input(pack(InputState())), _lastSample(0), _underruns(0)
+{
+
+}
+
+void Emulator::start(const callback_t& update)
+{
+  stop();
+
+  _update = update;
+  _unseen.markAll();
+  _running = true;
+  _thread = std::thread(&Emulator::run, this);
+}
+
+void Emulator::stop()
+{
+  _running = false;
+
+  if (_thread.joinable())
+    _thread.join();
+}
+
+void Emulator::post(const callback_t& command)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _commands.push_back(command);
+}
+
+void Emulator::setInput(const InputState& input)
+{
+  _input.store(pack(input), std::memory_order_relaxed);
+}
+
+void Emulator::execute()
+{
+  std::vector<callback_t> commands;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    commands.swap(_commands);
+  }
+
+  for (const callback_t& command : commands)
+    command(_machine);
+}
+
+void Emulator::run()
+{
+  using clock = std::chrono::steady_clock;
+
+  const clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / _rate));
+  clock::time_point next = clock::now();
+
+  while (_running.load(std::memory_order_relaxed))
+  {
+    execute();
+
+    Replay::step(_machine, unpack(_input.load(std::memory_order_relaxed)), _update);
+
+    Frame& frame = _frames.back();
+    std::memcpy(frame.pixels.data(), _machine.screen().pixels(), sizeof(Framebuffer));
+    frame.number = _machine.frames();
+
+    /* until the consumer is known to have picked up the previous frame its lines are carried over */
+    DirtyLines lines = _machine.screen().dirtyLines();
+    _machine.screen().clearDirtyLines();
+    frame.lines = _unseen;
+    frame.lines |= lines;
+
+    _unseen = _frames.publish() ? lines : frame.lines;
+
+    mix();
+
+    /* the pace is kept on absolute deadlines, a thread stalled too long (eg. by a debugger) restarts from now instead of catching up */
+    next += period;
+    const clock::time_point now = clock::now();
+
+    if (now > next + period * 4)
+      next = now;
+    else
+      std::this_thread::sleep_until(next);
+  }
+}
+
+void Emulator::mix()
+{
+  ProfileScope scope(Profiler::Stage::Sound);
+
+  constexpr size_t FRAME = Specs::SOUND_SAMPLES_PER_FRAME;
+  constexpr size_t TARGET = FRAME * AUDIO_LATENCY;
+  /* a few samples more or less every frame follow the drift between the device clock and ours without being heard */
+  constexpr size_t DRIFT = FRAME / 200;
+
+  const size_t queued = _audio.size();
+  size_t count = FRAME;
+
+  /* after a stall the queue is refilled at once instead of slowly, the device would run dry again in between */
+  if (queued < TARGET / 2)
+    count = TARGET - queued;
+  else if (queued < TARGET)
+    count += std::min(DRIFT, TARGET - queued);
+  else
+    count -= std::min(DRIFT, queued - TARGET);
+
+  _sound.render(static_cast<const Machine&>(_machine).sound(), _block.data(), count);
+
+  /* samples which don't fit are dropped, the device is further behind than the whole queue */
+  _audio.write(_block.data(), count);
+}
+
+void Emulator::readAudio(s16* samples, size_t count)
+{
+  const size_t read = _audio.read(samples, count);
+
+  if (read)
+    _lastSample = samples[read - 1];
+
+  /* a short queue is padded with the last sample, which doesn't click the way dropping to silence would */
+  if (read < count)
+  {
+    std::fill(samples + read, samples + count, _lastSample);
+    _underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+}
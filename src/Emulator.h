@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Machine.h"
+#include "RingBuffer.h"
+#include "SoundChip.h"
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+  Runs a machine on its own thread at a fixed rate, the frames it produces are handed over through a triple buffer
+  and their audio through a ring buffer, so the threads presenting them never hold up the emulation.
+*/
+class Emulator
+{
+public:
+  using callback_t = std::function<void(Machine&)>;
+
+  /* frames of audio kept queued ahead of the device to ride out stalls of the emulation thread */
+  static constexpr size_t AUDIO_LATENCY = 4;
+  static constexpr size_t AUDIO_CAPACITY = 8192;
+  static_assert(AUDIO_CAPACITY >= Specs::SOUND_SAMPLES_PER_FRAME * AUDIO_LATENCY * 2);
+
+  struct Frame
+  {
+    Framebuffer pixels;
+    u64 number;
+    /* lines that changed since the last frame the consumer picked up, the ones it skipped included */
+    DirtyLines lines;
+  };
+
+private:
+  Machine _machine;
+  callback_t _update;
+  double _rate;
+
+  std::thread _thread;
+  std::atomic<bool> _running;
+  std::atomic<u64> _input;
+
+  std::mutex _lock;
+  std::vector<callback_t> _commands;
+
+  TripleBuffer<Frame> _frames;
+  /* lines changed by frames published since the last one known to be picked up */
+  DirtyLines _unseen;
+
+  SoundChip _sound;
+  RingBuffer<s16, AUDIO_CAPACITY> _audio;
+  std::array<s16, AUDIO_CAPACITY> _block;
+
+  /* consumer side of the audio */
+  s16 _lastSample;
+  std::atomic<u64> _underruns;
+
+  void run();
+  void execute();
+  void mix();
+
+public:
+  Emulator(double rate = 60.0);
+  ~Emulator() { stop(); }
+
+  Emulator(const Emulator&) = delete;
+  Emulator& operator=(const Emulator&) = delete;
+
+  /* update runs on the emulation thread after every frame, as demo::update does */
+  void start(const callback_t& update);
+  void stop();
+  bool running() const { return _running.load(std::memory_order_relaxed); }
+
+  /* the machine can be touched directly only while the emulator is stopped, otherwise post() to it */
+  Machine& machine() { return _machine; }
+  void post(const callback_t& command);
+
+  /* latched by the emulation thread before its next frame */
+  void setInput(const InputState& input);
+
+  /* consumer side, true if a frame newer than the current frame() was picked up */
+  bool acquire() { return _frames.update(); }
+  const Frame& frame() const { return _frames.front(); }
+
+  /* consumer side of the audio, from a single thread like an audio callback, always fills every sample */
+  void readAudio(s16* samples, size_t count);
+  u64 underruns() const { return _underruns.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,294 @@
+#include "FrameExport.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MINIATURE_SHARED_MEMORY 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  constexpr size_t SLOT_ALIGNMENT = 64;
+
+  size_t alignUp(size_t value, size_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
+}
+
+#if defined(MINIATURE_SHARED_MEMORY)
+
+bool FrameExport::open(const std::string& name, HostFormat format, u32 slots, ScaleFilter filter, u32 scale)
+{
+  close();
+
+  if (slots == 0 || slots > FrameExportHeader::MAX_SLOTS)
+  {
+    printf("Frame export needs between 1 and %u slots.\n", FrameExportHeader::MAX_SLOTS);
+    return false;
+  }
+
+  if (format != HostFormat::Unknown)
+  {
+    _converter = PixelConverter(format);
+
+    if (!_converter)
+    {
+      printf("Frame export can't convert to %s.\n", PixelConverter::name(format));
+      return false;
+    }
+  }
+
+  const size_t bytesPerPixel = format != HostFormat::Unknown ? PixelConverter::bytesPerPixel(format) : sizeof(col_t);
+
+  if (!Upscaler::isValid(filter, scale))
+  {
+    printf("Frame export can't scale by %u with %s.\n", scale, Upscaler::name(filter));
+    return false;
+  }
+
+  /* plain 1x frames are converted straight into their slot, anything else is staged and then scaled into it */
+  if (scale > 1)
+  {
+    _upscaler = Upscaler(filter, scale, bytesPerPixel);
+    _staging.resize(Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT * bytesPerPixel);
+  }
+
+  const size_t stride = Specs::SCREEN_WIDTH * scale * bytesPerPixel;
+  const size_t slotSize = stride * Specs::SCREEN_HEIGHT * scale;
+  const size_t slotOffset = alignUp(sizeof(FrameExportHeader), SLOT_ALIGNMENT);
+  const size_t size = slotOffset + alignUp(slotSize, SLOT_ALIGNMENT) * slots;
+
+  int fd = -1;
+
+  if (!name.empty())
+    fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  else
+  {
+#if defined(__linux__)
+    fd = memfd_create("miniature-frames", MFD_CLOEXEC);
+#else
+    printf("Anonymous frame export needs memfd_create, which is available only on Linux.\n");
+    return false;
+#endif
+  }
+
+  if (fd < 0 || ftruncate(fd, size) != 0)
+  {
+    printf("Unable to create shared memory for frame export: %s\n", strerror(errno));
+    if (fd >= 0) ::close(fd);
+    return false;
+  }
+
+  void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (region == MAP_FAILED)
+  {
+    printf("Unable to map shared memory for frame export: %s\n", strerror(errno));
+    ::close(fd);
+    return false;
+  }
+
+  _region = static_cast<u8*>(region);
+  _size = size;
+  _fd = fd;
+  _name = name;
+
+  /* the region comes zeroed from ftruncate, so every counter already starts at 0 */
+  _header = new (_region) FrameExportHeader;
+  _header->magic = FrameExportHeader::MAGIC;
+  _header->version = FrameExportHeader::VERSION;
+  _header->width = Specs::SCREEN_WIDTH * scale;
+  _header->height = Specs::SCREEN_HEIGHT * scale;
+  _header->format = u32(format);
+  _header->bytesPerPixel = u32(bytesPerPixel);
+  _header->stride = u32(stride);
+  _header->slots = slots;
+  _header->scale = scale;
+  _header->filter = u32(filter);
+  _header->slotOffset = slotOffset;
+  _header->slotSize = slotSize;
+
+  return true;
+}
+
+void FrameExport::close()
+{
+  if (_region)
+  {
+    munmap(_region, _size);
+    ::close(_fd);
+
+    if (!_name.empty())
+      shm_unlink(_name.c_str());
+  }
+
+  _header = nullptr;
+  _region = nullptr;
+  _size = 0;
+  _fd = -1;
+  _name.clear();
+
+  _upscaler = Upscaler();
+  _staging.clear();
+}
+
+void FrameExport::publish(const Machine& machine)
+{
+  if (!_header)
+    return;
+
+  const u64 sequence = _header->sequence.load(std::memory_order_relaxed);
+  const u32 slot = u32(sequence % _header->slots);
+  std::atomic<u64>& slotSequence = _header->slotSequences[slot];
+  u8* dest = _region + _header->slotOffset + slot * alignUp(_header->slotSize, SLOT_ALIGNMENT);
+
+  const u64 frame = sequence + 1;
+  slotSequence.store(2 * frame - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  /* converted directly into shared memory, the raw format is a single copy out of VRAM */
+  const col_t* pixels = machine.screen().pixels();
+  const size_t count = Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT;
+  if (_upscaler)
+  {
+    const void* source = pixels;
+
+    if (_converter)
+    {
+      _converter.convert(pixels, _staging.data(), count);
+      source = _staging.data();
+    }
+
+    _upscaler.scale(source, Specs::SCREEN_WIDTH, Specs::SCREEN_HEIGHT, dest, _header->stride);
+  }
+  else if (_converter)
+    _converter.convert(pixels, dest, count);
+  else
+    std::memcpy(dest, pixels, count * sizeof(col_t));
+
+  slotSequence.store(2 * frame, std::memory_order_release);
+  _header->sequence.store(frame, std::memory_order_release);
+}
+
+bool FrameReader::open(const std::string& name)
+{
+  close();
+
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+  if (fd < 0)
+  {
+    printf("Unable to open shared frames %s: %s\n", name.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(FrameExportHeader))
+  {
+    printf("Shared frames %s are too small to contain a header.\n", name.c_str());
+    ::close(fd);
+    return false;
+  }
+
+  void* region = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if (region == MAP_FAILED)
+  {
+    printf("Unable to map shared frames %s: %s\n", name.c_str(), strerror(errno));
+    return false;
+  }
+
+  _region = static_cast<const u8*>(region);
+  _size = info.st_size;
+  _header = reinterpret_cast<const FrameExportHeader*>(_region);
+
+  if (_header->magic != FrameExportHeader::MAGIC || _header->version != FrameExportHeader::VERSION)
+  {
+    printf("Shared frames %s were not created by a compatible frame export.\n", name.c_str());
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void FrameReader::close()
+{
+  if (_region)
+    munmap(const_cast<u8*>(_region), _size);
+
+  _header = nullptr;
+  _region = nullptr;
+  _size = 0;
+}
+
+#else
+
+bool FrameExport::open(const std::string&, HostFormat, u32, ScaleFilter, u32)
+{
+  printf("Frame export needs POSIX shared memory, which is not available on this platform.\n");
+  return false;
+}
+
+void FrameExport::close() { }
+void FrameExport::publish(const Machine&) { }
+
+bool FrameReader::open(const std::string&)
+{
+  printf("Frame export needs POSIX shared memory, which is not available on this platform.\n");
+  return false;
+}
+
+void FrameReader::close() { }
+
+#endif
+
+u64 FrameReader::read(void* dest) const
+{
+  if (!_header)
+    return 0;
+
+  u64 previous = 0;
+  u32 stalled = 0;
+
+  /* the writer may lap us while copying, in which case the next latest frame is tried, unless it stopped moving */
+  while (true)
+  {
+    const u64 sequence = _header->sequence.load(std::memory_order_acquire);
+
+    if (sequence == 0)
+      return 0;
+
+    if (sequence != previous)
+    {
+      previous = sequence;
+      stalled = 0;
+    }
+    else if (++stalled >= STALLED_ATTEMPTS)
+      return 0;
+    else
+      std::this_thread::yield();
+
+    const u32 slot = u32((sequence - 1) % _header->slots);
+    const std::atomic<u64>& slotSequence = _header->slotSequences[slot];
+    const u8* src = _region + _header->slotOffset + slot * alignUp(_header->slotSize, SLOT_ALIGNMENT);
+
+    /* anything but the complete frame of this sequence means the slot is being written or already holds a newer one */
+    const u64 complete = 2 * sequence;
+    if (slotSequence.load(std::memory_order_acquire) != complete)
+      continue;
+
+    std::memcpy(dest, src, _header->slotSize);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (slotSequence.load(std::memory_order_relaxed) == complete)
+      return sequence;
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Machine.h"
+#include "PixelConverter.h"
+#include "Upscaler.h"
+
+#include <atomic>
+
+/*
+  Layout of the shared region: a header followed by a ring of slots, each holding one whole frame.
+  Frame n (counting from 1) is published by setting the sequence of its slot to 2n - 1 while writing the
+  pixels, to 2n once they are written and finally storing n as the global sequence. Readers take the slot
+  of the latest sequence n and accept what they read only if the slot sequence was 2n before and after the
+  read, so a slot being rewritten or already holding a newer frame is never mistaken for frame n.
+*/
+struct FrameExportHeader
+{
+  static constexpr u32 MAGIC = 0x4246494D; // "MIFB"
+  static constexpr u32 VERSION = 3;
+  static constexpr u32 MAX_SLOTS = 8;
+
+  u32 magic;
+  u32 version;
+  u32 width, height; // after scaling
+  u32 format; // a HostFormat, Unknown means raw col_t as stored in VRAM
+  u32 bytesPerPixel;
+  u32 stride;
+  u32 slots;
+  u32 scale; // integer factor applied to the framebuffer
+  u32 filter; // a ScaleFilter
+  u64 slotOffset; // from the start of the region
+  u64 slotSize;
+
+  std::atomic<u64> sequence; // frames published so far, the latest one is in slot (sequence - 1) % slots
+  std::atomic<u64> slotSequences[MAX_SLOTS]; // twice the frame in the slot, odd while it's written
+
+  static_assert(std::atomic<u64>::is_always_lock_free, "counters are shared with other processes");
+};
+
+/* publishes every frame into shared memory, converting it straight into its slot or through the upscaler when scaled */
+class FrameExport
+{
+private:
+  FrameExportHeader* _header;
+  u8* _region;
+  size_t _size;
+  int _fd;
+  std::string _name;
+
+  PixelConverter _converter;
+  Upscaler _upscaler;
+  std::vector<u8> _staging;
+
+public:
+  FrameExport() : _header(nullptr), _region(nullptr), _size(0), _fd(-1) { }
+  ~FrameExport() { close(); }
+
+  FrameExport(const FrameExport&) = delete;
+  FrameExport& operator=(const FrameExport&) = delete;
+
+  /* name is a POSIX shared memory object like "/miniature", an empty one creates an anonymous memfd on Linux */
+  bool open(const std::string& name, HostFormat format, u32 slots = 3, ScaleFilter filter = ScaleFilter::Nearest, u32 scale = 1);
+  void close();
+
+  void publish(const Machine& machine);
+
+  operator bool() const { return _header != nullptr; }
+  int fd() const { return _fd; }
+  u64 sequence() const { return _header ? _header->sequence.load(std::memory_order_relaxed) : 0; }
+};
+
+/* attaches to a region created by FrameExport in another process */
+class FrameReader
+{
+public:
+  /* tries in a row on a sequence which doesn't move before the writer is taken for stopped in the middle of a frame */
+  static constexpr u32 STALLED_ATTEMPTS = 1024;
+
+private:
+  const FrameExportHeader* _header;
+  const u8* _region;
+  size_t _size;
+
+public:
+  FrameReader() : _header(nullptr), _region(nullptr), _size(0) { }
+  ~FrameReader() { close(); }
+
+  FrameReader(const FrameReader&) = delete;
+  FrameReader& operator=(const FrameReader&) = delete;
+
+  bool open(const std::string& name);
+  void close();
+
+  const FrameExportHeader* header() const { return _header; }
+  size_t frameSize() const { return _header ? _header->slotSize : 0; }
+
+  /* copies the latest frame into dest and returns its sequence, 0 if nothing was published yet or the writer stalled */
+  u64 read(void* dest) const;
+};
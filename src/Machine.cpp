@@ -1,153 +1,891 @@
 #include "Machine.h"
-
-#define CHECK(x)
+#include "Cpu.h"
+#include "Translator.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MINIATURE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(MINIATURE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
 
 static_assert(sizeof(SpriteMap) == Specs::SPRITE_MAP_SIZE_IN_BYTES);
 static_assert(sizeof(Sprite) == Specs::SPRITE_SIZE_IN_BYTES);
 static_assert(sizeof(Palettes) == Specs::PALETTES_SIZE_IN_BYTES);
+static_assert(sizeof(TileMaps) == Specs::TILE_MAP_SIZE_IN_BYTES * Specs::TILE_MAPS_COUNT);
 
 coord_t SpriteInfo::pixelWidth() const { return Specs::SPRITE_WIDTH * ((coord_t)width + 1); }
 coord_t SpriteInfo::pixelHeight() const { return Specs::SPRITE_HEIGHT * ((coord_t)height + 1); }
 
 
 
-Screen::Screen(Machine* machine) : machine(machine), memory(&machine->memory())
+Screen::Screen(Machine* machine) : machine(machine), memory(&machine->memory()), activeSpritesCount(0),
+  linesSpritesPerLine(0), linesSpriteOrder(SpriteOrder::Index), linesOverflow(0), linesDropped(0)
 {
   static_assert((Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT) % 2 == 0);
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  /* all zeroes is a consistent state, zero indices through zeroed palettes */
+  scanout.fill(0);
+  scanoutIndices.fill(0);
+  scanoutPalettes = { };
+#endif
 }
 
 
-void Screen::set(coord_t x, coord_t y, col_t color)
+namespace
 {
-  framebuffer()[x + y * width()] = color;
+  /* fills a span and reports whether any pixel actually changed, so unchanged lines stay clean */
+  inline bool fillSpan(pix_t* begin, pix_t* end, pix_t color)
+  {
+    pix_t changed = 0;
+
+    for (pix_t* p = begin; p != end; ++p)
+    {
+      changed |= *p ^ color;
+      *p = color;
+    }
+
+    return changed;
+  }
+
+  /* sprite size in tiles as read from memory, clamped so a corrupted info can't overrun the row buffers of the rasterizer */
+  inline coord_t spriteTiles(SpriteSize size)
+  {
+    return std::clamp(coord_t(size), coord_t(0), coord_t(SpriteSize::_64));
+  }
+
+  /* narrows [first, last] to the steps from origin in the direction of step which stay within [0, size) */
+  inline void clipSteps(int64_t origin, int64_t step, int64_t size, int64_t& first, int64_t& last)
+  {
+    first = std::max(first, step > 0 ? -origin : origin - (size - 1));
+    last = std::min(last, step > 0 ? size - 1 - origin : origin);
+  }
+
+  /* steps of the minor axis of a line walk after k steps of the major one, the walk takes one when the error crosses half a pixel */
+  inline int64_t minorSteps(int64_t major, int64_t minor, int64_t k)
+  {
+    return (2 * minor * k + major) / (2 * major);
+  }
+
+  /* first step of the major axis after which the minor one has taken count steps, the inverse of minorSteps() */
+  inline int64_t majorStepReaching(int64_t major, int64_t minor, int64_t count)
+  {
+    const int64_t n = (2 * count - 1) * major, d = 2 * minor;
+    return n >= 0 ? (n + d - 1) / d : -(-n / d);
+  }
+
+  /* half width of a circle row at distance d from the center, largest x with x^2 + d^2 <= r^2 + r, -1 past the circle */
+  coord_t circleExtent(coord_t radius, coord_t d)
+  {
+    const int64_t limit = int64_t(radius) * radius + radius - int64_t(d) * d;
+    if (limit < 0)
+      return -1;
+
+    int64_t x = int64_t(std::sqrt(double(limit)));
+
+    while (x * x > limit) --x;
+    while ((x + 1) * (x + 1) <= limit) ++x;
+
+    return coord_t(x);
+  }
+
+  /* distances from the center of the circle rows which can fall on screen, rows in between are clipped by spans */
+  std::pair<coord_t, coord_t> circleRows(coord_t cy, coord_t radius, coord_t height)
+  {
+    return { std::max({ 0, -cy, cy - (height - 1) }), std::min(radius, std::max(height - 1 - cy, cy)) };
+  }
 }
 
-void Screen::clear()
+void Screen::set(coord_t x, coord_t y, pix_t color)
 {
-  fill(Color::BLACK);
+  if (u32(x) >= u32(width()) || u32(y) >= u32(height()))
+    return;
+
+  plot(x, y, color);
 }
 
-void Screen::fill(col_t color)
+void Screen::plot(coord_t x, coord_t y, pix_t color)
 {
-  std::fill(framebuffer(), framebuffer() + width() * height(), color);
+  pix_t& pixel = framebuffer()[x + y * width()];
+
+  if (pixel != color)
+  {
+    pixel = color;
+    markDirty(y);
+  }
 }
 
-void Screen::rect(coord_t x, coord_t y, coord_t w, coord_t h, col_t color)
+void Screen::clear()
 {
-  CHECK(x >= 0 && x + w < width() && y >= 0 && y + h < height());
+  fill(Specs::INDEXED_FRAMEBUFFER ? pix_t(0) : pix_t(Color::BLACK));
+}
 
-  for (auto j = y; j < y + h; ++j)
+void Screen::fill(pix_t color)
+{
+  for (coord_t y = 0; y < height(); ++y)
   {
-    auto start = framebuffer() + j * width() + x;
-    std::fill(start, start + w, color);
+    pix_t* line = framebuffer() + y * width();
+    if (fillSpan(line, line + width(), color))
+      markDirty(y);
   }
 }
 
-void Screen::line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, col_t color)
+void Screen::rect(coord_t x, coord_t y, coord_t w, coord_t h, pix_t color)
 {
-  // vertical
-  if (y0 == y1)
+  /* intersect with the screen once, spans inside are then written without checks */
+  const coord_t left = std::max(x, 0), right = std::min(x + w, width());
+  const coord_t top = std::max(y, 0), bottom = std::min(y + h, height());
+
+  if (left >= right || top >= bottom)
+    return;
+
+  for (auto j = top; j < bottom; ++j)
   {
-    if (x0 > x1) std::swap(x0, x1);
+    auto start = framebuffer() + j * width();
+    if (fillSpan(start + left, start + right, color))
+      markDirty(j);
+  }
+}
+
+void Screen::hline(coord_t x0, coord_t x1, coord_t y, pix_t color)
+{
+  if (u32(y) >= u32(height()))
+    return;
+
+  x0 = std::max(x0, 0);
+  x1 = std::min(x1, width() - 1);
+
+  if (x0 > x1)
+    return;
+
+  pix_t* row = framebuffer() + y * width();
+  if (fillSpan(row + x0, row + x1 + 1, color))
+    markDirty(y);
+}
+
+void Screen::vline(coord_t x, coord_t y0, coord_t y1, pix_t color)
+{
+  if (u32(x) >= u32(width()))
+    return;
+
+  y0 = std::max(y0, 0);
+  y1 = std::min(y1, height() - 1);
+
+  /* one pixel per row, stepping the pointer by the pitch */
+  pix_t* pixel = framebuffer() + x + y0 * width();
 
-    for (coord_t x = x0; x <= x1; ++x)
-      set(x, y0, color);
+  for (coord_t y = y0; y <= y1; ++y, pixel += width())
+  {
+    if (*pixel != color)
+    {
+      *pixel = color;
+      markDirty(y);
+    }
   }
+}
+
+void Screen::line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, pix_t color)
+{
   // horizontal
+  if (y0 == y1)
+    hline(std::min(x0, x1), std::max(x0, x1), y0, color);
+  // vertical
   else if (x0 == x1)
+    vline(x0, std::min(y0, y1), std::max(y0, y1), color);
+  else
   {
-    if (y0 > y1) std::swap(y0, y1);
+    const coord_t dx = std::abs(x1 - x0);
+    const coord_t sx = x0 < x1 ? 1 : -1;
+    const coord_t dy = -std::abs(y1 - y0);
+    const coord_t sy = y0 < y1 ? 1 : -1;
+    const bool xMajor = dx >= -dy;
+
+    /*
+      clipping keeps the walk of the whole segment and only picks the range of major steps which are on screen,
+      the minor coordinate and the error after any step have a closed form so clipped pixels are the unclipped ones
+    */
+    const int64_t major = xMajor ? dx : -dy, minor = xMajor ? -dy : dx;
+    int64_t first = 0, last = major, minorFirst = 0, minorLast = minor;
+
+    clipSteps(xMajor ? x0 : y0, xMajor ? sx : sy, xMajor ? width() : height(), first, last);
+    clipSteps(xMajor ? y0 : x0, xMajor ? sy : sx, xMajor ? height() : width(), minorFirst, minorLast);
+    first = std::max(first, majorStepReaching(major, minor, minorFirst));
+    last = std::min(last, majorStepReaching(major, minor, minorLast + 1) - 1);
+
+    if (first > last)
+      return;
+
+    const int64_t taken = minorSteps(major, minor, first);
+    x0 += coord_t(sx * (xMajor ? first : taken));
+    y0 += coord_t(sy * (xMajor ? taken : first));
+    coord_t err = coord_t(dx + dy + (xMajor ? first * dy + taken * dx : first * dx + taken * dy));
+    const coord_t steps = coord_t(last - first);
+
+    /*
+      the walk moves a pointer and runs once per pixel of the major axis, which always steps: x major lines
+      mark a row dirty once when they leave it, y major ones change row on every pixel
+    */
+    pix_t* pixel = framebuffer() + x0 + y0 * width();
+    const coord_t pitch = sy * width();
+
+    if (xMajor)
+    {
+      bool changed = false;
 
-    for (coord_t y = y0; y <= y1; ++y)
-      set(x0, y, color);
+      for (coord_t i = 0; i < steps; ++i)
+      {
+        changed |= *pixel != color;
+        *pixel = color;
+
+        const coord_t err2 = 2 * err;
+        err += dy;
+        pixel += sx;
+
+        if (err2 <= dx)
+        {
+          if (changed)
+            markDirty(y0);
+
+          changed = false;
+          err += dx;
+          y0 += sy;
+          pixel += pitch;
+        }
+      }
+
+      changed |= *pixel != color;
+      *pixel = color;
+
+      if (changed)
+        markDirty(y0);
+    }
+    else
+    {
+      for (coord_t i = steps; ; --i, y0 += sy)
+      {
+        if (*pixel != color)
+        {
+          *pixel = color;
+          markDirty(y0);
+        }
+
+        if (!i)
+          break;
+
+        const coord_t err2 = 2 * err;
+        err += dx;
+        pixel += pitch;
+
+        if (err2 >= dy)
+        {
+          err += dy;
+          pixel += sx;
+        }
+      }
+    }
   }
-  else
+}
+
+void Screen::polyline(const point_t* points, size_t count, pix_t color)
+{
+  if (count == 1)
+    set(points[0].x, points[0].y, color);
+
+  for (size_t i = 1; i < count; ++i)
+    line(points[i - 1].x, points[i - 1].y, points[i].x, points[i].y, color);
+}
+
+void Screen::triangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, pix_t color)
+{
+  line(x0, y0, x1, y1, color);
+  line(x1, y1, x2, y2, color);
+  line(x2, y2, x0, y0, color);
+}
+
+void Screen::fillTriangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, pix_t color)
+{
+  point_t a = { x0, y0 }, b = { x1, y1 }, c = { x2, y2 };
+
+  /* sorted from top to bottom, the long edge a-c spans every row and the other two share it */
+  if (a.y > b.y) std::swap(a, b);
+  if (b.y > c.y) std::swap(b, c);
+  if (a.y > b.y) std::swap(a, b);
+
+  if (a.y == c.y)
+  {
+    hline(std::min({ a.x, b.x, c.x }), std::max({ a.x, b.x, c.x }), a.y, color);
+    return;
+  }
+
+  const auto edgeX = [](const point_t& from, const point_t& to, coord_t y) {
+    return from.x + coord_t(std::lround(double(to.x - from.x) * (y - from.y) / (to.y - from.y)));
+  };
+
+  const coord_t top = std::max(a.y, 0), bottom = std::min(c.y, height() - 1);
+
+  for (coord_t y = top; y <= bottom; ++y)
   {
-    coord_t dx = std::abs(x1 - x0);
-    coord_t sx = x0 < x1 ? 1 : -1;
-    coord_t dy = -std::abs(y1 - y0);
-    coord_t sy = y0 < y1 ? 1 : -1;
-    coord_t err = dx + dy;
+    const coord_t x = edgeX(a, c, y);
+    coord_t left, right;
 
-    while (true)
+    if (y < b.y)
+      left = right = edgeX(a, b, y);
+    else if (b.y == c.y)
     {
-      set(x0, y0, color);
+      left = b.x;
+      right = c.x;
+    }
+    else
+      left = right = edgeX(b, c, y);
 
-      if (x0 == x1 && y0 == y1)
-        break;
+    hline(std::min({ x, left, right }), std::max({ x, left, right }), y, color);
+  }
+}
+
+void Screen::circle(coord_t cx, coord_t cy, coord_t radius, pix_t color)
+{
+  if (radius < 0)
+    return;
+
+  const auto rows = circleRows(cy, radius, height());
 
-      coord_t err2 = 2 * err;
+  /* no row of the circle is on screen */
+  if (rows.first > rows.second)
+    return;
 
-      if (err2 >= dy)
+  /* every row spans from its own extent to just past the extent of the next row outwards, so the outline stays connected */
+  coord_t next = circleExtent(radius, rows.first);
+
+  for (coord_t d = rows.first; d <= rows.second; ++d)
+  {
+    const coord_t outer = next;
+    next = d < radius ? circleExtent(radius, d + 1) : -1;
+    const coord_t inner = std::min(next + 1, outer);
+
+    for (coord_t y : { cy - d, cy + d })
+    {
+      if (inner == 0)
+        hline(cx - outer, cx + outer, y, color);
+      else
       {
-        err += dy;
-        x0 += sx;
+        hline(cx - outer, cx - inner, y, color);
+        hline(cx + inner, cx + outer, y, color);
       }
 
-      if (err2 <= dx)
+      if (d == 0)
+        break;
+    }
+  }
+}
+
+void Screen::fillCircle(coord_t cx, coord_t cy, coord_t radius, pix_t color)
+{
+  if (radius < 0)
+    return;
+
+  const auto rows = circleRows(cy, radius, height());
+
+  for (coord_t d = rows.first; d <= rows.second; ++d)
+  {
+    const coord_t extent = circleExtent(radius, d);
+
+    hline(cx - extent, cx + extent, cy - d, color);
+    if (d)
+      hline(cx - extent, cx + extent, cy + d, color);
+  }
+}
+
+void SpriteCache::refresh(const Sprite* sprites, DirtySprites& dirty)
+{
+  if (!dirty.any())
+    return;
+
+  for (s32 i = 0; i < SPRITE_COUNT; ++i)
+  {
+    if (!dirty.test(i))
+      continue;
+
+    Tile& tile = _tiles[i];
+    Tile& mirrored = _mirrored[i];
+
+    for (coord_t y = 0; y < Specs::SPRITE_HEIGHT; ++y)
+    {
+      const u8* packed = sprites[i].row(y);
+      u8* dest = tile.data() + y * Specs::SPRITE_WIDTH;
+      u8* mdest = mirrored.data() + y * Specs::SPRITE_WIDTH;
+
+      for (coord_t x = 0; x < Specs::SPRITE_ROW_SIZE_IN_BYTES; ++x)
       {
-        err += dx;
-        y0 += sy;
+        const u8 left = (packed[x] >> 4) & 0x0F, right = packed[x] & 0x0F;
+
+        dest[x * 2] = left;
+        dest[x * 2 + 1] = right;
+        mdest[Specs::SPRITE_WIDTH - 1 - x * 2] = left;
+        mdest[Specs::SPRITE_WIDTH - 2 - x * 2] = right;
       }
     }
   }
+
+  dirty.clear();
 }
 
-void Screen::rasterizeSprites()
+namespace
+{
+  /* maps count decoded sprite rows through a palette, placing them one after the other in dest */
+  using expand_t = void(*)(const u8* const* rows, coord_t count, const Palette& palette, col_t* dest);
+
+  void expandSpriteRowsScalar(const u8* const* rows, coord_t count, const Palette& palette, col_t* dest)
+  {
+    for (coord_t t = 0; t < count; ++t, dest += Specs::SPRITE_WIDTH)
+      for (coord_t x = 0; x < Specs::SPRITE_WIDTH; ++x)
+        dest[x] = palette[rows[t][x]];
+  }
+
+#if defined(MINIATURE_X86)
+  /* a palette fits a single register once split in low and high bytes, pshufb then looks up 8 pixels at once */
+  TARGET("ssse3") void expandSpriteRowsSSSE3(const u8* const* rows, coord_t count, const Palette& palette, col_t* dest)
+  {
+    static_assert(Specs::PALETTE_SIZE == 16 && Specs::SPRITE_WIDTH == 8);
+
+    const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette.data()));
+    const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette.data() + 8));
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const __m128i lo = _mm_packus_epi16(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    const __m128i hi = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+
+    for (coord_t t = 0; t < count; ++t, dest += Specs::SPRITE_WIDTH)
+    {
+      const __m128i indices = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[t]));
+      const __m128i colors = _mm_unpacklo_epi8(_mm_shuffle_epi8(lo, indices), _mm_shuffle_epi8(hi, indices));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), colors);
+    }
+  }
+
+  bool hasSSSE3()
+  {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return info[2] & (1 << 9);
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+  }
+#endif
+
+  expand_t selectExpandSpriteRows()
+  {
+#if defined(MINIATURE_X86)
+    if (hasSSSE3())
+      return expandSpriteRowsSSSE3;
+#endif
+    return expandSpriteRowsScalar;
+  }
+
+  const expand_t expandSpriteRows = selectExpandSpriteRows();
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  /* indexed pixels only need the palette number merged into the decoded color indices, a whole tile row at a time */
+  void indexSpriteRows(const u8* const* rows, coord_t count, u8 palette, pix_t* dest)
+  {
+    static_assert(Specs::SPRITE_WIDTH == sizeof(u64));
+    const u64 base = u64(Color::indexed(palette, 0)) * 0x0101010101010101ULL;
+
+    for (coord_t t = 0; t < count; ++t, dest += Specs::SPRITE_WIDTH)
+    {
+      u64 row;
+      std::memcpy(&row, rows[t], sizeof(row));
+      row |= base;
+      std::memcpy(dest, &row, sizeof(row));
+    }
+  }
+#endif
+
+  /* decoded rows as framebuffer pixels, colors of the palette or indices into it */
+  inline void expandRows(const u8* const* rows, coord_t count, const Palettes& palettes, u8 palette, pix_t* dest)
+  {
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+    (void)palettes;
+    indexSpriteRows(rows, count, palette, dest);
+#else
+    expandSpriteRows(rows, count, palettes[palette], dest);
+#endif
+  }
+
+  /* copies the opaque pixels of an expanded row over a line, reports whether the line changed */
+  using composite_t = bool(*)(const pix_t* src, pix_t* dest, coord_t count, const Palette& palette);
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  /* opacity comes from the palette entry, so it's looked up as a byte mask and then blended without branches */
+  bool compositeScalar(const pix_t* src, pix_t* dest, coord_t count, const Palette& palette)
+  {
+    std::array<u8, Specs::PALETTE_SIZE> masks;
+    for (coord_t i = 0; i < Specs::PALETTE_SIZE; ++i)
+      masks[i] = Color::isOpaque(palette[i]) ? 0xFF : 0x00;
+
+    pix_t changed = 0;
+    for (coord_t x = 0; x < count; ++x)
+    {
+      const pix_t mask = masks[src[x] & (Specs::PALETTE_SIZE - 1)];
+      const pix_t pixel = (src[x] & mask) | (dest[x] & ~mask);
+      changed |= pixel ^ dest[x];
+      dest[x] = pixel;
+    }
+
+    return changed;
+  }
+
+#if defined(MINIATURE_X86)
+  /* the 16 masks fit a register, so pshufb resolves the opacity of 16 pixels at once and 8 for the tail */
+  TARGET("ssse3") bool compositeSSSE3(const pix_t* src, pix_t* dest, coord_t count, const Palette& palette)
+  {
+    static_assert(Specs::PALETTE_SIZE == 16);
+
+    const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette.data()));
+    const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette.data() + 8));
+    const __m128i opaque = _mm_set1_epi16(s16(Color::OPAQUE_FLAG));
+    const __m128i masks = _mm_packs_epi16(_mm_cmpeq_epi16(_mm_and_si128(p0, opaque), opaque), _mm_cmpeq_epi16(_mm_and_si128(p1, opaque), opaque));
+    const __m128i low = _mm_set1_epi8(Specs::PALETTE_SIZE - 1);
+
+    __m128i changed = _mm_setzero_si128();
+    coord_t x = 0;
+
+    for (; x + 16 <= count; x += 16)
+    {
+      const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+      const __m128i out = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + x));
+      const __m128i mask = _mm_shuffle_epi8(masks, _mm_and_si128(in, low));
+      const __m128i pixels = _mm_or_si128(_mm_and_si128(mask, in), _mm_andnot_si128(mask, out));
+      changed = _mm_or_si128(changed, _mm_xor_si128(pixels, out));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), pixels);
+    }
+
+    for (; x + 8 <= count; x += 8)
+    {
+      const __m128i in = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x));
+      const __m128i out = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(dest + x));
+      const __m128i mask = _mm_shuffle_epi8(masks, _mm_and_si128(in, low));
+      const __m128i pixels = _mm_or_si128(_mm_and_si128(mask, in), _mm_andnot_si128(mask, out));
+      changed = _mm_or_si128(changed, _mm_xor_si128(pixels, out));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + x), pixels);
+    }
+
+    const bool tail = x < count && compositeScalar(src + x, dest + x, count - x, palette);
+    return tail || _mm_movemask_epi8(_mm_cmpeq_epi8(changed, _mm_setzero_si128())) != 0xFFFF;
+  }
+#endif
+
+  composite_t selectComposite()
+  {
+#if defined(MINIATURE_X86)
+    if (hasSSSE3())
+      return compositeSSSE3;
+#endif
+    return compositeScalar;
+  }
+
+  const composite_t composite = selectComposite();
+#else
+  bool compositeScalar(const pix_t* src, pix_t* dest, coord_t count, const Palette&)
+  {
+    pix_t changed = 0;
+    for (coord_t x = 0; x < count; ++x)
+    {
+      const pix_t pixel = Color::isOpaque(src[x]) ? src[x] : dest[x];
+      changed |= pixel ^ dest[x];
+      dest[x] = pixel;
+    }
+
+    return changed;
+  }
+
+  const composite_t composite = compositeScalar;
+#endif
+}
+
+void Screen::refreshSpriteCache()
 {
-  /* for each sprite */
+  spriteCache.refresh(state().sprites().data(), memory->dirtySprites());
+}
+
+bool Screen::isVisible(const SpriteInfo& info) const
+{
+  if (!(info.flags && SpriteFlag::Enabled))
+    return false;
+
+  /* tile rows are walked on width and tile columns on height, as the per-pixel renderer always did */
+  const coord_t ww = spriteTiles(info.width), hh = spriteTiles(info.height);
+
+  return info.x < width() && info.x + hh * Specs::SPRITE_WIDTH > 0 &&
+    info.y < height() && info.y + ww * Specs::SPRITE_HEIGHT > 0;
+}
+
+void Screen::updateActiveSprites()
+{
+  DirtySpriteInfos& dirty = memory->dirtySpriteInfos();
+
+  for (s32 i = 0; i < Specs::SPRITE_INFO_SIZE; ++i)
+    if (dirty.test(i))
+      visibleSprites.set(i, isVisible(state().spriteInfos()[i]));
+
+  dirty.clear();
+
+  activeSpritesCount = 0;
   for (s32 i = 0; i < Specs::SPRITE_INFO_SIZE; ++i)
+    if (visibleSprites.test(i))
+      activeSprites[activeSpritesCount++] = u8(i);
+}
+
+void Screen::buildSpriteLines()
+{
+  const SpriteInfos& infos = state().spriteInfos();
+  const bool byPriority = linesSpriteOrder == SpriteOrder::Priority;
+  const s32 limit = linesSpritesPerLine ? linesSpritesPerLine : Specs::SPRITE_INFO_SIZE;
+
+  for (auto& line : spriteLines)
+  {
+    line.count = 0;
+    line.overflow = false;
+  }
+
+  /* sprites claim line slots in this order, lowest index first or highest priority first */
+  std::array<u8, Specs::SPRITE_INFO_SIZE> order;
+  std::copy(activeSprites.begin(), activeSprites.begin() + activeSpritesCount, order.begin());
+  if (byPriority)
+    std::stable_sort(order.begin(), order.begin() + activeSpritesCount, [&infos](u8 a, u8 b) { return infos[a].priority > infos[b].priority; });
+
+  linesOverflow = 0;
+  linesDropped = 0;
+
+  for (s32 a = 0; a < activeSpritesCount; ++a)
   {
-    const SpriteInfo& info = machine->spriteInfos()[i];
-    const bool flippedY = info.flags && SpriteFlag::FlippedY;
-    const bool flippedX = info.flags && SpriteFlag::FlippedX;
+    const u8 i = order[a];
+    const SpriteInfo& info = infos[i];
+    const coord_t ww = spriteTiles(info.width);
 
-    const coord_t ww = coord_t(info.width), hh = coord_t(info.height);
+    const coord_t top = std::max(coord_t(info.y), 0);
+    const coord_t bottom = std::min(coord_t(info.y) + ww * Specs::SPRITE_HEIGHT, height());
 
-    /* if sprite should be drawn */
-    if (info.flags && SpriteFlag::Enabled)
+    for (coord_t y = top; y < bottom; ++y)
     {
-      Palette& palette = machine->palettes()[info.palette];
+      SpriteLine& line = spriteLines[y];
 
-      /* handle multi-tile sprites */
-      for (coord_t ty = 0; ty < ww; ++ty)
+      if (line.count < limit)
+        line.sprites[line.count++] = i;
+      else
       {
-        for (coord_t tx = 0; tx < hh; ++tx)
-        {
-          coord_t iy = flippedX ? (hh - 1 - ty) : ty;
-          coord_t ix = flippedY ? (ww - 1 - tx) : tx;
+        linesOverflow += !line.overflow;
+        line.overflow = true;
+        ++linesDropped;
+      }
+    }
+  }
 
-          Sprite sprite = machine->sprites()[info.index + ix + iy * Specs::SPRITE_MAP_WIDTH];
+  /* the sprites kept on a line are then drawn from lowest to highest priority */
+  if (byPriority)
+  {
+    for (auto& line : spriteLines)
+      std::sort(line.sprites.begin(), line.sprites.begin() + line.count, [&infos](u8 a, u8 b) {
+        return infos[a].priority != infos[b].priority ? infos[a].priority < infos[b].priority : a < b;
+      });
+  }
+}
 
-          /* draw it on framebuffer */
-          for (int y = 0; y < Specs::SPRITE_HEIGHT; ++y)
-            for (int x = 0; x < Specs::SPRITE_WIDTH; ++x)
-            {
-              auto fx = info.x + x + tx * Specs::SPRITE_WIDTH, fy = info.y + y + ty * Specs::SPRITE_HEIGHT;
+bool Screen::rasterizeSpriteRow(const SpriteInfo& info, coord_t y, pix_t* line)
+{
+  const bool flippedY = info.flags && SpriteFlag::FlippedY;
+  const bool flippedX = info.flags && SpriteFlag::FlippedX;
 
-              coord_t sy = flippedX ? (Specs::SPRITE_HEIGHT - 1 - y) : y;
-              coord_t sx = flippedY ? (Specs::SPRITE_WIDTH - 1 - x) : x;
+  /* tile rows are walked on width and tile columns on height, see isVisible(), so flips mirror within those counts */
+  const coord_t ww = spriteTiles(info.width), hh = spriteTiles(info.height);
 
-              col_idx_t c = sprite.get(sx, sy);
-              //TODO: range check?
+  const coord_t py = y - info.y;
+  const coord_t ty = py / Specs::SPRITE_HEIGHT;
+  const coord_t iy = flippedX ? (ww - 1 - ty) : ty;
+  const coord_t sy = flippedX ? (Specs::SPRITE_HEIGHT - 1 - py % Specs::SPRITE_HEIGHT) : py % Specs::SPRITE_HEIGHT;
 
-              col_t color = palette[c];
+  const u8 palette = info.palette % Specs::PALETTE_COUNT;
+  const s32 base = info.index + iy * Specs::SPRITE_MAP_WIDTH;
 
-              if (Color::isOpaque(color))
-                set(fx, fy, color);
-            }
-        }
-      }
+  /* fetch the whole sprite row, flipping is resolved here and not per pixel */
+  std::array<const u8*, (coord_t)SpriteSize::_64> tiles;
+  for (coord_t tx = 0; tx < hh; ++tx)
+  {
+    const coord_t ix = flippedY ? (hh - 1 - tx) : tx;
+    tiles[tx] = spriteCache.row(base + ix, sy, flippedY);
+  }
+
+  std::array<pix_t, Specs::SPRITE_WIDTH * (coord_t)SpriteSize::_64> row;
+  expandRows(tiles.data(), hh, state().palettes(), palette, row.data());
+
+  /* info lives in the same memory as the framebuffer, keep its position out of the loop */
+  const coord_t x0 = info.x;
+  const coord_t begin = std::max(0, -x0);
+  const coord_t end = std::min(hh * Specs::SPRITE_WIDTH, width() - x0);
+
+  return begin < end && composite(row.data() + begin, line + x0 + begin, end - begin, state().palettes()[palette]);
+}
+
+void Screen::rasterizeSprites()
+{
+  ProfileScope scope(Profiler::Stage::Sprites);
+
+  refreshSpriteCache();
+
+  VideoRegisters& registers = machine->videoRegisters();
 
+  /* positions, sizes and flags are all in the infos, untouched infos and registers leave every list valid */
+  const bool infosChanged = memory->dirtySpriteInfos().any();
+  if (infosChanged)
+    updateActiveSprites();
+
+  if (infosChanged || registers.spritesPerLine != linesSpritesPerLine || registers.spriteOrder != linesSpriteOrder)
+  {
+    linesSpritesPerLine = registers.spritesPerLine;
+    linesSpriteOrder = registers.spriteOrder;
+    buildSpriteLines();
+  }
+
+  registers.overflowLines = linesOverflow;
+  registers.droppedSprites = linesDropped;
+
+  /* sprites are composited line by line in the order of their lists, so later sprites still win */
+  for (coord_t y = 0; y < height(); ++y)
+  {
+    const SpriteLine& sprites = spriteLines[y];
+    pix_t* line = framebuffer() + y * width();
+
+    bool changed = false;
+    for (u8 i = 0; i < sprites.count; ++i)
+      changed |= rasterizeSpriteRow(state().spriteInfos()[sprites.sprites[i]], y, line);
+
+    if (changed)
+      markDirty(y);
+  }
+}
 
+
+bool Screen::rasterizeTileMapRow(const TileMapInfo& info, const TileMap& map, coord_t y, pix_t* line)
+{
+  constexpr coord_t PIXEL_WIDTH = Specs::TILE_MAP_WIDTH * Specs::SPRITE_WIDTH;
+  constexpr coord_t PIXEL_HEIGHT = Specs::TILE_MAP_HEIGHT * Specs::SPRITE_HEIGHT;
+  constexpr coord_t TILES_PER_LINE = Specs::SCREEN_WIDTH / Specs::SPRITE_WIDTH + 1;
+
+  const coord_t my = (y + info.y) & (PIXEL_HEIGHT - 1);
+  const coord_t mx = info.x & (PIXEL_WIDTH - 1);
+
+  const u8* indices = map.data() + (my / Specs::SPRITE_HEIGHT) * Specs::TILE_MAP_WIDTH;
+  const coord_t sy = my % Specs::SPRITE_HEIGHT;
+  const coord_t firstTile = mx / Specs::SPRITE_WIDTH;
+  const coord_t fineX = mx % Specs::SPRITE_WIDTH;
+
+  const u8 palette = info.palette % Specs::PALETTE_COUNT;
+  const s32 base = (info.spriteMap % Specs::SPRITE_MAPS_COUNT) * Specs::SPRITE_MAP_SIZE;
+
+  /* decode the whole row of tiles covering the line, one more than the screen fits for fine scrolling */
+  std::array<const u8*, TILES_PER_LINE> tiles;
+  for (coord_t t = 0; t < TILES_PER_LINE; ++t)
+    tiles[t] = spriteCache.row(base + indices[(firstTile + t) & (Specs::TILE_MAP_WIDTH - 1)], sy, false);
+
+  std::array<pix_t, TILES_PER_LINE * Specs::SPRITE_WIDTH> row;
+  expandRows(tiles.data(), TILES_PER_LINE, state().palettes(), palette, row.data());
+
+  return composite(row.data() + fineX, line, width(), state().palettes()[palette]);
+}
+
+void Screen::rasterizeTileMap(s32 index)
+{
+  ProfileScope scope(Profiler::Stage::TileMaps);
+
+  refreshSpriteCache();
+
+  const TileMapInfo& info = state().tileMapInfos()[index];
+  const TileMap& map = state().tileMaps()[index];
+
+  for (coord_t y = 0; y < height(); ++y)
+  {
+    if (rasterizeTileMapRow(info, map, y, framebuffer() + y * width()))
+      markDirty(y);
+  }
+}
+
+void Screen::scanOut()
+{
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  const Palettes& palettes = state().palettes();
+  const bool recolored = palettes != scanoutPalettes;
+
+  if (recolored)
+    scanoutPalettes = palettes;
+
+  /* palettes are contiguous, so an indexed pixel is directly the position of its color among all of them */
+  std::array<col_t, Specs::PALETTE_COUNT * Specs::PALETTE_SIZE> colors;
+  std::memcpy(colors.data(), scanoutPalettes.data(), sizeof(colors));
+
+  for (coord_t y = 0; y < height(); ++y)
+  {
+    const pix_t* src = framebuffer() + y * width();
+    pix_t* resolved = scanoutIndices.data() + y * width();
+
+    if (!recolored && std::memcmp(src, resolved, width() * sizeof(pix_t)) == 0)
+      continue;
+
+    std::memcpy(resolved, src, width() * sizeof(pix_t));
+
+    /* four indices are read at once, the local table can't alias the output */
+    static_assert(Specs::SCREEN_WIDTH % 4 == 0);
+    col_t* dest = scanout.data() + y * width();
+    for (coord_t x = 0; x < width(); x += 4)
+    {
+      u32 indices;
+      std::memcpy(&indices, resolved + x, sizeof(indices));
+
+      dest[x] = colors[indices & 0xFF];
+      dest[x + 1] = colors[(indices >> 8) & 0xFF];
+      dest[x + 2] = colors[(indices >> 16) & 0xFF];
+      dest[x + 3] = colors[indices >> 24];
     }
   }
+#endif
+}
+
+void Screen::rasterize()
+{
+  const TileMapInfos& infos = state().tileMapInfos();
+
+  for (s32 i = 0; i < Specs::TILE_MAPS_COUNT; ++i)
+    if ((infos[i].flags && TileMapFlag::Enabled) && !(infos[i].flags && TileMapFlag::Foreground))
+      rasterizeTileMap(i);
 
+  rasterizeSprites();
+
+  for (s32 i = 0; i < Specs::TILE_MAPS_COUNT; ++i)
+    if ((infos[i].flags && TileMapFlag::Enabled) && (infos[i].flags && TileMapFlag::Foreground))
+      rasterizeTileMap(i);
 }
 
 
+Machine::Machine() : _screen(this), _frames(0), _snapshot(0)
+{
 
-Machine::Machine() : _screen(this)
+}
+
+Machine::~Machine()
 {
 
 }
@@ -155,4 +893,122 @@ Machine::Machine() : _screen(this)
 void Machine::reset()
 {
   _memory.clear();
-}
\ No newline at end of file
+  videoRegisters().spritesPerLine = Specs::SPRITES_PER_LINE;
+  sound().volume = Specs::SOUND_VOLUME;
+  cpu().budget = Specs::CPU_CYCLES_PER_FRAME;
+  _frames = 0;
+}
+
+bool Machine::load(const u32* code, size_t count)
+{
+  if (count > size_t(Specs::CODE_SIZE_IN_INSTRUCTIONS))
+  {
+    printf("Program of %zu instructions doesn't fit in %d.\n", count, Specs::CODE_SIZE_IN_INSTRUCTIONS);
+    return false;
+  }
+
+  _memory.write(Address::CODE, code, addr_t(count * sizeof(u32)));
+
+  if (_translator)
+    _translator->flush();
+
+  CpuRegisters& registers = cpu();
+  const u32 budget = registers.budget;
+  registers = CpuRegisters();
+  registers.sp = Address::CPU_REGISTERS;
+  registers.budget = budget;
+  registers.status = CpuStatus::Running;
+
+  return true;
+}
+
+void Machine::frame()
+{
+  /* programs run before the frame is rasterized, so what they change shows up in the same frame */
+  if (static_cast<const Machine&>(*this).cpu().status == CpuStatus::Running)
+  {
+    ProfileScope scope(Profiler::Stage::Program);
+    CpuRegisters& registers = cpu();
+    registers.cycles = _translator ? _translator->run(*this, registers.budget) : Cpu::run(*this, registers.budget);
+  }
+
+  _screen.rasterize();
+  _screen.scanOut();
+  ++_frames;
+
+  /* references handed out until now can't be written anymore, the frame dropped its own */
+  _memory.framePages().clear();
+}
+
+void Machine::setTranslation(bool enabled)
+{
+  if (!enabled)
+    _translator.reset();
+  else if (!_translator)
+    _translator = std::make_unique<Translator>();
+}
+
+Snapshot Machine::snapshot(const Snapshot* base)
+{
+  static std::atomic<u64> nextId(1);
+
+  Snapshot snapshot;
+  snapshot._frames = _frames;
+  snapshot._id = nextId++;
+
+  const Memory& memory = _memory;
+  DirtyPages& dirty = _memory.dirtyPages();
+  const bool shared = base && *base && base->_id == _snapshot;
+
+  for (size_t i = 0; i < Specs::SNAPSHOT_PAGE_COUNT; ++i)
+  {
+    const u8* data = memory.addr<u8>(addr_t(i * Specs::SNAPSHOT_PAGE_SIZE));
+
+    if (shared && !dirty.test(i))
+    {
+      /* a clean page which changed was written through a reference kept across a frame */
+      assert(std::memcmp(base->_pages[i]->data(), data, Specs::SNAPSHOT_PAGE_SIZE) == 0);
+      snapshot._pages[i] = base->_pages[i];
+    }
+    else
+    {
+      auto page = std::make_shared<Snapshot::Page>();
+      std::memcpy(page->data(), data, Specs::SNAPSHOT_PAGE_SIZE);
+      snapshot._pages[i] = std::move(page);
+    }
+  }
+
+  dirty = _memory.framePages();
+  _snapshot = snapshot._id;
+  return snapshot;
+}
+
+void Machine::restore(const Snapshot& snapshot)
+{
+  assert(snapshot);
+
+  u8* data = _memory.direct<u8>(0);
+
+  for (size_t i = 0; i < Specs::SNAPSHOT_PAGE_COUNT; ++i)
+    std::memcpy(data + i * Specs::SNAPSHOT_PAGE_SIZE, snapshot._pages[i]->data(), Specs::SNAPSHOT_PAGE_SIZE);
+
+  _memory.markAllConsumers();
+
+  /* the displayed frame is not part of memory, an indexed one is resolved again from the restored state */
+  _screen.scanOut();
+  _frames = snapshot._frames;
+
+  /* memory is now exactly the snapshot, which becomes the base of the next one, but for references still held */
+  _memory.dirtyPages() = _memory.framePages();
+  _snapshot = snapshot._id;
+}
+
+size_t Snapshot::pagesNotSharedWith(const Snapshot& other) const
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < Specs::SNAPSHOT_PAGE_COUNT; ++i)
+    count += _pages[i] != other._pages[i];
+
+  return count;
+}
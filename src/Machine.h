@@ -4,6 +4,11 @@
 
 #include "FlagSet.h"
 
+#include <algorithm>
+#include <bitset>
+#include <memory>
+#include <new>
+
 static constexpr s32 KB1 = 1024;
 static constexpr s32 KB64 = 1 << 16;
 static constexpr s32 KB128 = 1 << 17;
@@ -14,6 +19,17 @@ using col_t = u16;
 using col_idx_t = u32;
 using col_idx_pair_t = u32;
 
+/*
+  Pixels as stored in VRAM. Built with MINIATURE_INDEXED_FRAMEBUFFER every pixel is a palette number and a
+  color index packed in one byte, colors are then looked up only once per frame at scan-out so that changing
+  a palette recolors what was already drawn. Otherwise pixels are colors resolved when they are drawn.
+*/
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+using pix_t = u8;
+#else
+using pix_t = col_t;
+#endif
+
 enum class SpriteFlag : u32
 {
   Enabled  = 0x00000001,
@@ -29,6 +45,7 @@ struct SpriteInfo
   s16 x, y;
   u8 index;
   u8 palette; // : 4
+  u8 priority; // higher is drawn over lower and kept first on full lines, in SpriteOrder::Priority only
 
   SpriteSize width;
   SpriteSize height;
@@ -37,9 +54,121 @@ struct SpriteInfo
   coord_t pixelHeight() const;
 };
 
+enum class TileMapFlag : u8
+{
+  Enabled    = 0x01,
+  Foreground = 0x02, // drawn over sprites instead of under them
+};
+
 struct TileMapInfo
 {
-  s16 x, y;
+  flag_set<TileMapFlag> flags;
+  u8 palette;
+  u8 spriteMap; // which sprite map tiles are fetched from
+  s16 x, y; // scroll offset, wraps around the map
+};
+
+enum class SpriteOrder : u8
+{
+  Index    = 0x00, // later indices are drawn over earlier ones, earlier ones are kept on full lines
+  Priority = 0x01, // ordered by SpriteInfo::priority and then by index
+};
+
+/* registers configuring the sprite engine, counters are written back by the machine after every frame */
+struct VideoRegisters
+{
+  u8 spritesPerLine; // 0 means no limit
+  SpriteOrder spriteOrder;
+  u16 overflowLines; // lines which had more sprites than spritesPerLine in the last frame
+  u16 droppedSprites; // sprite rows skipped because of the limit in the last frame
+};
+
+enum class Button : u16
+{
+  Up     = 0x0001,
+  Down   = 0x0002,
+  Left   = 0x0004,
+  Right  = 0x0008,
+  A      = 0x0010,
+  B      = 0x0020,
+  Start  = 0x0040,
+  Select = 0x0080,
+};
+
+/* input sampled by the host before every frame, programs only read it */
+struct InputState
+{
+  flag_set<Button> buttons;
+  s16 mouseX, mouseY; // in screen pixels, negative when outside of it
+  u8 mouseButtons; // bit 0 left, 1 right, 2 middle
+  u8 padding;
+
+  bool operator==(const InputState& other) const
+  {
+    return buttons == other.buttons && mouseX == other.mouseX && mouseY == other.mouseY && mouseButtons == other.mouseButtons;
+  }
+  bool operator!=(const InputState& other) const { return !(*this == other); }
+};
+
+/* every channel has a fixed generator, channels are stored in this order */
+enum class SoundChannelType : u8
+{
+  Square,
+  Triangle,
+  Noise,
+  Wave,
+
+  Count
+};
+
+struct SoundChannel
+{
+  u16 frequency; // in Hz, whole periods for tones, shift register steps for noise, 0 silences the channel
+  u8 volume; // 0 to 15
+  u8 duty; // eighths of the period spent high for square, 0 is half, short noise sequence when not 0
+};
+
+/* registers of the sound chip, read once for every frame of audio synthesized */
+struct SoundRegisters
+{
+  std::array<SoundChannel, size_t(SoundChannelType::Count)> channels;
+  std::array<u8, 16> wave; // 4 bit samples of the wave channel, the first one in the high nibble
+  u8 volume; // master volume from 0 to 15
+  u8 padding[3];
+
+  SoundChannel& channel(SoundChannelType type) { return channels[size_t(type)]; }
+  const SoundChannel& channel(SoundChannelType type) const { return channels[size_t(type)]; }
+};
+
+enum class CpuStatus : u8
+{
+  Halted  = 0x00, // nothing loaded or the program executed Halt
+  Running = 0x01,
+  Fault   = 0x02, // stopped by an error, pc is left past the instruction which raised it
+};
+
+enum class CpuFault : u8
+{
+  None,
+  InvalidOpcode,
+  DivideByZero,
+  StackOverflow, // too many nested calls, a return with the call depth past the call stack, or pushes down into the code
+  StackUnderflow, // return without call, or pop with the data stack empty
+};
+
+/* state of the program processor, kept in memory so that snapshots, rewind and replays cover programs too */
+struct CpuRegisters
+{
+  std::array<s32, 16> r;
+  u32 pc; // index of the next instruction in the code region
+  u32 sp; // address of the last value pushed, the data stack grows downwards from Address::CPU_REGISTERS to Address::RAM
+  u32 budget; // cycles granted every frame, a program which runs out resumes where it stopped on the next one
+  u32 cycles; // cycles spent in the last frame
+  CpuStatus status;
+  CpuFault fault;
+  u8 depth; // calls in progress
+  u8 padding;
+  std::array<u16, 32> calls; // return addresses as instruction indices
 };
 
 struct Specs
@@ -63,15 +192,43 @@ struct Specs
   static constexpr s32 TILE_MAP_HEIGHT = 32;
   static constexpr s32 TILE_MAPS_COUNT = 2;
   static constexpr s32 TILE_MAP_SIZE_IN_BYTES = TILE_MAP_WIDTH * TILE_MAP_HEIGHT;
+  static constexpr s32 TILE_MAP_INFOS_SIZE_IN_BYTES = TILE_MAPS_COUNT * sizeof(TileMapInfo);
 
   static constexpr s32 SPRITE_INFO_SIZE = 128;
   static constexpr s32 SPRITE_INFO_SIZE_IN_BYTES = sizeof(SpriteInfo);
   static constexpr s32 SPRITE_INFOS_SIZE_IN_BYTES = SPRITE_INFO_SIZE * SPRITE_INFO_SIZE_IN_BYTES;
+  /* sprite budget of every scanline written on reset, 0 keeps lines unlimited */
+  static constexpr s32 SPRITES_PER_LINE = 0;
+
+  static constexpr s32 VIDEO_REGISTERS_SIZE_IN_BYTES = sizeof(VideoRegisters);
+  static constexpr s32 INPUT_SIZE_IN_BYTES = sizeof(InputState);
+
+  /* audio is synthesized a frame at a time, the sample rate is chosen to divide evenly into frames */
+  static constexpr s32 FRAMES_PER_SECOND = 60;
+  static constexpr s32 SOUND_SAMPLE_RATE = 48000;
+  static constexpr s32 SOUND_SAMPLES_PER_FRAME = SOUND_SAMPLE_RATE / FRAMES_PER_SECOND;
+  static constexpr s32 SOUND_WAVE_SAMPLES = std::tuple_size<decltype(SoundRegisters::wave)>::value * 2;
+  static constexpr s32 SOUND_REGISTERS_SIZE_IN_BYTES = sizeof(SoundRegisters);
+  /* master volume written on reset */
+  static constexpr u8 SOUND_VOLUME = 15;
+
+  /* programs start at address 0, every instruction is 32 bits */
+  static constexpr s32 CODE_SIZE_IN_BYTES = 32 * KB1;
+  static constexpr s32 CODE_SIZE_IN_INSTRUCTIONS = CODE_SIZE_IN_BYTES / sizeof(u32);
+  /* granularity at which writes to the code region are tracked */
+  static constexpr s32 CODE_PAGE_SIZE_IN_BYTES = KB1;
+  static constexpr s32 CODE_PAGE_COUNT = CODE_SIZE_IN_BYTES / CODE_PAGE_SIZE_IN_BYTES;
+  static constexpr s32 CPU_REGISTERS_SIZE_IN_BYTES = sizeof(CpuRegisters);
+  static constexpr s32 CPU_REGISTER_COUNT = std::tuple_size<decltype(CpuRegisters::r)>::value;
+  static constexpr s32 CPU_CALL_DEPTH = std::tuple_size<decltype(CpuRegisters::calls)>::value;
+  /* cycle budget of every frame written on reset */
+  static constexpr u32 CPU_CYCLES_PER_FRAME = 1 << 16;
 
   static constexpr s32 BITS_PER_SPRITE_COLOR = 4;
   static constexpr s32 BITS_PER_SPRITE_PALETTE = 4;
 
-  static constexpr s32 FRAMEBUFFER_SIZE_IN_BYTES = SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(col_t);
+  static constexpr bool INDEXED_FRAMEBUFFER = sizeof(pix_t) == sizeof(u8);
+  static constexpr s32 FRAMEBUFFER_SIZE_IN_BYTES = SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(pix_t);
   static constexpr s32 PALETTES_SIZE_IN_BYTES = PALETTE_SIZE * PALETTE_COUNT * sizeof(col_t);
   static constexpr s32 SPRITE_ROW_SIZE_IN_BYTES = SPRITE_WIDTH * (BITS_PER_SPRITE_COLOR / 8.0f);
   static constexpr s32 SPRITE_SIZE_IN_BYTES = SPRITE_HEIGHT * SPRITE_ROW_SIZE_IN_BYTES;
@@ -81,10 +238,18 @@ struct Specs
   static constexpr s32 GREEN_SHIFT = BITS_PER_COLOR_COMPONENT * 1;
   static constexpr s32 BLUE_SHIFT = 0;
 
+  static constexpr addr_t SNAPSHOT_PAGE_SIZE = 4 * KB1;
+  static constexpr addr_t SNAPSHOT_PAGE_COUNT = MEMORY_SIZE / SNAPSHOT_PAGE_SIZE;
+
   static constexpr s32 COLOR_MASK = (1 << BITS_PER_COLOR_COMPONENT) - 1;
   static constexpr s32 COLOR_SHIFT = 8 - BITS_PER_COLOR_COMPONENT;
   
   static_assert(BITS_PER_COLOR_COMPONENT * 3 <= sizeof(col_t) * 8);
+  static_assert(!INDEXED_FRAMEBUFFER || (1 << (BITS_PER_SPRITE_PALETTE + BITS_PER_SPRITE_COLOR)) == PALETTE_COUNT * PALETTE_SIZE, "an indexed pixel addresses every palette entry");
+  static_assert(MEMORY_SIZE % SNAPSHOT_PAGE_SIZE == 0);
+  static_assert((MEMORY_SIZE & (MEMORY_SIZE - 1)) == 0 && (CODE_SIZE_IN_INSTRUCTIONS & (CODE_SIZE_IN_INSTRUCTIONS - 1)) == 0, "program addresses wrap around by masking");
+  static_assert((CPU_REGISTER_COUNT & (CPU_REGISTER_COUNT - 1)) == 0, "register operands are masked");
+  static_assert((TILE_MAP_WIDTH & (TILE_MAP_WIDTH - 1)) == 0 && (TILE_MAP_HEIGHT & (TILE_MAP_HEIGHT - 1)) == 0, "tile map wraparound relies on power of two sizes");
 };
 
 struct Address
@@ -94,7 +259,17 @@ struct Address
   static constexpr addr_t SPRITE_INFOS = PALETTES - Specs::SPRITE_INFOS_SIZE_IN_BYTES;
   static constexpr addr_t SPRITE_MAP = SPRITE_INFOS - Specs::SPRITE_MAP_SIZE_IN_BYTES * Specs::SPRITE_MAPS_COUNT;
   static constexpr addr_t TILE_MAP = SPRITE_MAP - Specs::TILE_MAP_SIZE_IN_BYTES * Specs::TILE_MAPS_COUNT;
+  static constexpr addr_t TILE_MAP_INFOS = TILE_MAP - Specs::TILE_MAP_INFOS_SIZE_IN_BYTES;
+  static constexpr addr_t VIDEO_REGISTERS = TILE_MAP_INFOS - Specs::VIDEO_REGISTERS_SIZE_IN_BYTES;
+  static constexpr addr_t INPUT = VIDEO_REGISTERS - Specs::INPUT_SIZE_IN_BYTES;
+  static constexpr addr_t SOUND_REGISTERS = INPUT - Specs::SOUND_REGISTERS_SIZE_IN_BYTES;
+  static constexpr addr_t CPU_REGISTERS = (SOUND_REGISTERS - Specs::CPU_REGISTERS_SIZE_IN_BYTES) & ~addr_t(sizeof(u32) - 1);
+
+  /* code at the bottom, the rest up to the cpu registers is free for data and the stack */
+  static constexpr addr_t CODE = 0;
+  static constexpr addr_t RAM = CODE + Specs::CODE_SIZE_IN_BYTES;
 
+  static_assert(RAM < CPU_REGISTERS);
 };
 
 struct Color
@@ -108,21 +283,32 @@ struct Color
   static constexpr bool isOpaque(col_t c) { return c & OPAQUE_FLAG; }
   static constexpr bool isTransparent(col_t c) { return !isOpaque(c); }
 
+  /* framebuffer value of an entry of a palette with an indexed framebuffer */
+  static constexpr u8 indexed(u8 palette, u8 index) { return u8(palette << Specs::BITS_PER_SPRITE_COLOR | index); }
+
+  /* restores a component to 8 bits, optionally replicating its top bits so that 0x1F maps to 0xFF */
+  static constexpr u8 expand(u8 component, bool fullBrightness)
+  {
+    return fullBrightness ?
+      (component << Specs::COLOR_SHIFT) | (component >> (Specs::BITS_PER_COLOR_COMPONENT - Specs::COLOR_SHIFT)) :
+      (component << Specs::COLOR_SHIFT);
+  }
+
   static constexpr col_t ccc(u8 r, u8 g, u8 b)
   {
-    //TODO: not using full brightness colors
     return OPAQUE_FLAG |
       ((r >> (Specs::COLOR_SHIFT)) << Specs::RED_SHIFT) |
       ((g >> (Specs::COLOR_SHIFT)) << Specs::GREEN_SHIFT) |
       ((b >> (Specs::COLOR_SHIFT)) << Specs::BLUE_SHIFT);
   }
 
-  static color_t ccc(u16 c)
+  /* plain shift by default, full brightness costs nothing when resolved through a ColorLUT */
+  static color_t ccc(u16 c, bool fullBrightness = false)
   {
-    u8 r = ((c >> Specs::RED_SHIFT) & Specs::COLOR_MASK) << Specs::COLOR_SHIFT;
-    u8 g = ((c >> Specs::GREEN_SHIFT) & Specs::COLOR_MASK) << Specs::COLOR_SHIFT;
-    u8 b = ((c >> Specs::BLUE_SHIFT) & Specs::COLOR_MASK) << Specs::COLOR_SHIFT;
-    return { r, g, b };
+    u8 r = expand((c >> Specs::RED_SHIFT) & Specs::COLOR_MASK, fullBrightness);
+    u8 g = expand((c >> Specs::GREEN_SHIFT) & Specs::COLOR_MASK, fullBrightness);
+    u8 b = expand((c >> Specs::BLUE_SHIFT) & Specs::COLOR_MASK, fullBrightness);
+    return { r, g, b, 0xFF };
   }
 };
 
@@ -148,29 +334,40 @@ public:
     set(x + y * Specs::SPRITE_WIDTH, color);
   }
 
+  /* two pixels in a byte, the left one in the high nibble like set() */
+  static constexpr u8 pack(col_idx_t left, col_idx_t right) { return u8((left & 0x0F) << 4 | (right & 0x0F)); }
+  /* color index of a hex digit, either case */
+  static constexpr col_idx_t digit(char c)
+  {
+    return c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : c - 'A' + 10);
+  }
+
+  /* rows are written a byte at a time instead of a pixel at a time */
   void setRow(coord_t y, const std::array<col_idx_t, Specs::SPRITE_WIDTH>& data)
   {
-    for (coord_t x = 0; x < Specs::SPRITE_WIDTH; ++x)
-      set(x, y, data[x]);
+    u8* dest = row(y);
+    for (coord_t x = 0; x < Specs::SPRITE_WIDTH; x += 2)
+      dest[x / 2] = pack(data[x], data[x + 1]);
   }
 
   void setRowString(coord_t y, const std::string& data)
   {
     assert(data.size() == Specs::SPRITE_WIDTH);
-    for (coord_t x = 0; x < Specs::SPRITE_WIDTH; ++x)
-      set(x, y, (data[x] >= '0' || data[x] <= '9') ? (data[x] - '0') : (data[x] - 'A'));
+    u8* dest = row(y);
+    for (coord_t x = 0; x < Specs::SPRITE_WIDTH; x += 2)
+      dest[x / 2] = pack(digit(data[x]), digit(data[x + 1]));
   }
   
   void setString(const std::string& data)
   {
     assert(data.size() == Specs::SPRITE_HEIGHT * Specs::SPRITE_WIDTH);
-    for (coord_t i = 0; i < Specs::SPRITE_HEIGHT * Specs::SPRITE_WIDTH; ++i)
-      set(i, (data[i] >= '0' || data[i] <= '9') ? (data[i] - '0') : (data[i] - 'A'));
+    for (coord_t i = 0; i < Specs::SPRITE_HEIGHT * Specs::SPRITE_WIDTH; i += 2)
+      this->data[i / 2] = pack(digit(data[i]), digit(data[i + 1]));
   }
 
-  col_idx_t get(coord_t x, coord_t y)
+  col_idx_t get(coord_t x, coord_t y) const
   {
-    u8* base = row(y) + (x / 2);
+    const u8* base = row(y) + (x / 2);
 
     if (x % 2 == 0)
       return (*base >> 4) & 0x0F;
@@ -179,12 +376,62 @@ public:
   }
 
   u8* row(coord_t y) { return data.data() + y * Specs::SPRITE_ROW_SIZE_IN_BYTES; }
+  const u8* row(coord_t y) const { return data.data() + y * Specs::SPRITE_ROW_SIZE_IN_BYTES; }
 };
 
 using Palette = std::array<col_t, Specs::PALETTE_SIZE>;
 using Palettes = std::array<Palette, Specs::PALETTE_COUNT>;
 using SpriteMap = std::array<Sprite, Specs::SPRITE_MAP_SIZE>;
 using SpriteInfos = std::array<SpriteInfo, Specs::SPRITE_INFO_SIZE>;
+using Framebuffer = std::array<col_t, Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT>;
+using TileMap = std::array<u8, Specs::TILE_MAP_WIDTH * Specs::TILE_MAP_HEIGHT>;
+using TileMaps = std::array<TileMap, Specs::TILE_MAPS_COUNT>;
+using TileMapInfos = std::array<TileMapInfo, Specs::TILE_MAPS_COUNT>;
+
+/* one dirty bit for every BLOCK bytes of the memory region starting at BASE */
+template<addr_t BASE, addr_t SIZE, addr_t BLOCK>
+class DirtyRegion
+{
+public:
+  static constexpr size_t COUNT = SIZE / BLOCK;
+  static_assert(SIZE % BLOCK == 0);
+
+private:
+  std::bitset<COUNT> _bits;
+
+public:
+  void mark(addr_t address, addr_t length)
+  {
+    if (address < BASE + SIZE && address + length > BASE)
+    {
+      const addr_t first = (std::max(address, BASE) - BASE) / BLOCK;
+      const addr_t last = (std::min(address + length, BASE + SIZE) - 1 - BASE) / BLOCK;
+
+      for (addr_t i = first; i <= last; ++i)
+        _bits.set(i);
+    }
+  }
+
+  void mark(size_t index) { _bits.set(index); }
+  void markAll() { _bits.set(); }
+  void clear() { _bits.reset(); }
+
+  DirtyRegion& operator|=(const DirtyRegion& other) { _bits |= other._bits; return *this; }
+
+  bool any() const { return _bits.any(); }
+  bool test(size_t index) const { return _bits.test(index); }
+};
+
+/* framebuffer lines written since the last time they were consumed */
+using DirtyLines = DirtyRegion<Address::VRAM, Specs::FRAMEBUFFER_SIZE_IN_BYTES, Specs::SCREEN_WIDTH * sizeof(pix_t)>;
+/* sprites of every sprite map written since they were last decoded */
+using DirtySprites = DirtyRegion<Address::SPRITE_MAP, Specs::SPRITE_MAP_SIZE_IN_BYTES * Specs::SPRITE_MAPS_COUNT, Specs::SPRITE_SIZE_IN_BYTES>;
+/* sprite infos written since visibility was last evaluated */
+using DirtySpriteInfos = DirtyRegion<Address::SPRITE_INFOS, sizeof(SpriteInfos), sizeof(SpriteInfo)>;
+/* code pages written since their translations were last checked */
+using DirtyCode = DirtyRegion<Address::CODE, Specs::CODE_SIZE_IN_BYTES, Specs::CODE_PAGE_SIZE_IN_BYTES>;
+/* snapshot pages written since the last snapshot was taken or restored */
+using DirtyPages = DirtyRegion<0, Specs::MEMORY_SIZE, Specs::SNAPSHOT_PAGE_SIZE>;
 
 class Memory
 {
@@ -193,49 +440,219 @@ public:
 
 private:
   u8* memory;
+  DirtyLines _dirtyLines;
+  DirtySprites _dirtySprites;
+  DirtySpriteInfos _dirtySpriteInfos;
+  DirtyCode _dirtyCode;
+  DirtyPages _dirtyPages;
+  DirtyPages _framePages; // handed out since the current frame started, references into them may still be written
+
+  /*
+    every mutable access marks the bytes it hands out as written, at the time it hands them out: a plain
+    reference must be written before the next frame consumes the marks, and taken again after. Snapshots
+    keep copying pages handed out during the current frame, so they can be taken in between. Sprites are
+    written through SpriteRef instead, which marks on every write and can be kept around.
+  */
+  void touch(addr_t addr, addr_t length)
+  {
+    _dirtyLines.mark(addr, length);
+    _dirtySprites.mark(addr, length);
+    _dirtySpriteInfos.mark(addr, length);
+    _dirtyCode.mark(addr, length);
+    _dirtyPages.mark(addr, length);
+    _framePages.mark(addr, length);
+  }
 
 public:
-  Memory() : memory(new u8[size()])
-  {
+  /* page aligned so that snapshot pages and os pages coincide and blocks of different machines never share a cache line */
+  static constexpr size_t ALIGNMENT = Specs::SNAPSHOT_PAGE_SIZE;
 
+  Memory() : memory(new (std::align_val_t(ALIGNMENT)) u8[size()])
+  {
+    _dirtyLines.markAll();
+    _dirtySprites.markAll();
+    _dirtySpriteInfos.markAll();
+    _dirtyCode.markAll();
+    _dirtyPages.markAll();
   }
 
   ~Memory()
   {
-    delete[] memory;
+    operator delete[](memory, std::align_val_t(ALIGNMENT));
   }
 
+  Memory(const Memory&) = delete;
+  Memory& operator=(const Memory&) = delete;
+
   void clear()
   {
     std::fill(memory, memory + size(), 0);
+    _dirtyLines.markAll();
+    _dirtySprites.markAll();
+    _dirtySpriteInfos.markAll();
+    _dirtyCode.markAll();
+    _dirtyPages.markAll();
   }
 
-  void* raw() { return memory; }
+  void* raw() { touch(0, size()); return memory; }
 
-  template<typename T> T* addr(addr_t addr) { return reinterpret_cast<T*>(&memory[addr]); }
+  /* a single T, only its sizeof(T) bytes are marked: anything indexed past it must go through span() */
+  template<typename T> T* addr(addr_t addr) { touch(addr, sizeof(T)); return reinterpret_cast<T*>(&memory[addr]); }
+  /* count consecutive T starting at addr, all of them marked, for bulk writes through a pointer */
+  template<typename T> T* span(addr_t addr, addr_t count)
+  {
+    assert(addr + count * sizeof(T) <= size());
+    touch(addr, addr_t(count * sizeof(T)));
+    return reinterpret_cast<T*>(&memory[addr]);
+  }
   template<typename T> const T* addr(addr_t addr) const { return reinterpret_cast<T*>(&memory[addr]); }
 
-  u8& byte(addr_t addr) { return reinterpret_cast<u8&>(memory[addr]); }
-  u16& word(addr_t addr) { return reinterpret_cast<u16&>(memory[addr]); }
-  u32& dword(addr_t addr) { return reinterpret_cast<u32&>(memory[addr]); }
+  /* copies length bytes at addr, tracked as a single write */
+  void write(addr_t addr, const void* source, addr_t length) { touch(addr, length); std::copy_n(static_cast<const u8*>(source), length, &memory[addr]); }
+
+  /* no tracking, callers must mark what they write themselves */
+  template<typename T> T* direct(addr_t addr) { return reinterpret_cast<T*>(&memory[addr]); }
+
+  DirtyLines& dirtyLines() { return _dirtyLines; }
+  const DirtyLines& dirtyLines() const { return _dirtyLines; }
+  DirtySprites& dirtySprites() { return _dirtySprites; }
+  DirtySpriteInfos& dirtySpriteInfos() { return _dirtySpriteInfos; }
+  DirtyCode& dirtyCode() { return _dirtyCode; }
+  DirtyPages& dirtyPages() { return _dirtyPages; }
+  const DirtyPages& dirtyPages() const { return _dirtyPages; }
+  DirtyPages& framePages() { return _framePages; }
+
+  /* after the whole memory was replaced without tracking, every consumer sees it as written */
+  void markAllConsumers()
+  {
+    _dirtyLines.markAll();
+    _dirtySprites.markAll();
+    _dirtySpriteInfos.markAll();
+    _dirtyCode.markAll();
+  }
+
+  u8& byte(addr_t addr) { touch(addr, sizeof(u8)); return reinterpret_cast<u8&>(memory[addr]); }
+  u16& word(addr_t addr) { touch(addr, sizeof(u16)); return reinterpret_cast<u16&>(memory[addr]); }
+  u32& dword(addr_t addr) { touch(addr, sizeof(u32)); return reinterpret_cast<u32&>(memory[addr]); }
 
   const u8& byte(addr_t addr) const { return reinterpret_cast<const u8&>(memory[addr]); }
   const u16& word(addr_t addr) const { return reinterpret_cast<const u16&>(memory[addr]); }
   const u32& dword(addr_t addr) const { return reinterpret_cast<const u32&>(memory[addr]); }
 };
 
+/* a sprite written in place, each write marks the sprite when it happens so the reference can outlive frames */
+class SpriteRef
+{
+private:
+  Memory* _memory;
+  addr_t _address;
+
+  Sprite& sprite() { return *_memory->addr<Sprite>(_address); }
+
+public:
+  SpriteRef(Memory* memory, addr_t address) : _memory(memory), _address(address) { }
+
+  void set(coord_t i, col_idx_t color) { sprite().set(i, color); }
+  void set(coord_t x, coord_t y, col_idx_t color) { sprite().set(x, y, color); }
+  void setRow(coord_t y, const std::array<col_idx_t, Specs::SPRITE_WIDTH>& data) { sprite().setRow(y, data); }
+  void setRowString(coord_t y, const std::string& data) { sprite().setRowString(y, data); }
+  void setString(const std::string& data) { sprite().setString(data); }
+
+  const Sprite& get() const { return *static_cast<const Memory*>(_memory)->addr<Sprite>(_address); }
+  col_idx_t get(coord_t x, coord_t y) const { return get().get(x, y); }
+};
+
 using coord_t = s32;
 
 class Machine;
 
+/* every sprite decoded to one color index per pixel, also mirrored on x, vertical flips just walk rows backwards */
+class SpriteCache
+{
+public:
+  static constexpr s32 SPRITE_COUNT = Specs::SPRITE_MAP_SIZE * Specs::SPRITE_MAPS_COUNT;
+  /* one byte per pixel, col_idx_t would make the cache four times larger */
+  using Tile = std::array<u8, Specs::SPRITE_WIDTH * Specs::SPRITE_HEIGHT>;
+  static_assert((SPRITE_COUNT & (SPRITE_COUNT - 1)) == 0);
+
+private:
+  std::array<Tile, SPRITE_COUNT> _tiles;
+  std::array<Tile, SPRITE_COUNT> _mirrored;
+
+public:
+  /* decodes only the sprites marked in dirty and clears them */
+  void refresh(const Sprite* sprites, DirtySprites& dirty);
+
+  const u8* row(s32 index, coord_t y, bool mirrored) const
+  {
+    /* indices past either end of the sprite maps wrap around instead of reading unrelated memory */
+    return (mirrored ? _mirrored : _tiles)[index & (SPRITE_COUNT - 1)].data() + y * Specs::SPRITE_WIDTH;
+  }
+};
+
 class Screen
 {
 private:
   Machine* machine;
   Memory* memory;
 
-  const col_t* framebuffer() const { return memory->addr<col_t>(Address::VRAM); }
-  col_t* framebuffer() { return memory->addr<col_t>(Address::VRAM); }
+  /* reads go through the const accessor, the mutable one would mark every line as written */
+  const pix_t* framebuffer() const { return static_cast<const Memory*>(memory)->addr<pix_t>(Address::VRAM); }
+  pix_t* framebuffer() { return memory->direct<pix_t>(Address::VRAM); }
+
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  /* colors of the last frame, VRAM only holds indices */
+  Framebuffer scanout;
+
+  /* what scanout was resolved from, lines are resolved again only if their indices or the palettes changed */
+  std::array<pix_t, Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT> scanoutIndices;
+  Palettes scanoutPalettes;
+#endif
+
+  void markDirty(coord_t y)
+  {
+    memory->dirtyLines().mark(size_t(y));
+    memory->dirtyPages().mark(Address::VRAM + addr_t(y) * Specs::SCREEN_WIDTH * sizeof(pix_t), 1);
+  }
+
+  /* unchecked single pixel write, callers clip before */
+  void plot(coord_t x, coord_t y, pix_t color);
+
+  /* spans with both ends included, clipped to the screen */
+  void hline(coord_t x0, coord_t x1, coord_t y, pix_t color);
+  void vline(coord_t x, coord_t y0, coord_t y1, pix_t color);
+
+  /* per scanline list of sprite indices, rebuilt once per frame by rasterizeSprites() */
+  struct SpriteLine
+  {
+    u8 count;
+    bool overflow;
+    std::array<u8, Specs::SPRITE_INFO_SIZE> sprites;
+  };
+
+  std::array<SpriteLine, Specs::SCREEN_HEIGHT> spriteLines;
+  SpriteCache spriteCache;
+
+  /* enabled sprites at least partially on screen, only infos written since the last frame are evaluated again */
+  std::bitset<Specs::SPRITE_INFO_SIZE> visibleSprites;
+  std::array<u8, Specs::SPRITE_INFO_SIZE> activeSprites;
+  s32 activeSpritesCount;
+
+  /* registers the scanline lists were built with, changing them builds the lists again */
+  u8 linesSpritesPerLine;
+  SpriteOrder linesSpriteOrder;
+  u16 linesOverflow, linesDropped;
+
+  bool isVisible(const SpriteInfo& info) const;
+  void updateActiveSprites();
+
+  /* rasterizers only read machine state, mutable accessors would mark it as written */
+  const Machine& state() const { return *machine; }
+  void refreshSpriteCache();
+
+  void buildSpriteLines();
+  bool rasterizeSpriteRow(const SpriteInfo& info, coord_t y, pix_t* line);
+  bool rasterizeTileMapRow(const TileMapInfo& info, const TileMap& map, coord_t y, pix_t* line);
 
 public:
   Screen(Machine* machine);
@@ -244,34 +661,147 @@ public:
   auto width() const { return Specs::SCREEN_WIDTH; }
   auto height() const { return Specs::SCREEN_HEIGHT; }
 
+  /* colors as displayed, with an indexed framebuffer these are the ones resolved by the last scanOut() */
+#if defined(MINIATURE_INDEXED_FRAMEBUFFER)
+  col_t pixel(addr_t i) const { return scanout[i]; }
+  const col_t* pixels() const { return scanout.data(); }
+#else
   col_t pixel(addr_t i) const { return framebuffer()[i]; }
+  const col_t* pixels() const { return framebuffer(); }
+#endif
+
+  /* pixels as stored in VRAM, the same as pixels() unless the framebuffer is indexed */
+  const pix_t* vram() const { return framebuffer(); }
+
+  /* resolves indexed pixels through the current palettes, done by Machine::frame() */
+  void scanOut();
+
+  /* lines whose pixels changed since the last clearDirtyLines() */
+  const DirtyLines& dirtyLines() const { return memory->dirtyLines(); }
+  void clearDirtyLines() { memory->dirtyLines().clear(); }
+  void invalidate() { memory->dirtyLines().markAll(); }
 
   void clear();
-  void fill(col_t color);
+  void fill(pix_t color);
   
-  void set(coord_t x, coord_t y, col_t color);
+  /* every primitive is clipped to the screen, off-screen parts are skipped; colors are pix_t, so indices when indexed */
+  void set(coord_t x, coord_t y, pix_t color);
+
+  void rect(coord_t x, coord_t y, coord_t w, coord_t h, pix_t color);
+  void line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, pix_t color);
+
+  /* connects the points in order, repeat the first one at the end to close the shape */
+  void polyline(const point_t* points, size_t count, pix_t color);
 
-  void rect(coord_t x, coord_t y, coord_t w, coord_t h, col_t color);
-  void line(coord_t x0, coord_t y0, coord_t x1, coord_t y1, col_t color);
+  void triangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, pix_t color);
+  void fillTriangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, pix_t color);
+
+  /* circles cover the pixels whose centers lie within radius + 0.5 of the center, outline and fill match */
+  void circle(coord_t cx, coord_t cy, coord_t radius, pix_t color);
+  void fillCircle(coord_t cx, coord_t cy, coord_t radius, pix_t color);
+
+  /* sprites which survived culling in the last rasterizeSprites() */
+  s32 activeSpriteCount() const { return activeSpritesCount; }
 
   void rasterizeSprites();
+  void rasterizeTileMap(s32 index);
+
+  /* background tile maps, sprites and then foreground tile maps */
+  void rasterize();
 };
 
 
+/* whole machine state, 4KB pages not written since the base snapshot are shared with it instead of copied */
+class Snapshot
+{
+public:
+  using Page = std::array<u8, Specs::SNAPSHOT_PAGE_SIZE>;
+
+private:
+  std::array<std::shared_ptr<const Page>, Specs::SNAPSHOT_PAGE_COUNT> _pages;
+  u64 _frames;
+  u64 _id; // identifies the state the pages were taken from, copies of a snapshot share it
+
+  friend class Machine;
+
+public:
+  Snapshot() : _frames(0), _id(0) { }
+
+  operator bool() const { return _pages[0] != nullptr; }
+
+  u64 frames() const { return _frames; }
+  const Page& page(size_t index) const { return *_pages[index]; }
+
+  /* pages not shared with other, which is usually the snapshot this one was based on */
+  size_t pagesNotSharedWith(const Snapshot& other) const;
+};
+
+class Translator;
+
 class Machine
 {
 private:
   Memory _memory;
   Screen _screen;
+  std::unique_ptr<Translator> _translator;
+
+  u64 _frames;
+  u64 _snapshot; // id of the last snapshot taken or restored, the dirty pages are relative to it
 
 public:
   Machine();
+  ~Machine();
 
   Memory& memory() { return _memory; }
+  const Memory& memory() const { return _memory; }
   Screen& screen() { return _screen; }
+  const Screen& screen() const { return _screen; }
   Palettes& palettes() { return *_memory.addr<Palettes>(Address::PALETTES); }
-  SpriteMap& sprites() { return *_memory.addr<SpriteMap>(Address::SPRITE_MAP); }
   SpriteInfos& spriteInfos() { return *_memory.addr<SpriteInfos>(Address::SPRITE_INFOS); }
+  TileMaps& tileMaps() { return *_memory.addr<TileMaps>(Address::TILE_MAP); }
+  TileMapInfos& tileMapInfos() { return *_memory.addr<TileMapInfos>(Address::TILE_MAP_INFOS); }
+
+  /* a single sprite of any sprite map, only this one gets decoded again and only when it's written */
+  SpriteRef sprite(s32 index) { return SpriteRef(&_memory, Address::SPRITE_MAP + index * Specs::SPRITE_SIZE_IN_BYTES); }
+  const Sprite& sprite(s32 index) const { return *_memory.addr<Sprite>(Address::SPRITE_MAP + index * Specs::SPRITE_SIZE_IN_BYTES); }
+  /* a single sprite info, only this one gets culled again */
+  SpriteInfo& spriteInfo(s32 index) { return *_memory.addr<SpriteInfo>(Address::SPRITE_INFOS + index * sizeof(SpriteInfo)); }
+
+  const Palettes& palettes() const { return *_memory.addr<Palettes>(Address::PALETTES); }
+  const SpriteMap& sprites() const { return *_memory.addr<SpriteMap>(Address::SPRITE_MAP); }
+  const SpriteInfos& spriteInfos() const { return *_memory.addr<SpriteInfos>(Address::SPRITE_INFOS); }
+  const TileMaps& tileMaps() const { return *_memory.addr<TileMaps>(Address::TILE_MAP); }
+  const TileMapInfos& tileMapInfos() const { return *_memory.addr<TileMapInfos>(Address::TILE_MAP_INFOS); }
+
+  VideoRegisters& videoRegisters() { return *_memory.addr<VideoRegisters>(Address::VIDEO_REGISTERS); }
+  const VideoRegisters& videoRegisters() const { return *_memory.addr<VideoRegisters>(Address::VIDEO_REGISTERS); }
+
+  InputState& input() { return *_memory.addr<InputState>(Address::INPUT); }
+  const InputState& input() const { return *_memory.addr<InputState>(Address::INPUT); }
+
+  SoundRegisters& sound() { return *_memory.addr<SoundRegisters>(Address::SOUND_REGISTERS); }
+  const SoundRegisters& sound() const { return *_memory.addr<SoundRegisters>(Address::SOUND_REGISTERS); }
+
+  CpuRegisters& cpu() { return *_memory.addr<CpuRegisters>(Address::CPU_REGISTERS); }
+  const CpuRegisters& cpu() const { return *_memory.addr<CpuRegisters>(Address::CPU_REGISTERS); }
+
+  /* copies a program at the start of the code region and runs it from its first instruction on the next frame */
+  bool load(const u32* code, size_t count);
+
+  /* runs programs through translated blocks once they get hot instead of only interpreting them */
+  void setTranslation(bool enabled);
+  const Translator* translator() const { return _translator.get(); }
+
+  u64 frames() const { return _frames; }
 
   void reset();
+  void frame();
+
+  /*
+    only pages written since base are copied, which is known only when base is the last snapshot taken or restored,
+    any other base gets a full copy. Dirty pages are cleared but for the ones handed out during the current frame,
+    so the next snapshot is relative to this one and still sees writes through references taken before it.
+  */
+  Snapshot snapshot(const Snapshot* base = nullptr);
+  void restore(const Snapshot& snapshot);
 };
\ No newline at end of file
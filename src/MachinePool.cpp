@@ -0,0 +1,184 @@
+#include "MachinePool.h"
+
+#include <chrono>
+
+MachinePool::MachinePool(size_t instances, size_t threads) : _generation(0), _quit(false), _queued(0), _idle(0), _callback(nullptr), _step(false), _remaining(0), _steals(0)
+{
+  if (!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  _machines.reserve(instances);
+  for (size_t i = 0; i < instances; ++i)
+    _machines.emplace_back(new Machine());
+
+  for (size_t i = 0; i < threads; ++i)
+    _workers.emplace_back(new Worker());
+
+  for (size_t i = 0; i < threads; ++i)
+    _threads.emplace_back(&MachinePool::work, this, i);
+
+  /* first touch of every memory block happens on the worker which initially owns its chunk */
+  forEach([](Machine& machine, size_t) { machine.reset(); });
+}
+
+MachinePool::~MachinePool()
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _quit = true;
+  }
+
+  _wake.notify_all();
+
+  for (std::thread& thread : _threads)
+    thread.join();
+}
+
+bool MachinePool::pop(size_t worker, Task& task)
+{
+  Worker& w = *_workers[worker];
+  std::lock_guard<std::mutex> guard(w.lock);
+
+  if (w.tasks.empty())
+    return false;
+
+  task = w.tasks.back();
+  w.tasks.pop_back();
+  --_queued;
+  return true;
+}
+
+bool MachinePool::steal(size_t worker, Task& task)
+{
+  for (size_t i = 1; i < _workers.size(); ++i)
+  {
+    Worker& victim = *_workers[(worker + i) % _workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+
+    if (!victim.tasks.empty())
+    {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      --_queued;
+      ++_steals;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void MachinePool::execute(size_t worker, const Task& task)
+{
+  const size_t begin = task.chunk * CHUNK_SIZE;
+  const size_t end = std::min(begin + CHUNK_SIZE, _machines.size());
+
+  for (size_t i = begin; i < end; ++i)
+  {
+    Machine& machine = *_machines[i];
+
+    if (_step)
+      machine.frame();
+
+    if (*_callback)
+      (*_callback)(machine, i);
+  }
+
+  /* next frame of the same chunk stays on this worker while its memory is still in cache */
+  if (task.frames > 1)
+  {
+    {
+      Worker& w = *_workers[worker];
+      std::lock_guard<std::mutex> guard(w.lock);
+      w.tasks.push_back({ task.chunk, task.frames - 1 });
+    }
+
+    /* idle workers registered themselves before checking _queued, so one of the two sides always sees the other */
+    ++_queued;
+    if (_idle.load() > 0)
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _work.notify_one();
+    }
+  }
+
+  if (--_remaining == 0)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _done.notify_all();
+    _work.notify_all();
+  }
+}
+
+void MachinePool::work(size_t worker)
+{
+  u64 generation = 0;
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> guard(_lock);
+      _wake.wait(guard, [&] { return _quit || _generation != generation; });
+
+      if (_quit)
+        return;
+
+      generation = _generation;
+    }
+
+    Task task;
+    while (_remaining.load() > 0)
+    {
+      if (pop(worker, task) || steal(worker, task))
+      {
+        execute(worker, task);
+        continue;
+      }
+
+      /* every queued task is taken, the next one comes from a worker finishing a frame of its chunk */
+      std::unique_lock<std::mutex> guard(_lock);
+      ++_idle;
+      _work.wait(guard, [this] { return _queued.load() > 0 || _remaining.load() == 0; });
+      --_idle;
+    }
+  }
+}
+
+void MachinePool::dispatch(u64 frames, const callback_t* callback, bool step)
+{
+  if (!frames || _machines.empty())
+    return;
+
+  _callback = callback;
+  _step = step;
+  _remaining = chunks() * frames;
+
+  for (size_t c = 0; c < chunks(); ++c)
+  {
+    Worker& w = *_workers[c % _workers.size()];
+    std::lock_guard<std::mutex> guard(w.lock);
+    w.tasks.push_back({ u32(c), frames });
+    ++_queued;
+  }
+
+  std::unique_lock<std::mutex> guard(_lock);
+  ++_generation;
+  _wake.notify_all();
+  _done.wait(guard, [this] { return _remaining.load() == 0; });
+}
+
+void MachinePool::forEach(const callback_t& callback)
+{
+  dispatch(1, &callback, false);
+}
+
+PoolStats MachinePool::run(u64 frames, const callback_t& update)
+{
+  const u64 steals = _steals;
+  const auto start = std::chrono::steady_clock::now();
+
+  dispatch(frames, &update, true);
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return { frames * _machines.size(), seconds, _steals - steals };
+}
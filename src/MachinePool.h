@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct PoolStats
+{
+  u64 frames;
+  double seconds;
+  u64 steals;
+
+  double framesPerSecond() const { return seconds > 0.0 ? frames / seconds : 0.0; }
+};
+
+/*
+  Steps many independent machines on a work stealing thread pool. Machines are grouped in small chunks,
+  a task advances one chunk by a single frame and queues the following frame of the same chunk on the
+  worker that ran it, so every machine runs its frames in order while idle workers steal whole chunks.
+*/
+class MachinePool
+{
+public:
+  using callback_t = std::function<void(Machine& machine, size_t index)>;
+
+  static constexpr size_t CHUNK_SIZE = 4;
+
+private:
+  struct Task
+  {
+    u32 chunk;
+    u64 frames;
+  };
+
+  struct Worker
+  {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Machine>> _machines;
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+
+  std::mutex _lock;
+  std::condition_variable _wake, _done;
+  u64 _generation;
+  bool _quit;
+
+  /* workers with nothing to run or steal sleep on _work until a task is queued or the job ends */
+  std::condition_variable _work;
+  std::atomic<u64> _queued;
+  std::atomic<u32> _idle;
+
+  /* state of the job being executed */
+  const callback_t* _callback;
+  bool _step;
+  std::atomic<u64> _remaining;
+  std::atomic<u64> _steals;
+
+  size_t chunks() const { return (_machines.size() + CHUNK_SIZE - 1) / CHUNK_SIZE; }
+
+  bool pop(size_t worker, Task& task);
+  bool steal(size_t worker, Task& task);
+  void execute(size_t worker, const Task& task);
+  void work(size_t worker);
+  void dispatch(u64 frames, const callback_t* callback, bool step);
+
+public:
+  /* threads = 0 uses every hardware thread */
+  MachinePool(size_t instances, size_t threads = 0);
+  ~MachinePool();
+
+  size_t size() const { return _machines.size(); }
+  size_t threads() const { return _threads.size(); }
+
+  Machine& machine(size_t index) { return *_machines[index]; }
+
+  /* runs callback once on every machine in parallel */
+  void forEach(const callback_t& callback);
+  /* advances every machine by frames, update runs after each Machine::frame() */
+  PoolStats run(u64 frames, const callback_t& update = callback_t());
+};
@@ -0,0 +1,265 @@
+#include "PixelConverter.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MINIATURE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(MINIATURE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+/*
+  All kernels produce the same values SDL_MapRGBA(format, c.r, c.g, c.b, 255) gives for Color::ccc(c),
+  every 5 bit component is shifted to the top of its 8 (or 6) bit destination.
+*/
+
+namespace
+{
+  void scalarARGB8888(const col_t* src, void* dest, size_t count)
+  {
+    u32* out = static_cast<u32*>(dest);
+    for (size_t i = 0; i < count; ++i)
+    {
+      const u32 c = src[i];
+      out[i] = 0xFF000000 | ((c & 0x7C00) << 9) | ((c & 0x03E0) << 6) | ((c & 0x001F) << 3);
+    }
+  }
+
+  void scalarABGR8888(const col_t* src, void* dest, size_t count)
+  {
+    u32* out = static_cast<u32*>(dest);
+    for (size_t i = 0; i < count; ++i)
+    {
+      const u32 c = src[i];
+      out[i] = 0xFF000000 | ((c & 0x001F) << 19) | ((c & 0x03E0) << 6) | ((c & 0x7C00) >> 7);
+    }
+  }
+
+  void scalarRGB565(const col_t* src, void* dest, size_t count)
+  {
+    u16* out = static_cast<u16*>(dest);
+    for (size_t i = 0; i < count; ++i)
+    {
+      const u16 c = src[i];
+      out[i] = ((c << 1) & 0xFFC0) | (c & 0x001F);
+    }
+  }
+
+#if defined(MINIATURE_X86)
+
+  /* 8 pixels per iteration, red and blue are swapped by choosing which one goes in the low byte */
+  template<bool SWAP_RB>
+  TARGET("sse2") void sse2RGBA8888(const col_t* src, void* dest, size_t count)
+  {
+    u32* out = static_cast<u32*>(dest);
+
+    const __m128i mask = _mm_set1_epi16(0x00F8);
+    const __m128i alpha = _mm_set1_epi16(s16(0xFF00));
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+      const __m128i r = _mm_and_si128(_mm_srli_epi16(c, 7), mask);
+      const __m128i g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(c, 2), mask), 8);
+      const __m128i b = _mm_and_si128(_mm_slli_epi16(c, 3), mask);
+
+      /* low half holds the first two bytes of every pixel, high half the last two */
+      const __m128i lo = _mm_or_si128(SWAP_RB ? r : b, g);
+      const __m128i hi = _mm_or_si128(SWAP_RB ? b : r, alpha);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(lo, hi));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(lo, hi));
+    }
+
+    if (SWAP_RB)
+      scalarABGR8888(src + i, out + i, count - i);
+    else
+      scalarARGB8888(src + i, out + i, count - i);
+  }
+
+  TARGET("sse2") void sse2RGB565(const col_t* src, void* dest, size_t count)
+  {
+    u16* out = static_cast<u16*>(dest);
+
+    const __m128i high = _mm_set1_epi16(s16(0xFFC0));
+    const __m128i blue = _mm_set1_epi16(0x001F);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      const __m128i v = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(c, 1), high), _mm_and_si128(c, blue));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+    }
+
+    scalarRGB565(src + i, out + i, count - i);
+  }
+
+  /* 16 pixels per iteration, unpacking works per 128 bit lane so the halves are put back in order afterwards */
+  template<bool SWAP_RB>
+  TARGET("avx2") void avx2RGBA8888(const col_t* src, void* dest, size_t count)
+  {
+    u32* out = static_cast<u32*>(dest);
+
+    const __m256i mask = _mm256_set1_epi16(0x00F8);
+    const __m256i alpha = _mm256_set1_epi16(s16(0xFF00));
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+
+      const __m256i r = _mm256_and_si256(_mm256_srli_epi16(c, 7), mask);
+      const __m256i g = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(c, 2), mask), 8);
+      const __m256i b = _mm256_and_si256(_mm256_slli_epi16(c, 3), mask);
+
+      const __m256i lo = _mm256_or_si256(SWAP_RB ? r : b, g);
+      const __m256i hi = _mm256_or_si256(SWAP_RB ? b : r, alpha);
+
+      const __m256i first = _mm256_unpacklo_epi16(lo, hi);
+      const __m256i second = _mm256_unpackhi_epi16(lo, hi);
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute2x128_si256(first, second, 0x20));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 8), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+
+    if (SWAP_RB)
+      scalarABGR8888(src + i, out + i, count - i);
+    else
+      scalarARGB8888(src + i, out + i, count - i);
+  }
+
+  TARGET("avx2") void avx2RGB565(const col_t* src, void* dest, size_t count)
+  {
+    u16* out = static_cast<u16*>(dest);
+
+    const __m256i high = _mm256_set1_epi16(s16(0xFFC0));
+    const __m256i blue = _mm256_set1_epi16(0x001F);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+      const __m256i v = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(c, 1), high), _mm256_and_si256(c, blue));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+    }
+
+    scalarRGB565(src + i, out + i, count - i);
+  }
+
+#endif
+
+  PixelConverter::convert_t kernel(HostFormat format, PixelConverter::Kernel kernel)
+  {
+    using Kernel = PixelConverter::Kernel;
+
+    static const PixelConverter::convert_t scalar[] = { nullptr, scalarARGB8888, scalarABGR8888, scalarRGB565 };
+#if defined(MINIATURE_X86)
+    static const PixelConverter::convert_t sse2[] = { nullptr, sse2RGBA8888<false>, sse2RGBA8888<true>, sse2RGB565 };
+    static const PixelConverter::convert_t avx2[] = { nullptr, avx2RGBA8888<false>, avx2RGBA8888<true>, avx2RGB565 };
+#endif
+
+    switch (kernel)
+    {
+      case Kernel::Scalar: return scalar[size_t(format)];
+#if defined(MINIATURE_X86)
+      case Kernel::SSE2: return sse2[size_t(format)];
+      case Kernel::AVX2: return avx2[size_t(format)];
+#endif
+      default: return nullptr;
+    }
+  }
+}
+
+PixelConverter::PixelConverter(HostFormat format) : PixelConverter()
+{
+  for (Kernel kernel : { Kernel::AVX2, Kernel::SSE2, Kernel::Scalar })
+  {
+    if (isSupported(kernel))
+    {
+      *this = PixelConverter(format, kernel);
+      break;
+    }
+  }
+}
+
+PixelConverter::PixelConverter(HostFormat format, Kernel kernel) : _format(format), _kernel(kernel), _convert(nullptr)
+{
+  if (isSupported(kernel))
+    _convert = ::kernel(format, kernel);
+
+  if (!_convert)
+    _kernel = Kernel::None;
+}
+
+bool PixelConverter::isSupported(Kernel kernel)
+{
+  switch (kernel)
+  {
+    case Kernel::Scalar:
+      return true;
+#if defined(MINIATURE_X86)
+#if defined(_MSC_VER)
+    case Kernel::SSE2:
+    {
+      int info[4];
+      __cpuid(info, 1);
+      return info[3] & (1 << 26);
+    }
+    case Kernel::AVX2:
+    {
+      int info[4];
+      __cpuid(info, 0);
+      if (info[0] < 7) return false;
+
+      /* the os must also save ymm registers on context switches */
+      __cpuid(info, 1);
+      const bool osxsave = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+      if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+
+      __cpuidex(info, 7, 0);
+      return info[1] & (1 << 5);
+    }
+#else
+    case Kernel::SSE2: return __builtin_cpu_supports("sse2");
+    case Kernel::AVX2: return __builtin_cpu_supports("avx2");
+#endif
+#endif
+    default:
+      return false;
+  }
+}
+
+size_t PixelConverter::bytesPerPixel(HostFormat format)
+{
+  switch (format)
+  {
+    case HostFormat::ARGB8888:
+    case HostFormat::ABGR8888:
+      return sizeof(u32);
+    case HostFormat::RGB565:
+      return sizeof(u16);
+    default:
+      return 0;
+  }
+}
+
+const char* PixelConverter::name(Kernel kernel)
+{
+  static const char* names[] = { "none", "scalar", "sse2", "avx2" };
+  return names[size_t(kernel)];
+}
+
+const char* PixelConverter::name(HostFormat format)
+{
+  static const char* names[] = { "unknown", "argb8888", "abgr8888", "rgb565" };
+  return names[size_t(format)];
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <cstddef>
+
+/* host pixel layouts the framebuffer can be converted to without going through SDL_MapRGBA */
+enum class HostFormat
+{
+  Unknown,
+  ARGB8888,
+  ABGR8888,
+  RGB565
+};
+
+class PixelConverter
+{
+public:
+  enum class Kernel { None, Scalar, SSE2, AVX2 };
+
+  using convert_t = void(*)(const col_t* src, void* dest, size_t count);
+
+private:
+  HostFormat _format;
+  Kernel _kernel;
+  convert_t _convert;
+
+public:
+  PixelConverter() : _format(HostFormat::Unknown), _kernel(Kernel::None), _convert(nullptr) { }
+  /* picks the widest kernel supported by the running cpu */
+  PixelConverter(HostFormat format);
+  PixelConverter(HostFormat format, Kernel kernel);
+
+  operator bool() const { return _convert != nullptr; }
+
+  HostFormat format() const { return _format; }
+  Kernel kernel() const { return _kernel; }
+  size_t bytesPerPixel() const { return bytesPerPixel(_format); }
+
+  void convert(const col_t* src, void* dest, size_t count) const { _convert(src, dest, count); }
+
+  static bool isSupported(Kernel kernel);
+  static size_t bytesPerPixel(HostFormat format);
+  static const char* name(Kernel kernel);
+  static const char* name(HostFormat format);
+};
@@ -0,0 +1,125 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+void Profiler::commit()
+{
+  if (!enabled())
+    return;
+
+  for (size_t i = 0; i < STAGES; ++i)
+  {
+    if (!_ran[i].exchange(false, std::memory_order_relaxed))
+      continue;
+
+    Series& series = _series[i];
+    const u32 elapsed = u32(std::min<u64>(_pending[i].exchange(0, std::memory_order_relaxed), std::numeric_limits<u32>::max()));
+
+    series.window[series.samples % WINDOW] = elapsed;
+    series.total += elapsed;
+    series.max = std::max(series.max, elapsed);
+    ++series.samples;
+  }
+
+  ++_frames;
+}
+
+void Profiler::reset()
+{
+  _frames = 0;
+
+  for (size_t i = 0; i < STAGES; ++i)
+  {
+    _pending[i].store(0, std::memory_order_relaxed);
+    _ran[i].store(false, std::memory_order_relaxed);
+  }
+
+  for (Series& series : _series)
+  {
+    series.samples = 0;
+    series.total = 0;
+    series.max = 0;
+  }
+}
+
+Profiler::Stats Profiler::stats(Stage stage)
+{
+  const Series& series = _series[size_t(stage)];
+  Stats stats = { series.samples, 0.0, 0.0, 0.0, series.max / 1000.0 };
+
+  if (!series.samples)
+    return stats;
+
+  stats.mean = series.total / 1000.0 / series.samples;
+
+  /* percentiles only consider the last WINDOW frames, so that old spikes eventually go away */
+  std::vector<u32> sorted(series.window.begin(), series.window.begin() + std::min<u64>(series.samples, WINDOW));
+
+  const auto percentile = [&sorted](double p) {
+    const size_t index = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index] / 1000.0;
+  };
+
+  stats.p50 = percentile(0.50);
+  stats.p99 = percentile(0.99);
+
+  return stats;
+}
+
+const char* Profiler::name(Stage stage)
+{
+  static const char* names[] = { "frame", "update", "program", "tile-maps", "sprites", "sound", "blit", "upload", "present" };
+  static_assert(sizeof(names) / sizeof(names[0]) == STAGES);
+  return names[size_t(stage)];
+}
+
+void Profiler::write(FILE* out, Format format)
+{
+  if (format == Format::Json)
+  {
+    fprintf(out, "{\n  \"frames\": %llu,\n  \"window\": %zu,\n  \"stages\": {", (unsigned long long)_frames, WINDOW);
+
+    bool first = true;
+    for (size_t i = 0; i < STAGES; ++i)
+    {
+      const Stats s = stats(Stage(i));
+
+      if (!s.samples)
+        continue;
+
+      fprintf(out, "%s\n    \"%s\": { \"samples\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f }",
+        first ? "" : ",", name(Stage(i)), (unsigned long long)s.samples, s.mean, s.p50, s.p99, s.max);
+      first = false;
+    }
+
+    fprintf(out, "\n  }\n}\n");
+  }
+  else
+  {
+    fprintf(out, "%-12s %10s %12s %12s %12s %12s\n", "stage", "samples", "mean us", "p50 us", "p99 us", "max us");
+
+    for (size_t i = 0; i < STAGES; ++i)
+    {
+      const Stats s = stats(Stage(i));
+
+      if (s.samples)
+        fprintf(out, "%-12s %10llu %12.3f %12.3f %12.3f %12.3f\n", name(Stage(i)), (unsigned long long)s.samples, s.mean, s.p50, s.p99, s.max);
+    }
+  }
+}
+
+bool Profiler::save(const path& fileName, Format format)
+{
+  FILE* out = fopen(fileName.c_str(), "w");
+
+  if (!out)
+    return false;
+
+  write(out, format);
+  fclose(out);
+
+  return true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Common.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+/*
+  Per stage frame timings. Every stage accumulates what it spends during a frame, commit() then stores
+  the totals of the stages which ran into a rolling window from which percentiles are computed.
+  Stages can be timed from any thread, commit() and the reports belong to a single one.
+  When disabled each scope costs a single branch.
+*/
+class Profiler
+{
+public:
+  enum class Stage : u8 { Frame, Update, Program, TileMaps, Sprites, Sound, Blit, Upload, Present, Count };
+
+  using clock = std::chrono::steady_clock;
+
+  static constexpr size_t WINDOW = 1024;
+  static constexpr size_t STAGES = size_t(Stage::Count);
+
+  enum class Format { Text, Json };
+
+  struct Stats
+  {
+    u64 samples; // frames in which the stage ran, not only the ones in the window
+    double mean, p50, p99, max; // microseconds, max over the whole run
+  };
+
+private:
+  struct Series
+  {
+    std::array<u32, WINDOW> window; // nanoseconds
+    u64 samples;
+    u64 total;
+    u32 max;
+  };
+
+  static inline std::atomic<bool> _enabled;
+  static inline u64 _frames = 0;
+  static inline std::array<std::atomic<u64>, STAGES> _pending;
+  static inline std::array<std::atomic<bool>, STAGES> _ran;
+  static inline std::array<Series, STAGES> _series = { };
+
+public:
+  static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+  static void setEnabled(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+
+  static void record(Stage stage, clock::duration elapsed)
+  {
+    _pending[size_t(stage)].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+    _ran[size_t(stage)].store(true, std::memory_order_relaxed);
+  }
+
+  /* closes the current frame */
+  static void commit();
+  static void reset();
+
+  static u64 frames() { return _frames; }
+  static Stats stats(Stage stage);
+  static const char* name(Stage stage);
+
+  static void write(FILE* out, Format format);
+  static bool save(const path& fileName, Format format);
+};
+
+class ProfileScope
+{
+private:
+  Profiler::Stage _stage;
+  bool _active;
+  Profiler::clock::time_point _start;
+
+public:
+  ProfileScope(Profiler::Stage stage) : _stage(stage), _active(Profiler::enabled())
+  {
+    if (_active)
+      _start = Profiler::clock::now();
+  }
+
+  ~ProfileScope()
+  {
+    if (_active)
+      Profiler::record(_stage, Profiler::clock::now() - _start);
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+};
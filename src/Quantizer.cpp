@@ -0,0 +1,131 @@
+#include "Quantizer.h"
+
+#include <algorithm>
+
+namespace
+{
+  constexpr s32 SHIFTS[] = { Specs::RED_SHIFT, Specs::GREEN_SHIFT, Specs::BLUE_SHIFT };
+  constexpr u16 COLOR_BITS = Quantizer::COLORS - 1;
+
+  struct Sample
+  {
+    u16 color;
+    u32 count;
+  };
+
+  struct Box
+  {
+    size_t begin, end;
+    u64 count;
+    s32 axis; // component with the widest range
+    u32 extent;
+  };
+
+  u32 component(u16 color, s32 axis) { return (color >> SHIFTS[axis]) & Specs::COLOR_MASK; }
+
+  Box measure(const std::vector<Sample>& samples, size_t begin, size_t end)
+  {
+    Box box = { begin, end, 0, 0, 0 };
+    u32 low[3] = { Specs::COLOR_MASK, Specs::COLOR_MASK, Specs::COLOR_MASK }, high[3] = { 0, 0, 0 };
+
+    for (size_t i = begin; i < end; ++i)
+    {
+      box.count += samples[i].count;
+
+      for (s32 axis = 0; axis < 3; ++axis)
+      {
+        low[axis] = std::min(low[axis], component(samples[i].color, axis));
+        high[axis] = std::max(high[axis], component(samples[i].color, axis));
+      }
+    }
+
+    for (s32 axis = 0; axis < 3; ++axis)
+    {
+      if (high[axis] - low[axis] > box.extent)
+      {
+        box.axis = axis;
+        box.extent = high[axis] - low[axis];
+      }
+    }
+
+    return box;
+  }
+}
+
+void Quantizer::add(const u8* rgba, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, rgba += 4)
+  {
+    if (!isTransparent(rgba))
+      ++_histogram[color(rgba) & COLOR_BITS];
+  }
+}
+
+const Palette& Quantizer::build()
+{
+  std::vector<Sample> samples;
+
+  for (size_t c = 0; c < COLORS; ++c)
+  {
+    if (_histogram[c])
+      samples.push_back({ u16(c), _histogram[c] });
+  }
+
+  std::vector<Box> boxes;
+
+  if (!samples.empty())
+    boxes.push_back(measure(samples, 0, samples.size()));
+
+  /* the box which weighs the most in pixels times range is split at its median until every entry is taken */
+  while (boxes.size() < Specs::PALETTE_SIZE - 1)
+  {
+    auto largest = std::max_element(boxes.begin(), boxes.end(), [](const Box& b1, const Box& b2) { return b1.count * b1.extent < b2.count * b2.extent; });
+
+    /* every box is down to a single color, there are fewer colors than entries */
+    if (largest == boxes.end() || !largest->extent)
+      break;
+
+    const Box box = *largest;
+    std::sort(samples.begin() + box.begin, samples.begin() + box.end, [axis = box.axis](const Sample& s1, const Sample& s2) {
+      return component(s1.color, axis) < component(s2.color, axis);
+    });
+
+    /* both halves keep at least a color even when one of them holds most of the pixels */
+    size_t median = box.begin + 1;
+    for (u64 count = samples[box.begin].count; median < box.end - 1 && count * 2 < box.count; ++median)
+      count += samples[median].count;
+
+    *largest = measure(samples, box.begin, median);
+    boxes.push_back(measure(samples, median, box.end));
+  }
+
+  _palette.fill(Color::TRANSPARENT);
+
+  for (size_t i = 0; i < boxes.size(); ++i)
+  {
+    const Box& box = boxes[i];
+    u64 sums[3] = { 0, 0, 0 };
+
+    for (size_t s = box.begin; s < box.end; ++s)
+    {
+      for (s32 axis = 0; axis < 3; ++axis)
+        sums[axis] += u64(component(samples[s].color, axis)) * samples[s].count;
+
+      _lookup[samples[s].color] = u8(i + 1);
+    }
+
+    col_t color = Color::OPAQUE_FLAG;
+    for (s32 axis = 0; axis < 3; ++axis)
+      color |= col_t((sums[axis] + box.count / 2) / box.count) << SHIFTS[axis];
+
+    _palette[i + 1] = color;
+  }
+
+  return _palette;
+}
+
+void Quantizer::map(const u8* rgba, size_t count, u8* indices) const
+{
+  for (size_t i = 0; i < count; ++i, rgba += 4)
+    indices[i] = isTransparent(rgba) ? TRANSPARENT_INDEX : _lookup[color(rgba) & COLOR_BITS];
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <vector>
+
+/*
+  Reduces true color RGBA images to a single Palette through median cut. Pixels are reduced to col_t
+  while they are counted, so no more than 32768 distinct colors are ever split, whatever the size of
+  the image. Entry 0 is always transparent and gets every pixel with alpha below half.
+*/
+class Quantizer
+{
+public:
+  static constexpr size_t COLORS = size_t(1) << (Specs::BITS_PER_COLOR_COMPONENT * 3);
+  static constexpr u8 TRANSPARENT_INDEX = 0;
+
+private:
+  std::vector<u32> _histogram;
+  std::vector<u8> _lookup; // palette index of every counted color once built
+  Palette _palette;
+
+public:
+  Quantizer() : _histogram(COLORS, 0), _lookup(COLORS, TRANSPARENT_INDEX), _palette() { }
+
+  static constexpr col_t color(const u8* rgba) { return Color::ccc(rgba[0], rgba[1], rgba[2]); }
+  static constexpr bool isTransparent(const u8* rgba) { return rgba[3] < 0x80; }
+
+  /* counts pixels, can be called on as many images as are meant to share the palette */
+  void add(const u8* rgba, size_t count);
+  /* chooses the palette for everything added so far */
+  const Palette& build();
+  /* palette index of every pixel, only valid for colors which were added before build() */
+  void map(const u8* rgba, size_t count, u8* indices) const;
+
+  const Palette& palette() const { return _palette; }
+};
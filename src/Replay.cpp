@@ -0,0 +1,250 @@
+#include "Replay.h"
+#include "Profiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+  constexpr u32 MAGIC = 0x4C52494D; // "MIRL"
+  constexpr u32 VERSION = 1;
+
+  struct FileHeader
+  {
+    u32 magic;
+    u32 version;
+    u64 frames;
+    u64 changes;
+    u32 inputSize;
+    u32 hashes; // 1 if a hash follows for every frame
+  };
+
+  /* frame deltas between changes are usually small, so they are stored as LEB128 */
+  void writeVarint(std::vector<u8>& out, u64 value)
+  {
+    do
+    {
+      u8 byte = value & 0x7F;
+      value >>= 7;
+      out.push_back(byte | (value ? 0x80 : 0x00));
+    } while (value);
+  }
+
+  bool readVarint(const u8*& in, const u8* end, u64& value)
+  {
+    value = 0;
+
+    for (u32 shift = 0; in < end && shift < 64; shift += 7)
+    {
+      const u8 byte = *in++;
+      value |= u64(byte & 0x7F) << shift;
+
+      if (!(byte & 0x80))
+        return true;
+    }
+
+    return false;
+  }
+}
+
+u64 hashFramebuffer(const Screen& screen)
+{
+  /* FNV-1a on 64 bit words, 4 pixels at a time */
+  constexpr u64 PRIME = 0x100000001B3ULL;
+  constexpr size_t WORDS = Specs::FRAMEBUFFER_SIZE_IN_BYTES / sizeof(u64);
+
+  const u8* pixels = reinterpret_cast<const u8*>(screen.pixels());
+  u64 hash = 0xCBF29CE484222325ULL;
+
+  for (size_t i = 0; i < WORDS; ++i)
+  {
+    u64 word;
+    std::memcpy(&word, pixels + i * sizeof(u64), sizeof(u64));
+    hash = (hash ^ word) * PRIME;
+  }
+
+  return hash;
+}
+
+void InputLog::clear()
+{
+  _changes.clear();
+  _hashes.clear();
+  _frames = 0;
+  _last = InputState();
+}
+
+void InputLog::record(const InputState& input, u64 hash)
+{
+  /* the first frame is always stored so that a log never depends on the input left in memory */
+  if (_frames == 0 || input != _last)
+  {
+    _changes.push_back({ _frames, input });
+    _last = input;
+  }
+
+  _hashes.push_back(hash);
+  ++_frames;
+}
+
+bool InputLog::save(const path& fileName) const
+{
+  FILE* out = fopen(fileName.c_str(), "wb");
+
+  if (!out)
+    return false;
+
+  const FileHeader header = { MAGIC, VERSION, _frames, _changes.size(), sizeof(InputState), 1 };
+
+  std::vector<u8> data;
+  data.reserve(_changes.size() * (sizeof(InputState) + 2) + _hashes.size() * sizeof(u64));
+
+  u64 previous = 0;
+  for (const Change& change : _changes)
+  {
+    writeVarint(data, change.frame - previous);
+    previous = change.frame;
+
+    const u8* state = reinterpret_cast<const u8*>(&change.state);
+    data.insert(data.end(), state, state + sizeof(InputState));
+  }
+
+  const u8* hashes = reinterpret_cast<const u8*>(_hashes.data());
+  data.insert(data.end(), hashes, hashes + _hashes.size() * sizeof(u64));
+
+  const bool success = fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(data.data(), 1, data.size(), out) == data.size();
+  fclose(out);
+
+  return success;
+}
+
+bool InputLog::load(const path& fileName)
+{
+  clear();
+
+  FILE* in = fopen(fileName.c_str(), "rb");
+
+  if (!in)
+    return false;
+
+  FileHeader header;
+  std::vector<u8> data;
+
+  bool success = fread(&header, sizeof(header), 1, in) == 1;
+
+  if (success)
+  {
+    u8 buffer[4096];
+    size_t read;
+
+    while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+      data.insert(data.end(), buffer, buffer + read);
+  }
+
+  fclose(in);
+
+  if (!success || header.magic != MAGIC || header.version != VERSION || header.inputSize != sizeof(InputState))
+  {
+    printf("%s is not a compatible input log.\n", fileName.c_str());
+    return false;
+  }
+
+  const u8* ptr = data.data();
+  const u8* end = data.data() + data.size();
+
+  u64 frame = 0;
+  for (u64 i = 0; i < header.changes; ++i)
+  {
+    u64 delta;
+
+    if (!readVarint(ptr, end, delta) || size_t(end - ptr) < sizeof(InputState))
+    {
+      printf("Input log %s is truncated.\n", fileName.c_str());
+      clear();
+      return false;
+    }
+
+    frame += delta;
+
+    Change change;
+    change.frame = frame;
+    std::memcpy(&change.state, ptr, sizeof(InputState));
+    ptr += sizeof(InputState);
+
+    _changes.push_back(change);
+  }
+
+  if (header.hashes)
+  {
+    if (size_t(end - ptr) < header.frames * sizeof(u64))
+    {
+      printf("Input log %s is truncated.\n", fileName.c_str());
+      clear();
+      return false;
+    }
+
+    _hashes.resize(header.frames);
+    std::memcpy(_hashes.data(), ptr, header.frames * sizeof(u64));
+  }
+
+  _frames = header.frames;
+  if (!_changes.empty())
+    _last = _changes.back().state;
+
+  return true;
+}
+
+void Replay::step(Machine& machine, const InputState& input, const update_t& update)
+{
+  machine.input() = input;
+  machine.frame();
+
+  if (update)
+  {
+    ProfileScope scope(Profiler::Stage::Update);
+    update(machine);
+  }
+}
+
+ReplayResult Replay::run(Machine& machine, const InputLog& log, const update_t& update, bool verify)
+{
+  using clock = std::chrono::steady_clock;
+
+  ReplayResult result = { 0, 0, 0, 0, 0.0 };
+  verify &= log.hashes().size() == log.frames();
+
+  const auto start = clock::now();
+
+  auto change = log.changes().begin();
+  InputState input = InputState();
+
+  for (u64 frame = 0; frame < log.frames(); ++frame)
+  {
+    while (change != log.changes().end() && change->frame == frame)
+      input = (change++)->state;
+
+    {
+      ProfileScope scope(Profiler::Stage::Frame);
+      step(machine, input, update);
+    }
+
+    Profiler::commit();
+
+    if (verify)
+    {
+      result.finalHash = hashFramebuffer(machine.screen());
+
+      if (result.finalHash != log.hashes()[frame] && result.mismatches++ == 0)
+        result.firstMismatch = frame;
+    }
+  }
+
+  result.frames = log.frames();
+  result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+  if (!verify)
+    result.finalHash = hashFramebuffer(machine.screen());
+
+  return result;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "Machine.h"
+#include "Common.h"
+
+#include <functional>
+#include <vector>
+
+/* 64 bit hash of the whole framebuffer, used to tell whether two runs produced the same frames */
+u64 hashFramebuffer(const Screen& screen);
+
+/* input of a session, stored only on the frames where it changed, plus the framebuffer hash after every frame */
+class InputLog
+{
+public:
+  struct Change
+  {
+    u64 frame;
+    InputState state;
+  };
+
+private:
+  std::vector<Change> _changes;
+  std::vector<u64> _hashes;
+  u64 _frames;
+  InputState _last;
+
+public:
+  InputLog() { clear(); }
+
+  void clear();
+  /* input is the one the frame ran with, hash is taken once the frame is complete */
+  void record(const InputState& input, u64 hash);
+
+  u64 frames() const { return _frames; }
+  const std::vector<Change>& changes() const { return _changes; }
+  const std::vector<u64>& hashes() const { return _hashes; }
+
+  bool save(const path& fileName) const;
+  bool load(const path& fileName);
+};
+
+struct ReplayResult
+{
+  u64 frames;
+  u64 mismatches;
+  u64 firstMismatch; // frame index, only meaningful when mismatches is not 0
+  u64 finalHash;
+  double seconds;
+
+  bool matches() const { return mismatches == 0; }
+  double framesPerSecond() const { return seconds > 0.0 ? frames / seconds : 0.0; }
+};
+
+class Replay
+{
+public:
+  using update_t = std::function<void(Machine&)>;
+
+  /* a single frame as run both while recording and while replaying, input is latched before the frame */
+  static void step(Machine& machine, const InputState& input, const update_t& update);
+
+  /* runs the whole log as fast as possible from the current state of machine, which must match the recorded one */
+  static ReplayResult run(Machine& machine, const InputLog& log, const update_t& update, bool verify = true);
+};
@@ -0,0 +1,55 @@
+#include "Rewind.h"
+
+RewindBuffer::RewindBuffer(size_t capacity, size_t budget) : _capacity(std::max<size_t>(capacity, 1)), _budget(budget), _bytes(0)
+{
+
+}
+
+void RewindBuffer::dropOldest()
+{
+  const Snapshot& oldest = _snapshots.front();
+  const size_t pages = _snapshots.size() > 1 ? oldest.pagesNotSharedWith(_snapshots[1]) : Specs::SNAPSHOT_PAGE_COUNT;
+
+  _bytes -= pages * Specs::SNAPSHOT_PAGE_SIZE;
+  _snapshots.pop_front();
+}
+
+void RewindBuffer::dropNewest()
+{
+  const Snapshot& newest = _snapshots.back();
+  const size_t pages = _snapshots.size() > 1 ? newest.pagesNotSharedWith(_snapshots[_snapshots.size() - 2]) : Specs::SNAPSHOT_PAGE_COUNT;
+
+  _bytes -= pages * Specs::SNAPSHOT_PAGE_SIZE;
+  _snapshots.pop_back();
+}
+
+void RewindBuffer::push(Machine& machine)
+{
+  const Snapshot* base = _snapshots.empty() ? nullptr : &_snapshots.back();
+  Snapshot snapshot = machine.snapshot(base);
+
+  const size_t pages = base ? snapshot.pagesNotSharedWith(*base) : Specs::SNAPSHOT_PAGE_COUNT;
+  _bytes += pages * Specs::SNAPSHOT_PAGE_SIZE;
+  _snapshots.push_back(std::move(snapshot));
+
+  while (_snapshots.size() > _capacity || (_bytes > _budget && _snapshots.size() > 1))
+    dropOldest();
+}
+
+bool RewindBuffer::rewind(Machine& machine, size_t steps)
+{
+  if (steps >= _snapshots.size())
+    return false;
+
+  for (size_t i = 0; i < steps; ++i)
+    dropNewest();
+
+  machine.restore(_snapshots.back());
+  return true;
+}
+
+void RewindBuffer::clear()
+{
+  _snapshots.clear();
+  _bytes = 0;
+}
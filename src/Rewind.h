@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <deque>
+
+/* bounded history of snapshots, each one shares its unchanged pages with the one taken before it */
+class RewindBuffer
+{
+private:
+  std::deque<Snapshot> _snapshots;
+  size_t _capacity;
+  size_t _budget;
+  size_t _bytes;
+
+  void dropOldest();
+  void dropNewest();
+
+public:
+  /* defaults keep 10 seconds at 60fps within 8MB */
+  RewindBuffer(size_t capacity = 600, size_t budget = 8 * KB1 * KB1);
+
+  void push(Machine& machine);
+  /* restores the snapshot taken the given amount of pushes ago, newer ones are discarded */
+  bool rewind(Machine& machine, size_t steps = 1);
+  void clear();
+
+  size_t size() const { return _snapshots.size(); }
+  size_t capacity() const { return _capacity; }
+  size_t budget() const { return _budget; }
+  /* memory actually owned by the history, shared pages are counted once */
+  size_t bytes() const { return _bytes; }
+};
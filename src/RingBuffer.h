@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Common.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+/*
+  Single producer and single consumer queue of values, neither side ever waits or takes a lock.
+  Writes which don't fit are cut short and reads of more than what's queued return less, so both
+  sides decide what to do about it. Positions only grow and are masked on access, CAPACITY must be
+  a power of two.
+*/
+template<typename T, size_t CAPACITY>
+class RingBuffer
+{
+private:
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0, "positions wrap around by masking");
+  static constexpr size_t MASK = CAPACITY - 1;
+
+  std::array<T, CAPACITY> _items;
+
+  /* each side owns a position and keeps the last one seen of the other, so they share a line only when they have to */
+  alignas(64) std::atomic<size_t> _write;
+  size_t _readCache;
+  alignas(64) std::atomic<size_t> _read;
+  size_t _writeCache;
+
+public:
+  RingBuffer() : _items(), _write(0), _readCache(0), _read(0), _writeCache(0) { }
+
+  /* producer side, returns how many values were queued */
+  size_t write(const T* values, size_t count)
+  {
+    const size_t write = _write.load(std::memory_order_relaxed);
+
+    if (CAPACITY - (write - _readCache) < count)
+      _readCache = _read.load(std::memory_order_acquire);
+
+    count = std::min(count, CAPACITY - (write - _readCache));
+
+    const size_t first = std::min(count, CAPACITY - (write & MASK));
+    std::copy_n(values, first, _items.begin() + (write & MASK));
+    std::copy_n(values + first, count - first, _items.begin());
+
+    _write.store(write + count, std::memory_order_release);
+    return count;
+  }
+
+  /* consumer side, returns how many values were dequeued */
+  size_t read(T* values, size_t count)
+  {
+    const size_t read = _read.load(std::memory_order_relaxed);
+
+    if (_writeCache - read < count)
+      _writeCache = _write.load(std::memory_order_acquire);
+
+    count = std::min(count, _writeCache - read);
+
+    const size_t first = std::min(count, CAPACITY - (read & MASK));
+    std::copy_n(_items.begin() + (read & MASK), first, values);
+    std::copy_n(_items.begin(), count - first, values + first);
+
+    _read.store(read + count, std::memory_order_release);
+    return count;
+  }
+
+  /* values queued, the other side can only make it smaller for the producer and larger for the consumer */
+  size_t size() const { return _write.load(std::memory_order_acquire) - _read.load(std::memory_order_acquire); }
+  static constexpr size_t capacity() { return CAPACITY; }
+};
@@ -0,0 +1,179 @@
+#include "SoundChip.h"
+
+#include <algorithm>
+
+namespace
+{
+  /* 4 bit levels of every channel and the master volume leave room for one more bit */
+  constexpr s32 GAIN = 2;
+  static_assert(15 * 15 * s32(SoundChannelType::Count) * 15 * GAIN <= 0x7FFF, "a full mix can't clip");
+
+  /* advance of the phase in a sample, a full period being 2^32 */
+  u32 step(u16 frequency) { return u32((u64(frequency) << 32) / Specs::SOUND_SAMPLE_RATE); }
+
+  /* a 4 bit value centered around 0 and scaled by the volume */
+  s32 level(u32 value, u8 volume) { return (s32(value) * 2 - 15) * (volume & 0x0F); }
+
+  /* top 5 bits of the phase, the position in a 32 step period */
+  u32 position(u32 phase) { return phase >> 27; }
+
+  bool audible(const SoundChannel& channel) { return channel.frequency && (channel.volume & 0x0F); }
+
+  struct WavHeader
+  {
+    char riff[4];
+    u32 riffSize;
+    char wave[4];
+    char fmt[4];
+    u32 fmtSize;
+    u16 format;
+    u16 channels;
+    u32 sampleRate;
+    u32 byteRate;
+    u16 blockAlign;
+    u16 bitsPerSample;
+    char data[4];
+    u32 dataSize;
+  };
+  static_assert(sizeof(WavHeader) == 44);
+
+  WavHeader wavHeader(u32 sampleRate, u64 samples)
+  {
+    const u32 dataSize = u32(samples * sizeof(s16));
+    return { { 'R', 'I', 'F', 'F' }, 36 + dataSize, { 'W', 'A', 'V', 'E' }, { 'f', 'm', 't', ' ' }, 16, 1, 1,
+      sampleRate, u32(sampleRate * sizeof(s16)), sizeof(s16), 16, { 'd', 'a', 't', 'a' }, dataSize };
+  }
+}
+
+void SoundChip::reset()
+{
+  _phases.fill(0);
+  _noiseSteps = 0;
+  _noise = NOISE_SEED;
+}
+
+void SoundChip::render(const SoundRegisters& registers, s16* samples, size_t count)
+{
+  for (size_t done = 0; done < count; )
+  {
+    const size_t length = std::min(count - done, _mix.size());
+    std::fill_n(_mix.begin(), length, 0);
+
+    /* every generator runs on the whole block at once, so its registers are decoded only once per block */
+    const SoundChannel& square = registers.channel(SoundChannelType::Square);
+    if (audible(square))
+    {
+      const u32 advance = step(square.frequency), duty = u32(square.duty ? std::min<u8>(square.duty, 7) : 4) << 29;
+      const s32 high = level(15, square.volume), low = level(0, square.volume);
+      u32& phase = _phases[size_t(SoundChannelType::Square)];
+
+      for (size_t i = 0; i < length; ++i, phase += advance)
+        _mix[i] += phase < duty ? high : low;
+    }
+
+    const SoundChannel& triangle = registers.channel(SoundChannelType::Triangle);
+    if (audible(triangle))
+    {
+      const u32 advance = step(triangle.frequency);
+      u32& phase = _phases[size_t(SoundChannelType::Triangle)];
+
+      for (size_t i = 0; i < length; ++i, phase += advance)
+      {
+        const u32 p = position(phase);
+        _mix[i] += level(p < 16 ? p : 31 - p, triangle.volume);
+      }
+    }
+
+    const SoundChannel& noise = registers.channel(SoundChannelType::Noise);
+    if (audible(noise))
+    {
+      const s32 high = level(15, noise.volume), low = level(0, noise.volume);
+
+      for (size_t i = 0; i < length; ++i)
+      {
+        /* the register steps at the frequency of the channel, which can be more than once per sample */
+        for (_noiseSteps += noise.frequency; _noiseSteps >= u32(Specs::SOUND_SAMPLE_RATE); _noiseSteps -= Specs::SOUND_SAMPLE_RATE)
+        {
+          const u16 feedback = (_noise ^ (_noise >> 1)) & 1;
+          _noise = u16((_noise >> 1) | (feedback << 14));
+
+          /* the short sequence also feeds back into bit 6, which repeats every 93 steps */
+          if (noise.duty)
+            _noise = u16((_noise & ~0x40) | (feedback << 6));
+        }
+
+        _mix[i] += _noise & 1 ? low : high;
+      }
+    }
+
+    const SoundChannel& wave = registers.channel(SoundChannelType::Wave);
+    if (audible(wave))
+    {
+      const u32 advance = step(wave.frequency);
+      u32& phase = _phases[size_t(SoundChannelType::Wave)];
+
+      for (size_t i = 0; i < length; ++i, phase += advance)
+      {
+        const u32 p = position(phase);
+        const u8 pair = registers.wave[p / 2];
+        _mix[i] += level(p % 2 ? pair & 0x0F : pair >> 4, wave.volume);
+      }
+    }
+
+    const s32 volume = (registers.volume & 0x0F) * GAIN;
+    for (size_t i = 0; i < length; ++i)
+      samples[done + i] = s16(_mix[i] * volume);
+
+    done += length;
+  }
+}
+
+bool WavWriter::open(const path& fileName, u32 sampleRate)
+{
+  close();
+
+  _file = fopen(fileName.c_str(), "wb");
+
+  if (!_file)
+  {
+    printf("Unable to create %s.\n", fileName.c_str());
+    return false;
+  }
+
+  /* sizes are unknown until the end, they are written again by close() */
+  _sampleRate = sampleRate;
+  const WavHeader header = wavHeader(sampleRate, 0);
+  if (fwrite(&header, sizeof(header), 1, _file) != 1)
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+bool WavWriter::write(const s16* samples, size_t count)
+{
+  if (!_file || fwrite(samples, sizeof(s16), count, _file) != count)
+    return false;
+
+  _samples += count;
+  return true;
+}
+
+bool WavWriter::close()
+{
+  if (!_file)
+    return true;
+
+  fflush(_file);
+
+  const WavHeader header = wavHeader(_sampleRate, _samples);
+  const bool success = fseek(_file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, _file) == 1;
+
+  fclose(_file);
+  _file = nullptr;
+  _samples = 0;
+
+  return success;
+}
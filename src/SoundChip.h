@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Machine.h"
+
+#include <cstdio>
+
+/*
+  Synthesizes the sound registers of a machine into signed 16 bit mono samples at Specs::SOUND_SAMPLE_RATE.
+  Registers are sampled once for every block, so changes made during a frame are heard from the next block.
+  Only the position of every generator is kept here, a chip can follow any machine.
+*/
+class SoundChip
+{
+private:
+  static constexpr u16 NOISE_SEED = 0x7FFF;
+
+  std::array<u32, size_t(SoundChannelType::Count)> _phases; // position in the period, a full period wraps around 32 bits
+  u32 _noiseSteps; // fraction of a step of the shift register, in samples times frequency
+  u16 _noise; // 15 bit shift register
+
+  std::array<s32, Specs::SOUND_SAMPLES_PER_FRAME> _mix;
+
+public:
+  SoundChip() { reset(); }
+
+  void reset();
+
+  /* fills samples with count of them, blocks longer than a frame are rendered a frame at a time */
+  void render(const SoundRegisters& registers, s16* samples, size_t count);
+};
+
+/* writes 16 bit mono samples into a wav file, the sizes in the header are fixed up on close */
+class WavWriter
+{
+private:
+  FILE* _file;
+  u32 _sampleRate;
+  u64 _samples;
+
+public:
+  WavWriter() : _file(nullptr), _sampleRate(0), _samples(0) { }
+  ~WavWriter() { close(); }
+
+  WavWriter(const WavWriter&) = delete;
+  WavWriter& operator=(const WavWriter&) = delete;
+
+  bool open(const path& fileName, u32 sampleRate = Specs::SOUND_SAMPLE_RATE);
+  bool write(const s16* samples, size_t count);
+  bool close();
+
+  operator bool() const { return _file != nullptr; }
+  u64 samples() const { return _samples; }
+};
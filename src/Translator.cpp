@@ -0,0 +1,377 @@
+#include "Translator.h"
+
+#include <algorithm>
+
+Translator::Translator() : _stats()
+{
+  flush();
+}
+
+void Translator::flush()
+{
+  for (auto& block : _blocks)
+    block.reset();
+
+  _heat.fill(0);
+  _rewrites.fill(0);
+}
+
+bool Translator::fuse(std::vector<Op>& ops, const Op& branch)
+{
+  if (ops.empty() || (branch.code != u8(Opcode::Jz) && branch.code != u8(Opcode::Jnz)) || ops.back().a != branch.a)
+    return false;
+
+  Op& op = ops.back();
+  const bool jz = branch.code == u8(Opcode::Jz);
+
+  switch (Opcode(op.code))
+  {
+    case Opcode::Addi:
+      op.code = u8(jz ? Fused::AddiJz : Fused::AddiJnz);
+      op.c = u8(op.imm);
+      break;
+    case Opcode::Slt: op.code = u8(jz ? Fused::SltJz : Fused::SltJnz); break;
+    case Opcode::Sltu: op.code = u8(jz ? Fused::SltuJz : Fused::SltuJnz); break;
+    case Opcode::Seq: op.code = u8(jz ? Fused::SeqJz : Fused::SeqJnz); break;
+    default: return false;
+  }
+
+  op.imm = branch.imm;
+  return true;
+}
+
+u32 Translator::cycles(const Op& op)
+{
+  if (op.code < u8(Opcode::Count))
+    return Cpu::cycles(Opcode(op.code));
+
+  return op.code == u8(Fused::End) ? 0 : 2;
+}
+
+Translator::Block* Translator::translate(const Memory& memory, u32 pc)
+{
+  using I = Instruction;
+
+  const u32* code = memory.addr<u32>(Address::CODE);
+
+  /* blocks never cross pages, so that a write drops only the translations made from the page it hit */
+  const u32 limit = std::min((pc / PAGE_SIZE_IN_INSTRUCTIONS + 1) * PAGE_SIZE_IN_INSTRUCTIONS, pc + MAX_BLOCK_LENGTH);
+
+  auto block = std::make_unique<Block>();
+  block->start = pc;
+  block->cycles = 0;
+  block->executions = 0;
+  block->links = { };
+
+  u32 last = 0;
+  bool control = false;
+
+  u32 i;
+
+  for (i = pc; i < limit && !control; ++i)
+  {
+    const u32 instruction = code[i];
+    const Opcode opcode = I::opcode(instruction);
+
+    /* the interpreter faults on invalid opcodes, the block stops right before them */
+    if (opcode >= Opcode::Count)
+      break;
+
+    Op op = { u8(opcode), u8(I::a(instruction)), u8(I::b(instruction)), u8(I::c(instruction)), 0 };
+
+    switch (opcode)
+    {
+      case Opcode::Ldi: op.imm = I::imm16(instruction); break;
+      case Opcode::Lui: op.imm = s32(u32(I::imm16(instruction)) << 16); break;
+      case Opcode::Jmp: case Opcode::Jz: case Opcode::Jnz: case Opcode::Call: op.imm = s32(u16(instruction >> 16) & Cpu::PC_MASK); break;
+      case Opcode::Addi: case Opcode::Ldb: case Opcode::Ldh: case Opcode::Ldw: case Opcode::Stb: case Opcode::Sth: case Opcode::Stw: op.imm = I::imm8(instruction); break;
+      default: break;
+    }
+
+    last = Cpu::cycles(opcode);
+    block->cycles += last;
+    control = Cpu::isControl(opcode);
+
+    if (!fuse(block->ops, op))
+      block->ops.push_back(op);
+  }
+
+  if (block->ops.empty())
+  {
+    _heat[pc] = 0;
+    return nullptr;
+  }
+
+  block->end = i & Cpu::PC_MASK;
+  block->required = block->cycles - last + 1;
+
+  if (!control)
+    block->ops.push_back({ u8(Fused::End), 0, 0, 0, 0 });
+
+  ++_stats.translations;
+  return (_blocks[pc] = std::move(block)).get();
+}
+
+void Translator::invalidate(Memory& memory, bool running)
+{
+  DirtyCode& dirty = memory.dirtyCode();
+  const u64 invalidations = _stats.invalidations;
+
+  for (size_t page = 0; page < DirtyCode::COUNT; ++page)
+  {
+    if (!dirty.test(page))
+      continue;
+
+    const size_t first = page * PAGE_SIZE_IN_INSTRUCTIONS;
+
+    for (size_t pc = first; pc < first + PAGE_SIZE_IN_INSTRUCTIONS; ++pc)
+    {
+      if (_blocks[pc])
+      {
+        _blocks[pc].reset();
+        ++_stats.invalidations;
+      }
+
+      _heat[pc] = 0;
+    }
+
+    if (running && _rewrites[page] < REWRITE_LIMIT)
+      ++_rewrites[page];
+  }
+
+  dirty.clear();
+
+  /* links can't tell which of them point to dropped blocks */
+  if (_stats.invalidations != invalidations)
+    for (auto& block : _blocks)
+      if (block)
+        block->links = { };
+}
+
+u32 Translator::run(Machine& machine, u32 budget)
+{
+  CpuRegisters& cpu = machine.cpu();
+
+  if (cpu.status != CpuStatus::Running)
+    return 0;
+
+  Memory& memory = machine.memory();
+
+  /* code written from outside since the last run, by a load or a restored snapshot */
+  if (memory.dirtyCode().any())
+    invalidate(memory, false);
+
+  int64_t remaining = budget;
+  bool yielded = false;
+
+  while (remaining > 0 && cpu.status == CpuStatus::Running && !yielded)
+  {
+    const u32 pc = cpu.pc;
+    Block* block = _blocks[pc].get();
+
+    if (!block && _rewrites[pc / PAGE_SIZE_IN_INSTRUCTIONS] < REWRITE_LIMIT && ++_heat[pc] >= HOT_THRESHOLD)
+      block = translate(memory, pc);
+
+    /* without enough budget for the whole block the interpreter stops at the exact instruction */
+    if (block && remaining >= block->required)
+    {
+      const int64_t before = remaining;
+      yielded = execute(machine, cpu, block, remaining);
+      _stats.translatedCycles += u64(before - remaining);
+    }
+    else
+    {
+      const u32 spent = Cpu::step(machine, u32(remaining), yielded);
+      remaining -= spent;
+      _stats.interpretedCycles += spent;
+    }
+
+    if (memory.dirtyCode().any())
+      invalidate(memory, true);
+  }
+
+  return u32(int64_t(budget) - remaining);
+}
+
+SEPARATE_DISPATCH bool Translator::execute(Machine& machine, CpuRegisters& cpu, Block* block, int64_t& budget)
+{
+  Memory& memory = machine.memory();
+  const Memory& view = memory;
+  Screen& screen = machine.screen();
+  s32* const r = cpu.r.data();
+
+  const Op* op;
+  u32 pc;
+  u32 link;
+  bool yielded = false;
+
+  /* a local copy, stores through the byte pointers of Memory would otherwise force it back to memory every time */
+  int64_t remaining = budget;
+
+#define RA r[op->a]
+#define RB r[op->b]
+#define RC r[op->c]
+#define RN(k) r[(op->a + (k)) & (Specs::CPU_REGISTER_COUNT - 1)]
+#define IMM8 op->imm
+#define IMM16 op->imm
+#define UPPER u32(op->imm)
+#define CHARGE(n) (void)(n)
+#define FAULT(f) { cpu.fault = (f); goto fault; }
+/* the rest of the block may have just been overwritten */
+#define WROTE(address) do { if ((address) < Address::CODE + Specs::CODE_SIZE_IN_BYTES) goto wroteCode; } while (0)
+#define FALL() do { pc = block->end; link = 0; goto chain; } while (0)
+#define TAKE() do { pc = op->imm; link = 1; goto chain; } while (0)
+
+#if defined(MINIATURE_COMPUTED_GOTO)
+#define OP(name) op_##name:
+#define FUSED(name) fused_##name:
+#define NEXT() goto *labels[(++op)->code]
+
+  static const void* const labels[] = {
+    &&op_Halt, &&op_Yield, &&op_Nop,
+    &&op_Ldi, &&op_Lui, &&op_Mov,
+    &&op_Add, &&op_Sub, &&op_Mul, &&op_Div, &&op_Mod, &&op_And, &&op_Or, &&op_Xor, &&op_Shl, &&op_Shr, &&op_Sar, &&op_Addi,
+    &&op_Slt, &&op_Sltu, &&op_Seq,
+    &&op_Jmp, &&op_Jz, &&op_Jnz, &&op_Call, &&op_Ret,
+    &&op_Push, &&op_Pop,
+    &&op_Ldb, &&op_Ldh, &&op_Ldw, &&op_Stb, &&op_Sth, &&op_Stw,
+    &&op_Cls, &&op_Pset, &&op_Line, &&op_Rect, &&op_Circ, &&op_Fcirc,
+    &&op_SprPos, &&op_SprTile, &&op_SprFlags, &&op_Pal,
+    &&op_Btn, &&op_Mouse, &&op_Frame,
+    &&fused_End,
+    &&fused_AddiJz, &&fused_AddiJnz,
+    &&fused_SltJz, &&fused_SltJnz,
+    &&fused_SltuJz, &&fused_SltuJnz,
+    &&fused_SeqJz, &&fused_SeqJnz
+  };
+  static_assert(sizeof(labels) / sizeof(labels[0]) == size_t(Fused::Count), "labels must follow the order of Opcode and Fused");
+#endif
+
+enter:
+  ++block->executions;
+  remaining -= block->cycles;
+  op = block->ops.data();
+
+#if defined(MINIATURE_COMPUTED_GOTO)
+  goto *labels[op->code];
+#else
+#define OP(name) case u8(Opcode::name):
+#define FUSED(name) case u8(Fused::name):
+#define NEXT() continue
+
+  for (;; ++op)
+  {
+    switch (op->code)
+    {
+#endif
+
+  FUSED(End) FALL();
+
+  /* the register is written as the first instruction would, the branch then tests the value without reading it back */
+  FUSED(AddiJz) { const s32 value = s32(u32(RB) + u32(int8_t(op->c))); RA = value; if (value) FALL(); TAKE(); }
+  FUSED(AddiJnz) { const s32 value = s32(u32(RB) + u32(int8_t(op->c))); RA = value; if (value) TAKE(); FALL(); }
+  FUSED(SltJz) { const bool value = RB < RC; RA = value; if (value) FALL(); TAKE(); }
+  FUSED(SltJnz) { const bool value = RB < RC; RA = value; if (value) TAKE(); FALL(); }
+  FUSED(SltuJz) { const bool value = u32(RB) < u32(RC); RA = value; if (value) FALL(); TAKE(); }
+  FUSED(SltuJnz) { const bool value = u32(RB) < u32(RC); RA = value; if (value) TAKE(); FALL(); }
+  FUSED(SeqJz) { const bool value = RB == RC; RA = value; if (value) FALL(); TAKE(); }
+  FUSED(SeqJnz) { const bool value = RB == RC; RA = value; if (value) TAKE(); FALL(); }
+
+  OP(Halt)
+    cpu.status = CpuStatus::Halted;
+    pc = block->end;
+    goto leave;
+  OP(Yield)
+    yielded = true;
+    pc = block->end;
+    goto leave;
+
+  OP(Jmp) TAKE();
+  OP(Jz) if (RA) FALL(); TAKE();
+  OP(Jnz) if (RA) TAKE(); FALL();
+  OP(Call)
+    if (cpu.depth >= Specs::CPU_CALL_DEPTH)
+      FAULT(CpuFault::StackOverflow);
+    cpu.calls[cpu.depth++] = u16(block->end);
+    TAKE();
+  OP(Ret)
+    if (!cpu.depth)
+      FAULT(CpuFault::StackUnderflow);
+    if (cpu.depth > Specs::CPU_CALL_DEPTH)
+      FAULT(CpuFault::StackOverflow);
+    pc = cpu.calls[--cpu.depth] & Cpu::PC_MASK;
+    goto done;
+
+#include "CpuOps.inl"
+
+#if !defined(MINIATURE_COMPUTED_GOTO)
+    }
+  }
+#endif
+
+#undef OP
+#undef FUSED
+#undef NEXT
+#undef RA
+#undef RB
+#undef RC
+#undef RN
+#undef IMM8
+#undef IMM16
+#undef UPPER
+#undef CHARGE
+#undef FAULT
+#undef WROTE
+#undef FALL
+#undef TAKE
+
+fault:
+  cpu.status = CpuStatus::Fault;
+
+wroteCode:
+  /* execution stops after op, what follows it was charged but never ran */
+  pc = (block->start + u32(op - block->ops.data()) + 1) & Cpu::PC_MASK;
+  for (const Op* rest = op + 1; rest < block->ops.data() + block->ops.size(); ++rest)
+    remaining += cycles(*rest);
+  goto leave;
+
+  /* blocks ending below didn't stop the program nor write code, the next one is entered without going back to run() */
+chain:
+  if (!block->links[link])
+    block->links[link] = _blocks[pc].get();
+
+  if (Block* next = block->links[link]; next && remaining >= next->required)
+  {
+    block = next;
+    goto enter;
+  }
+
+  goto leave;
+
+done:
+  if (Block* next = _blocks[pc].get(); next && remaining >= next->required)
+  {
+    block = next;
+    goto enter;
+  }
+
+leave:
+  cpu.pc = pc;
+  budget = remaining;
+  return yielded;
+}
+
+std::vector<const Translator::Block*> Translator::hottest(size_t count) const
+{
+  std::vector<const Block*> blocks;
+
+  for (const auto& block : _blocks)
+    if (block)
+      blocks.push_back(block.get());
+
+  count = std::min(count, blocks.size());
+  std::partial_sort(blocks.begin(), blocks.begin() + count, blocks.end(), [](const Block* a, const Block* b) { return a->executions > b->executions; });
+  blocks.resize(count);
+
+  return blocks;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Cpu.h"
+
+#include <memory>
+#include <vector>
+
+/*
+  Second execution tier for programs. Code is cut in blocks ending on the first instruction which changes the
+  flow of the program; blocks entered often enough are decoded once into ops with their operands and immediates
+  already extracted and then run with threaded dispatch, charging the cycles of the whole block at once.
+  Anything else goes through the Cpu interpreter, the results are the same cycle by cycle either way.
+  Only decoding and part of the dispatch are saved: registers are picked by operands at run time so they stay
+  in memory either way, only machine code emitted for the host could keep them in host registers.
+
+  Translations made from a code page are dropped as soon as the page is written, pages which keep being
+  rewritten while programs run are left to the interpreter from then on.
+*/
+class Translator
+{
+public:
+  static constexpr u32 HOT_THRESHOLD = 16; // entries into a block before it's translated
+  static constexpr u32 MAX_BLOCK_LENGTH = 64;
+  static constexpr u32 REWRITE_LIMIT = 4; // writes to a page by running programs after which it's only interpreted
+  static constexpr u32 PAGE_SIZE_IN_INSTRUCTIONS = Specs::CODE_PAGE_SIZE_IN_BYTES / sizeof(u32);
+
+  /*
+    Ops past the opcodes of the Cpu: the end of blocks which are not closed by a control instruction, and an
+    instruction writing a register followed by Jz or Jnz on the same register, executed as one. Addi keeps
+    its imm8 in c of fused ops, imm holds the branch target.
+  */
+  enum class Fused : u8
+  {
+    End = u8(Opcode::Count),
+    AddiJz, AddiJnz,
+    SltJz, SltJnz,
+    SltuJz, SltuJnz,
+    SeqJz, SeqJnz,
+    Count
+  };
+
+  struct Op
+  {
+    u8 code; // an Opcode or a Fused
+    u8 a, b, c;
+    s32 imm; // sign extended, already shifted for Lui and masked for branch targets
+  };
+
+  struct Block
+  {
+    u32 start;
+    u32 end; // instruction following the block
+    u32 cycles; // of all its instructions
+    u32 required; // budget which lets every instruction start, the last one can overdraw as in the interpreter
+    u64 executions;
+    std::vector<Op> ops;
+    /* successors found once and kept, the block at end and the one at the branch target */
+    std::array<Block*, 2> links;
+  };
+
+  struct Stats
+  {
+    u64 translations;
+    u64 invalidations;
+    u64 translatedCycles;
+    u64 interpretedCycles;
+  };
+
+private:
+  std::array<std::unique_ptr<Block>, Specs::CODE_SIZE_IN_INSTRUCTIONS> _blocks;
+  std::array<u16, Specs::CODE_SIZE_IN_INSTRUCTIONS> _heat;
+  std::array<u8, Specs::CODE_PAGE_COUNT> _rewrites;
+  Stats _stats;
+
+  Block* translate(const Memory& memory, u32 pc);
+  /* merges branch into the last op when they form a Fused pair */
+  static bool fuse(std::vector<Op>& ops, const Op& branch);
+  static u32 cycles(const Op& op);
+  /* drops translations of the pages written since the last call, running tells if the program wrote them */
+  void invalidate(Memory& memory, bool running);
+  /* runs block and then any translated block following it while the budget allows, returns true if the program yielded */
+  bool execute(Machine& machine, CpuRegisters& cpu, Block* block, int64_t& remaining);
+
+public:
+  Translator();
+
+  /* same as Cpu::run() */
+  u32 run(Machine& machine, u32 budget);
+
+  /* drops every translation together with what was learnt about the code, done when a program is loaded */
+  void flush();
+
+  const Stats& stats() const { return _stats; }
+  /* translated blocks ordered by executions, most executed first */
+  std::vector<const Block*> hottest(size_t count) const;
+};
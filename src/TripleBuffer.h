@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Common.h"
+
+#include <array>
+#include <atomic>
+
+/*
+  Single producer and single consumer exchange of the latest value, neither side ever waits.
+  The producer fills back() and publishes it, the consumer picks up the most recent published
+  value with update() and reads it from front(), values published in between are skipped.
+*/
+template<typename T>
+class TripleBuffer
+{
+private:
+  static constexpr u8 INDEX_MASK = 0x03;
+  static constexpr u8 FRESH = 0x04;
+
+  /* every buffer on its own cache lines so that the two sides don't false share */
+  struct alignas(64) Slot
+  {
+    T value;
+  };
+
+  std::array<Slot, 3> _slots;
+
+  alignas(64) u8 _back;
+  alignas(64) u8 _front;
+  alignas(64) std::atomic<u8> _middle;
+
+public:
+  TripleBuffer() : _slots(), _back(0), _front(1), _middle(2) { }
+
+  T& back() { return _slots[_back].value; }
+
+  /* true if the value published before this one had been picked up by the consumer, false if it was skipped */
+  bool publish()
+  {
+    const u8 previous = _middle.exchange(_back | FRESH, std::memory_order_acq_rel);
+    _back = previous & INDEX_MASK;
+    return !(previous & FRESH);
+  }
+
+  /* true if a newer value than the one in front() was picked up */
+  bool update()
+  {
+    if (!(_middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+
+    _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX_MASK;
+    return true;
+  }
+
+  const T& front() const { return _slots[_front].value; }
+};
@@ -0,0 +1,315 @@
+#include "Upscaler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MINIATURE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(MINIATURE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+namespace
+{
+  template<typename P>
+  void scalarExpand(const void* src, void* dest, size_t count, u32 factor)
+  {
+    const P* in = static_cast<const P*>(src);
+    P* out = static_cast<P*>(dest);
+
+    for (size_t i = 0; i < count; ++i)
+      std::fill_n(out + i * factor, factor, in[i]);
+  }
+
+  /* B is above E, H below it, D on its left and F on its right, borders repeat the edge pixels */
+  template<typename P>
+  void scale2xSpan(const P* above, const P* row, const P* below, P* top, P* bottom, size_t count, size_t from, size_t to)
+  {
+    for (size_t x = from; x < to; ++x)
+    {
+      const P B = above[x], H = below[x], E = row[x];
+      const P D = row[x ? x - 1 : 0], F = row[x + 1 < count ? x + 1 : x];
+
+      if (B != H && D != F)
+      {
+        top[2 * x] = D == B ? D : E;
+        top[2 * x + 1] = B == F ? F : E;
+        bottom[2 * x] = D == H ? D : E;
+        bottom[2 * x + 1] = H == F ? F : E;
+      }
+      else
+      {
+        top[2 * x] = top[2 * x + 1] = E;
+        bottom[2 * x] = bottom[2 * x + 1] = E;
+      }
+    }
+  }
+
+  template<typename P>
+  void scalarScale2x(const void* above, const void* row, const void* below, void* top, void* bottom, size_t count)
+  {
+    scale2xSpan(static_cast<const P*>(above), static_cast<const P*>(row), static_cast<const P*>(below), static_cast<P*>(top), static_cast<P*>(bottom), count, 0, count);
+  }
+
+#if defined(MINIATURE_X86)
+
+  /* the same kernels serve both pixel sizes, only the lane width of comparisons and interleaving changes */
+  struct Lanes16
+  {
+    using pixel_t = u16;
+    static constexpr size_t COUNT = 8;
+
+    TARGET("sse2") static __m128i splat(pixel_t p) { return _mm_set1_epi16(s16(p)); }
+    TARGET("sse2") static __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+    TARGET("sse2") static __m128i interleaveLow(__m128i a, __m128i b) { return _mm_unpacklo_epi16(a, b); }
+    TARGET("sse2") static __m128i interleaveHigh(__m128i a, __m128i b) { return _mm_unpackhi_epi16(a, b); }
+  };
+
+  struct Lanes32
+  {
+    using pixel_t = u32;
+    static constexpr size_t COUNT = 4;
+
+    TARGET("sse2") static __m128i splat(pixel_t p) { return _mm_set1_epi32(s32(p)); }
+    TARGET("sse2") static __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+    TARGET("sse2") static __m128i interleaveLow(__m128i a, __m128i b) { return _mm_unpacklo_epi32(a, b); }
+    TARGET("sse2") static __m128i interleaveHigh(__m128i a, __m128i b) { return _mm_unpackhi_epi32(a, b); }
+  };
+
+  template<typename P>
+  TARGET("sse2") __m128i load(const P* src) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)); }
+
+  template<typename P>
+  TARGET("sse2") void store(P* dest, __m128i value) { _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), value); }
+
+  TARGET("sse2") __m128i blend(__m128i mask, __m128i a, __m128i b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+  template<typename L>
+  TARGET("sse2") void sse2Expand(const void* src, void* dest, size_t count, u32 factor)
+  {
+    using pixel_t = typename L::pixel_t;
+    constexpr size_t N = L::COUNT;
+
+    const pixel_t* in = static_cast<const pixel_t*>(src);
+    pixel_t* out = static_cast<pixel_t*>(dest);
+
+    size_t i = 0;
+
+    if (factor == 2)
+    {
+      for (; i + N <= count; i += N)
+      {
+        const __m128i v = load(in + i);
+        store(out + 2 * i, L::interleaveLow(v, v));
+        store(out + 2 * i + N, L::interleaveHigh(v, v));
+      }
+    }
+    else if (factor == 4)
+    {
+      /* interleaving doubled pixels with themselves doubles them again */
+      for (; i + N <= count; i += N)
+      {
+        const __m128i v = load(in + i);
+        const __m128i lo = L::interleaveLow(v, v), hi = L::interleaveHigh(v, v);
+        store(out + 4 * i, L::interleaveLow(lo, lo));
+        store(out + 4 * i + N, L::interleaveHigh(lo, lo));
+        store(out + 4 * i + 2 * N, L::interleaveLow(hi, hi));
+        store(out + 4 * i + 3 * N, L::interleaveHigh(hi, hi));
+      }
+    }
+    else
+    {
+      /* every pixel is splat over whole vectors, the next one overwrites what went past its own run */
+      const size_t vectors = (factor + N - 1) / N;
+
+      for (; i < count && i * factor + vectors * N <= count * factor; ++i)
+      {
+        const __m128i v = L::splat(in[i]);
+        for (size_t j = 0; j < vectors; ++j)
+          store(out + i * factor + j * N, v);
+      }
+    }
+
+    scalarExpand<pixel_t>(in + i, out + i * factor, count - i, factor);
+  }
+
+  template<typename L>
+  TARGET("sse2") void sse2Scale2x(const void* above, const void* row, const void* below, void* top, void* bottom, size_t count)
+  {
+    using pixel_t = typename L::pixel_t;
+    constexpr size_t N = L::COUNT;
+
+    const pixel_t* a = static_cast<const pixel_t*>(above);
+    const pixel_t* r = static_cast<const pixel_t*>(row);
+    const pixel_t* b = static_cast<const pixel_t*>(below);
+    pixel_t* t = static_cast<pixel_t*>(top);
+    pixel_t* bt = static_cast<pixel_t*>(bottom);
+
+    /* first and last pixels need their neighbours clamped, they are left to the scalar code */
+    size_t x = 0;
+
+    if (count > N + 1)
+    {
+      scale2xSpan(a, r, b, t, bt, count, 0, 1);
+
+      const __m128i ones = _mm_set1_epi32(-1);
+
+      for (x = 1; x + N + 1 <= count; x += N)
+      {
+        const __m128i B = load(a + x), H = load(b + x);
+        const __m128i D = load(r + x - 1), E = load(r + x), F = load(r + x + 1);
+
+        const __m128i edge = _mm_andnot_si128(_mm_or_si128(L::equal(B, H), L::equal(D, F)), ones);
+
+        const __m128i e0 = blend(_mm_and_si128(edge, L::equal(D, B)), D, E);
+        const __m128i e1 = blend(_mm_and_si128(edge, L::equal(B, F)), F, E);
+        const __m128i e2 = blend(_mm_and_si128(edge, L::equal(D, H)), D, E);
+        const __m128i e3 = blend(_mm_and_si128(edge, L::equal(H, F)), F, E);
+
+        store(t + 2 * x, L::interleaveLow(e0, e1));
+        store(t + 2 * x + N, L::interleaveHigh(e0, e1));
+        store(bt + 2 * x, L::interleaveLow(e2, e3));
+        store(bt + 2 * x + N, L::interleaveHigh(e2, e3));
+      }
+    }
+
+    scale2xSpan(a, r, b, t, bt, count, x, count);
+  }
+
+#endif
+
+  template<typename P>
+  void kernels(PixelConverter::Kernel kernel, Upscaler::expand_t& expand, Upscaler::scale2x_t& scale2x)
+  {
+    using Kernel = PixelConverter::Kernel;
+
+    switch (kernel)
+    {
+      case Kernel::Scalar:
+        expand = scalarExpand<P>;
+        scale2x = scalarScale2x<P>;
+        break;
+#if defined(MINIATURE_X86)
+      case Kernel::SSE2:
+      {
+        using lanes_t = std::conditional_t<sizeof(P) == sizeof(u16), Lanes16, Lanes32>;
+        expand = sse2Expand<lanes_t>;
+        scale2x = sse2Scale2x<lanes_t>;
+        break;
+      }
+#endif
+      default:
+        break;
+    }
+  }
+}
+
+Upscaler::Upscaler(ScaleFilter filter, u32 factor, size_t bytesPerPixel) : Upscaler()
+{
+  for (Kernel kernel : { Kernel::SSE2, Kernel::Scalar })
+  {
+    if (PixelConverter::isSupported(kernel))
+    {
+      *this = Upscaler(filter, factor, bytesPerPixel, kernel);
+      break;
+    }
+  }
+}
+
+Upscaler::Upscaler(ScaleFilter filter, u32 factor, size_t bytesPerPixel, Kernel kernel) : Upscaler()
+{
+  if (!isValid(filter, factor) || !PixelConverter::isSupported(kernel))
+    return;
+
+  if (bytesPerPixel == sizeof(u16))
+    kernels<u16>(kernel, _expand, _scale2x);
+  else if (bytesPerPixel == sizeof(u32))
+    kernels<u32>(kernel, _expand, _scale2x);
+
+  if (_expand)
+  {
+    _filter = filter;
+    _factor = factor;
+    _bytesPerPixel = bytesPerPixel;
+    _kernel = kernel;
+  }
+}
+
+void Upscaler::scale(const void* src, coord_t width, coord_t height, void* dest, size_t stride)
+{
+  const u8* in = static_cast<const u8*>(src);
+  u8* out = static_cast<u8*>(dest);
+
+  const size_t pitch = width * _bytesPerPixel;
+
+  if (_filter == ScaleFilter::Nearest)
+  {
+    for (coord_t y = 0; y < height; ++y)
+    {
+      u8* row = out + y * _factor * stride;
+
+      if (_factor == 1)
+        std::memcpy(row, in + y * pitch, pitch);
+      else
+        _expand(in + y * pitch, row, width, _factor);
+
+      for (u32 i = 1; i < _factor; ++i)
+        std::memcpy(row + i * stride, row, pitch * _factor);
+    }
+  }
+  else
+  {
+    /* past 2x both output rows of Scale2x go through scratch first and are then expanded like nearest */
+    const u32 repeat = _factor / 2;
+    const size_t scaledPitch = pitch * 2;
+
+    if (repeat > 1)
+      _scratch.resize(scaledPitch * 2);
+
+    for (coord_t y = 0; y < height; ++y)
+    {
+      const u8* above = in + (y ? y - 1 : 0) * pitch;
+      const u8* row = in + y * pitch;
+      const u8* below = in + (y + 1 < height ? y + 1 : y) * pitch;
+
+      u8* first = out + 2 * y * repeat * stride;
+      u8* second = first + repeat * stride;
+
+      if (repeat == 1)
+      {
+        _scale2x(above, row, below, first, second, width);
+        continue;
+      }
+
+      _scale2x(above, row, below, _scratch.data(), _scratch.data() + scaledPitch, width);
+      _expand(_scratch.data(), first, 2 * width, repeat);
+      _expand(_scratch.data() + scaledPitch, second, 2 * width, repeat);
+
+      for (u32 i = 1; i < repeat; ++i)
+      {
+        std::memcpy(first + i * stride, first, scaledPitch * repeat);
+        std::memcpy(second + i * stride, second, scaledPitch * repeat);
+      }
+    }
+  }
+}
+
+bool Upscaler::isValid(ScaleFilter filter, u32 factor)
+{
+  if (factor < 1 || factor > MAX_FACTOR)
+    return false;
+
+  return filter != ScaleFilter::Scale2x || factor % 2 == 0;
+}
+
+const char* Upscaler::name(ScaleFilter filter)
+{
+  static const char* names[] = { "nearest", "scale2x" };
+  return names[size_t(filter)];
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "PixelConverter.h"
+
+#include <vector>
+
+enum class ScaleFilter
+{
+  Nearest, // any factor from 1 to MAX_FACTOR
+  Scale2x // Scale2x (EPX) edge smoothing, even factors only, whatever exceeds 2x is replicated
+};
+
+/*
+  Software upscaler for when there's no GPU to stretch frames. It works on already converted host pixels
+  of 2 or 4 bytes and writes straight into the destination, one source row at a time: the source rows
+  involved stay in cache while the scaled rows are produced once and then replicated vertically.
+*/
+class Upscaler
+{
+public:
+  using Kernel = PixelConverter::Kernel;
+
+  static constexpr u32 MAX_FACTOR = 8;
+
+  using expand_t = void(*)(const void* src, void* dest, size_t count, u32 factor);
+  using scale2x_t = void(*)(const void* above, const void* row, const void* below, void* top, void* bottom, size_t count);
+
+private:
+  ScaleFilter _filter;
+  u32 _factor;
+  size_t _bytesPerPixel;
+  Kernel _kernel;
+
+  expand_t _expand;
+  scale2x_t _scale2x;
+
+  std::vector<u8> _scratch;
+
+public:
+  Upscaler() : _filter(ScaleFilter::Nearest), _factor(0), _bytesPerPixel(0), _kernel(Kernel::None), _expand(nullptr), _scale2x(nullptr) { }
+  /* picks the widest kernel supported by the running cpu */
+  Upscaler(ScaleFilter filter, u32 factor, size_t bytesPerPixel);
+  Upscaler(ScaleFilter filter, u32 factor, size_t bytesPerPixel, Kernel kernel);
+
+  operator bool() const { return _expand != nullptr; }
+
+  ScaleFilter filter() const { return _filter; }
+  u32 factor() const { return _factor; }
+  Kernel kernel() const { return _kernel; }
+
+  /* src holds width * height packed pixels, dest must have room for factor times as many rows of stride bytes */
+  void scale(const void* src, coord_t width, coord_t height, void* dest, size_t stride);
+
+  static bool isValid(ScaleFilter filter, u32 factor);
+  static const char* name(ScaleFilter filter);
+};
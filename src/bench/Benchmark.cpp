@@ -0,0 +1,440 @@
+#include "Machine.h"
+#include "Assembler.h"
+#include "Translator.h"
+#include "ColorLUT.h"
+#include "Demo.h"
+#include "PixelConverter.h"
+#include "Upscaler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+  using clock = std::chrono::steady_clock;
+
+  /* a benchmark renders one "frame" of a fixed scene per iteration */
+  struct Benchmark
+  {
+    std::string name;
+    u64 pixels;
+    std::function<void(Machine&)> setup;
+    std::function<void(Machine&)> frame;
+  };
+
+  struct Result
+  {
+    std::string name;
+    u64 pixels;
+    u64 iterations;
+    double nsPerFrame;
+
+    double nsPerPixel() const { return pixels ? nsPerFrame / pixels : 0.0; }
+    double framesPerSecond() const { return 1e9 / nsPerFrame; }
+  };
+
+  struct Options
+  {
+    std::string filter;
+    path json;
+    double minTime = 0.2;
+  };
+
+  volatile u32 sink;
+
+  /* what primitives draw with, an indexed framebuffer takes the last entry of the last palette */
+  constexpr pix_t INK = Specs::INDEXED_FRAMEBUFFER ? pix_t(Color::indexed(Specs::PALETTE_COUNT - 1, Specs::PALETTE_SIZE - 1)) : pix_t(Color::WHITE);
+
+  const char* sizeName(SpriteSize size)
+  {
+    static const char* names[] = { "8", "16", "24", "32", "48", "64" };
+    return names[coord_t(size) - 1];
+  }
+
+  /* random but fixed sprite graphics and palettes, entry 0 of every palette stays transparent */
+  void setupSpriteData(Machine& machine)
+  {
+    std::mt19937 rng(1234);
+
+    for (addr_t i = 0; i < Specs::SPRITE_MAP_SIZE_IN_BYTES * Specs::SPRITE_MAPS_COUNT; ++i)
+      machine.memory().byte(Address::SPRITE_MAP + i) = u8(rng());
+
+    for (auto& palette : machine.palettes())
+      for (coord_t i = 1; i < Specs::PALETTE_SIZE; ++i)
+        palette[i] = Color::OPAQUE_FLAG | col_t(rng() & 0x7FFF);
+  }
+
+  Benchmark spriteBenchmark(s32 count, SpriteSize size, bool flippedX, bool flippedY, u8 spritesPerLine = 0)
+  {
+    const coord_t extent = Specs::SPRITE_WIDTH * coord_t(size);
+
+    std::string name = "sprites/" + std::to_string(count);
+    if (count)
+      name += std::string("/") + sizeName(size) + (flippedX ? "/fx" : "/--") + (flippedY ? "fy" : "--");
+    if (spritesPerLine)
+      name += "/limit" + std::to_string(spritesPerLine);
+
+    auto setup = [=](Machine& machine) {
+      setupSpriteData(machine);
+      machine.videoRegisters().spritesPerLine = spritesPerLine;
+
+      std::mt19937 rng(count * 31 + coord_t(size));
+      for (s32 i = 0; i < count; ++i)
+      {
+        SpriteInfo& info = machine.spriteInfos()[i];
+        info.flags.set(SpriteFlag::Enabled);
+        info.flags.set(SpriteFlag::FlippedX, flippedX);
+        info.flags.set(SpriteFlag::FlippedY, flippedY);
+        info.width = size;
+        info.height = size;
+        info.x = s16(rng() % (Specs::SCREEN_WIDTH - extent + 1));
+        info.y = s16(rng() % (Specs::SCREEN_HEIGHT - extent + 1));
+        info.index = u8(rng() % 128);
+        info.palette = u8(rng() % Specs::PALETTE_COUNT);
+      }
+    };
+
+    return { name, u64(count) * extent * extent, setup, [](Machine& machine) { machine.screen().rasterizeSprites(); } };
+  }
+
+  Benchmark lineBenchmark(const std::string& name, coord_t x0, coord_t y0, coord_t x1, coord_t y1)
+  {
+    const u64 pixels = std::max(std::abs(x1 - x0), std::abs(y1 - y0)) + 1;
+    return { "line/" + name, pixels, [](Machine&) { }, [=](Machine& machine) { machine.screen().line(x0, y0, x1, y1, INK); } };
+  }
+
+  /* runs a program until it yields once per frame, pixels are the instructions it executes on the way */
+  Benchmark cpuBenchmark(bool translated, const std::string& name, const std::vector<u32>& code, const std::function<void(Machine&)>& setup = [](Machine&) { })
+  {
+    const auto load = [=](Machine& machine) {
+      setup(machine);
+      machine.load(code.data(), code.size());
+    };
+
+    Machine probe;
+    probe.reset();
+    load(probe);
+
+    if (!translated)
+      return { "cpu/" + name, Cpu::run(probe, ~u32(0)), load, [](Machine& machine) { Cpu::run(machine, ~u32(0)); } };
+
+    /* blocks are translated during the first frames, the rest run them */
+    auto translator = std::make_shared<Translator>();
+    return { "cpu/" + name + "/translated", Cpu::run(probe, ~u32(0)), load, [translator](Machine& machine) { translator->run(machine, ~u32(0)); } };
+  }
+
+  /* a program repeating body 1000 times per frame, registers 14 and 15 belong to the loop */
+  std::vector<u32> cpuLoop(const std::function<void(Assembler&)>& body)
+  {
+    enum : u8 { COUNTER = 15 };
+
+    Assembler a;
+    const auto start = a.here();
+    a.load(COUNTER, 1000);
+    const auto loop = a.here();
+    body(a);
+    a.imm8(Opcode::Addi, COUNTER, COUNTER, -1);
+    a.branch(Opcode::Jnz, COUNTER, loop);
+    a.op(Opcode::Yield);
+    a.branch(Opcode::Jmp, 0, start);
+
+    std::vector<u32> code;
+    a.assemble(code);
+    return code;
+  }
+
+  std::vector<Benchmark> benchmarks()
+  {
+    const u64 screenPixels = Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT;
+    const coord_t w = Specs::SCREEN_WIDTH, h = Specs::SCREEN_HEIGHT;
+
+    std::vector<Benchmark> benchmarks;
+
+    benchmarks.push_back({ "fill", screenPixels, [](Machine&) { }, [](Machine& machine) { machine.screen().fill(INK); } });
+
+    benchmarks.push_back({ "rect/full", screenPixels, [](Machine&) { }, [=](Machine& machine) { machine.screen().rect(0, 0, w, h, INK); } });
+    benchmarks.push_back({ "rect/16x16", 16 * 16, [](Machine&) { }, [](Machine& machine) { machine.screen().rect(40, 40, 16, 16, INK); } });
+
+    benchmarks.push_back(lineBenchmark("horizontal", 0, h / 2, w - 1, h / 2));
+    benchmarks.push_back(lineBenchmark("vertical", w / 2, 0, w / 2, h - 1));
+    benchmarks.push_back(lineBenchmark("diagonal", 0, 0, w - 1, h - 1));
+    benchmarks.push_back(lineBenchmark("long", 0, h - 1, w - 1, h / 3));
+    benchmarks.push_back(lineBenchmark("short", 10, 10, 17, 13));
+
+    /* vector UI primitives, pixels is roughly the area or the perimeter they cover */
+    benchmarks.push_back({ "circle/40", 251, [](Machine&) { }, [](Machine& machine) { machine.screen().circle(64, 64, 40, INK); } });
+    benchmarks.push_back({ "fillCircle/40", 5025, [](Machine&) { }, [](Machine& machine) { machine.screen().fillCircle(64, 64, 40, INK); } });
+    benchmarks.push_back({ "fillCircle/clipped", 5025 / 4, [](Machine&) { }, [](Machine& machine) { machine.screen().fillCircle(0, 0, 40, INK); } });
+    benchmarks.push_back({ "triangle", 280, [](Machine&) { }, [](Machine& machine) { machine.screen().triangle(10, 100, 110, 90, 50, 5, INK); } });
+    benchmarks.push_back({ "fillTriangle", 4650, [](Machine&) { }, [](Machine& machine) { machine.screen().fillTriangle(10, 100, 110, 90, 50, 5, INK); } });
+    benchmarks.push_back({ "polyline/32", 32 * 12, [](Machine&) { }, [](Machine& machine) {
+      static std::array<point_t, 33> points;
+      for (s32 i = 0; i < 33; ++i)
+        points[i] = { 4 + i * 120 / 32, 64 + ((i & 1) ? 12 : -12) };
+      machine.screen().polyline(points.data(), points.size(), INK);
+    } });
+
+    benchmarks.push_back(spriteBenchmark(0, SpriteSize::_8, false, false));
+    for (s32 count : { 32, 128 })
+      for (SpriteSize size : { SpriteSize::_8, SpriteSize::_16, SpriteSize::_24, SpriteSize::_32, SpriteSize::_48, SpriteSize::_64 })
+        for (s32 flips = 0; flips < 4; ++flips)
+          benchmarks.push_back(spriteBenchmark(count, size, flips & 1, flips & 2));
+    for (u8 limit : { 8, 16 })
+      benchmarks.push_back(spriteBenchmark(128, SpriteSize::_32, false, false, limit));
+
+    /* fully covered scrolling background layers */
+    for (s32 layers = 1; layers <= Specs::TILE_MAPS_COUNT; ++layers)
+    {
+      benchmarks.push_back({ "tilemap/" + std::to_string(layers), screenPixels * layers, [=](Machine& machine) {
+        setupSpriteData(machine);
+
+        std::mt19937 rng(layers);
+        for (s32 i = 0; i < layers; ++i)
+        {
+          for (u8& tile : machine.tileMaps()[i])
+            tile = u8(rng());
+
+          TileMapInfo& info = machine.tileMapInfos()[i];
+          info.flags.set(TileMapFlag::Enabled);
+          info.palette = u8(i);
+          info.x = 13 + i * 50;
+          info.y = 7 + i * 30;
+        }
+      }, [](Machine& machine) { machine.screen().rasterize(); } });
+    }
+
+    /* interpreter dispatch or translated blocks, ns/pixel is the cost of a single instruction */
+    for (bool translated : { false, true })
+    {
+      benchmarks.push_back(cpuBenchmark(translated, "alu", cpuLoop([](Assembler& a) {
+        a.op(Opcode::Add, 1, 1, 2);
+        a.op(Opcode::Xor, 3, 3, 1);
+        a.op(Opcode::Shl, 4, 1, 5);
+        a.op(Opcode::Sub, 2, 2, 3);
+        a.op(Opcode::Mul, 5, 4, 1);
+        a.op(Opcode::Or, 6, 6, 5);
+      })));
+      benchmarks.push_back(cpuBenchmark(translated, "memory", cpuLoop([](Assembler& a) {
+        a.load(1, Address::RAM);
+        a.imm8(Opcode::Ldw, 2, 1, 0);
+        a.imm8(Opcode::Addi, 2, 2, 1);
+        a.imm8(Opcode::Stw, 2, 1, 0);
+        a.imm8(Opcode::Ldb, 3, 1, 4);
+        a.imm8(Opcode::Stb, 3, 1, 5);
+      })));
+      benchmarks.push_back(cpuBenchmark(translated, "branches", cpuLoop([](Assembler& a) {
+        const auto skip = a.label();
+        a.load(2, 500);
+        a.op(Opcode::Slt, 1, 15, 2);
+        a.branch(Opcode::Jz, 1, skip);
+        a.imm8(Opcode::Addi, 3, 3, 1);
+        a.bind(skip);
+        a.op(Opcode::Seq, 4, 15, 3);
+      })));
+      benchmarks.push_back(cpuBenchmark(translated, "pset", cpuLoop([](Assembler& a) {
+        a.imm8(Opcode::Addi, 1, 1, 1);
+        a.load(3, 127);
+        a.op(Opcode::And, 1, 1, 3);
+        a.op(Opcode::Pset, 1, 1, 2);
+      })));
+      benchmarks.push_back(cpuBenchmark(translated, "demo", demo::program(), demo::setup));
+    }
+
+    /* every 15 bit color plus the opaque flag, unpacked through Color::ccc */
+    benchmarks.push_back({ "color/ccc", screenPixels, [](Machine&) { }, [=](Machine&) {
+      u32 acc = 0;
+      for (u32 i = 0; i < screenPixels; ++i)
+      {
+        color_t c = Color::ccc(u16(i | Color::OPAQUE_FLAG));
+        acc += c.r ^ c.g ^ c.b;
+      }
+      sink = acc;
+    } });
+
+    /* SDL free equivalent of MainView::blitFramebuffer() for an ARGB8888 display format */
+    benchmarks.push_back({ "blit/scalar-argb8888", screenPixels, [](Machine& machine) { setupSpriteData(machine); }, [=](Machine& machine) {
+      static std::vector<u32> host(screenPixels);
+      const Screen& screen = machine.screen();
+      for (u32 i = 0; i < screenPixels; ++i)
+      {
+        color_t c = Color::ccc(screen.pixel(i));
+        host[i] = 0xFF000000 | (c.r << 16) | (c.g << 8) | c.b;
+      }
+      sink = host[screenPixels / 2];
+    } });
+
+    /* vectorized conversion kernels for every host format the cpu can run */
+    for (HostFormat format : { HostFormat::ARGB8888, HostFormat::ABGR8888, HostFormat::RGB565 })
+    {
+      for (PixelConverter::Kernel kernel : { PixelConverter::Kernel::Scalar, PixelConverter::Kernel::SSE2, PixelConverter::Kernel::AVX2 })
+      {
+        const PixelConverter converter(format, kernel);
+
+        if (!converter)
+          continue;
+
+        benchmarks.push_back({ std::string("blit/") + PixelConverter::name(format) + "/" + PixelConverter::name(kernel), screenPixels,
+          [](Machine& machine) { setupSpriteData(machine); }, [=](Machine& machine) {
+          static std::vector<u32> host(screenPixels);
+          converter.convert(machine.screen().pixels(), host.data(), screenPixels);
+          sink = host[screenPixels / 4];
+        } });
+      }
+    }
+
+    /* lookup table path used for other display formats and full brightness */
+    for (bool fullBrightness : { false, true })
+    {
+      auto lut = std::make_shared<ColorLUT>();
+      lut->build(HostFormat::ARGB8888, fullBrightness);
+
+      benchmarks.push_back({ std::string("blit/argb8888/lut") + (fullBrightness ? "-full" : ""), screenPixels,
+        [](Machine& machine) { setupSpriteData(machine); }, [=](Machine& machine) {
+        static std::vector<u32> host(screenPixels);
+        lut->convert(machine.screen().pixels(), host.data(), screenPixels);
+        sink = host[screenPixels / 4];
+      } });
+    }
+
+    /* software upscaling of an already converted ARGB8888 frame */
+    for (auto mode : std::vector<std::pair<ScaleFilter, u32>>{ { ScaleFilter::Nearest, 2 }, { ScaleFilter::Nearest, 3 }, { ScaleFilter::Nearest, 4 }, { ScaleFilter::Nearest, 8 }, { ScaleFilter::Scale2x, 2 }, { ScaleFilter::Scale2x, 4 } })
+    {
+      for (PixelConverter::Kernel kernel : { PixelConverter::Kernel::Scalar, PixelConverter::Kernel::SSE2 })
+      {
+        auto upscaler = std::make_shared<Upscaler>(mode.first, mode.second, sizeof(u32), kernel);
+
+        if (!*upscaler)
+          continue;
+
+        /* blocky pixel art made of few colors so that Scale2x finds edges to smooth, only scaling is measured */
+        const u32 factor = mode.second;
+        auto host = std::make_shared<std::vector<u32>>(screenPixels);
+        auto scaled = std::make_shared<std::vector<u32>>(screenPixels * factor * factor);
+
+        benchmarks.push_back({ std::string("upscale/") + Upscaler::name(mode.first) + "/" + std::to_string(factor) + "x/" + PixelConverter::name(kernel), screenPixels * factor * factor,
+          [=](Machine&) {
+          std::mt19937 rng(factor);
+          for (coord_t y = 0; y < h; ++y)
+            for (coord_t x = 0; x < w; ++x)
+              (*host)[y * w + x] = 0xFF000000 | (((x / 3) * 7 + (y / 2) * 13 + (rng() % 8 == 0)) % 5) * 0x333333;
+        }, [=](Machine&) {
+          upscaler->scale(host->data(), w, h, scaled->data(), w * factor * sizeof(u32));
+          sink = (*scaled)[scaled->size() / 3];
+        } });
+      }
+    }
+
+    return benchmarks;
+  }
+
+  Result run(const Benchmark& benchmark, double minTime)
+  {
+    Machine machine;
+    machine.reset();
+    benchmark.setup(machine);
+
+    /* warm up caches and branch predictors before measuring */
+    for (s32 i = 0; i < 16; ++i)
+      benchmark.frame(machine);
+
+    u64 iterations = 0, batch = 16;
+    clock::duration elapsed = clock::duration::zero();
+
+    while (std::chrono::duration<double>(elapsed).count() < minTime)
+    {
+      const auto start = clock::now();
+      for (u64 i = 0; i < batch; ++i)
+        benchmark.frame(machine);
+      elapsed += clock::now() - start;
+
+      iterations += batch;
+      batch *= 2;
+    }
+
+    sink = machine.screen().pixel(0);
+
+    const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    return { benchmark.name, benchmark.pixels, iterations, ns / iterations };
+  }
+
+  bool writeJson(const std::vector<Result>& results, const path& fileName)
+  {
+    FILE* out = fopen(fileName.c_str(), "w");
+
+    if (!out)
+      return false;
+
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      const Result& r = results[i];
+      fprintf(out, "    { \"name\": \"%s\", \"pixels\": %llu, \"iterations\": %llu, \"ns_per_frame\": %.3f, \"ns_per_pixel\": %.4f, \"frames_per_sec\": %.1f }%s\n",
+        r.name.c_str(), (unsigned long long)r.pixels, (unsigned long long)r.iterations, r.nsPerFrame, r.nsPerPixel(), r.framesPerSecond(),
+        i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    fclose(out);
+    return true;
+  }
+
+  bool parse(int argc, char* argv[], Options& options)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+
+      if (arg == "--filter" && hasValue)
+        options.filter = argv[++i];
+      else if (arg == "--json" && hasValue)
+        options.json = argv[++i];
+      else if (arg == "--min-time" && hasValue)
+        options.minTime = std::atof(argv[++i]) / 1000.0;
+      else
+        return false;
+    }
+
+    return true;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options options;
+
+  if (!parse(argc, argv, options))
+  {
+    printf("usage: miniature-bench [--filter TEXT] [--json FILE] [--min-time MS]\n");
+    return -1;
+  }
+
+  std::vector<Result> results;
+
+  printf("%-32s %10s %14s %12s %14s\n", "benchmark", "pixels", "ns/frame", "ns/pixel", "frames/sec");
+
+  for (const Benchmark& benchmark : benchmarks())
+  {
+    if (benchmark.name.find(options.filter) == std::string::npos)
+      continue;
+
+    Result r = run(benchmark, options.minTime);
+    printf("%-32s %10llu %14.1f %12.4f %14.1f\n", r.name.c_str(), (unsigned long long)r.pixels, r.nsPerFrame, r.nsPerPixel(), r.framesPerSecond());
+    results.push_back(r);
+  }
+
+  if (!options.json.empty() && !writeJson(results, options.json))
+  {
+    printf("Error while writing results to %s.\n", options.json.c_str());
+    return -1;
+  }
+
+  return 0;
+}
@@ -3,8 +3,11 @@
 #include "MainView.h"
 #include "ViewManager.h"
 
+#include "Demo.h"
+
 #include <vector>
 #include <algorithm>
+#include <cmath>
 
 using namespace ui;
 
@@ -14,16 +17,172 @@ u64 offset = 0;
 Surface surface;
 
 
-void MainView::blitFramebuffer()
+void MainView::blitFramebuffer(const Emulator::Frame& frame)
+{
+  ProfileScope scope(Profiler::Stage::Blit);
+
+  constexpr coord_t width = Specs::SCREEN_WIDTH, height = Specs::SCREEN_HEIGHT;
+
+  const PixelConverter& converter = gvm->pixelConverter();
+  const ColorLUT& lut = gvm->colorLUT();
+
+  u8* pixels = static_cast<u8*>(surface.surface->pixels);
+  coord_t first = height, last = 0;
+
+  /* known display formats are converted a whole row at a time, everything else goes through the lookup table */
+  for (coord_t y = 0; y < height; ++y)
+  {
+    /* the frame carries the lines of the frames that were skipped before it too */
+    if (!stale.test(y) && !frame.lines.test(y))
+      continue;
+
+    const col_t* src = frame.pixels.data() + y * width;
+    stale.reset(y);
+
+    if (converter && !lut.fullBrightness())
+      converter.convert(src, pixels + y * surface.surface->pitch, width);
+    else
+      lut.convert(src, pixels + y * surface.surface->pitch, width);
+
+    first = std::min(first, y);
+    last = y;
+  }
+
+  if (first <= last)
+  {
+    ProfileScope scope(Profiler::Stage::Upload);
+    surface.update(SDL_MakeRect(0, first, width, last - first + 1));
+  }
+}
+
+namespace
+{
+  const path RECORDING_FILE = "session.mrl";
+  const path PROFILE_FILE = "profile.json";
+
+  /* screen is drawn at 10, 10 scaled 3 times */
+  constexpr s32 SCREEN_OFFSET = 10;
+  constexpr s32 SCREEN_SCALE = 3;
+
+  Button buttonForKey(SDL_Keycode key)
+  {
+    switch (key)
+    {
+      case SDLK_UP: return Button::Up;
+      case SDLK_DOWN: return Button::Down;
+      case SDLK_LEFT: return Button::Left;
+      case SDLK_RIGHT: return Button::Right;
+      case SDLK_z: return Button::A;
+      case SDLK_x: return Button::B;
+      case SDLK_RETURN: return Button::Start;
+      case SDLK_BACKSPACE: return Button::Select;
+      default: return Button(0);
+    }
+  }
+}
+
+void MainView::setup(Machine& machine, const Cartridge* cartridge)
+{
+  if (cartridge)
+    cartridge->load(machine);
+  else
+    demo::setup(machine);
+}
+
+bool MainView::loadCartridge(const path& fileName)
 {
-  Screen& screen = machine.screen();
-  
-  for (int i = 0; i < machine.screen().width() * machine.screen().height(); ++i)
+  auto loaded = std::make_shared<Cartridge>();
+
+  if (!loaded->open(fileName))
+    return false;
+
+  cartridge = loaded;
+
+  emulator.post([this, loaded](Machine& machine) {
+    setup(machine, loaded.get());
+    scripted = false;
+  });
+
+  printf("Loaded cartridge %s\n", fileName.c_str());
+  return true;
+}
+
+void MainView::startAudio()
+{
+  SDL_AudioSpec desired = { };
+  desired.freq = Specs::SOUND_SAMPLE_RATE;
+  desired.format = AUDIO_S16SYS;
+  desired.channels = 1;
+  desired.samples = 512;
+  desired.userdata = &emulator;
+  desired.callback = [](void* userdata, Uint8* stream, int length) {
+    static_cast<Emulator*>(userdata)->readAudio(reinterpret_cast<s16*>(stream), length / sizeof(s16));
+  };
+
+  /* the format is fixed, SDL converts whatever the device wants */
+  SDL_AudioSpec obtained;
+  audio = SDL_OpenAudioDevice(nullptr, 0, &desired, &obtained, 0);
+
+  if (!audio)
+  {
+    printf("Unable to open an audio device, running without sound: %s\n", SDL_GetError());
+    return;
+  }
+
+  SDL_PauseAudioDevice(audio, 0);
+}
+
+void MainView::stopAudio()
+{
+  if (audio)
   {
-    col_t nc = screen.pixel(i);
-    color_t c = Color::ccc(nc);
-    surface.pixel(i) = SDL_MapRGBA(gvm->displayFormat(), c.r, c.g, c.b, 255);
+    SDL_CloseAudioDevice(audio);
+    printf("Audio underruns: %llu\n", (unsigned long long)emulator.underruns());
   }
+
+  audio = 0;
+}
+
+void MainView::toggleRecording()
+{
+  emulator.post([this, cartridge = cartridge](Machine& machine) {
+    if (!recording)
+    {
+      /* sessions always start from a fresh machine so that they can be replayed from the same state */
+      setup(machine, cartridge.get());
+      log.clear();
+      recording = true;
+      printf("Recording input into %s\n", RECORDING_FILE.c_str());
+    }
+    else
+    {
+      recording = false;
+
+      if (log.save(RECORDING_FILE))
+        printf("Saved %llu frames with %zu input changes into %s\n", (unsigned long long)log.frames(), log.changes().size(), RECORDING_FILE.c_str());
+      else
+        printf("Error while saving %s\n", RECORDING_FILE.c_str());
+    }
+  });
+}
+
+void MainView::replayRecording()
+{
+  InputLog recorded;
+
+  if (!recorded.load(RECORDING_FILE))
+    return;
+
+  Machine replayed;
+  setup(replayed, cartridge.get());
+
+  const ReplayResult result = Replay::run(replayed, recorded, cartridge ? Replay::update_t() : Replay::update_t(demo::update));
+
+  printf("Replayed %llu frames at %.0f frames/sec, ", (unsigned long long)result.frames, result.framesPerSecond());
+  if (result.matches())
+    printf("every frame matches\n");
+  else
+    printf("%llu frames differ starting from %llu\n", (unsigned long long)result.mismatches, (unsigned long long)result.firstMismatch);
 }
 
 std::string readableBytes(u64 amount)
@@ -32,12 +191,14 @@ std::string readableBytes(u64 amount)
   else return std::to_string(amount / KB1) + " Kb";
 }
 
-MainView::MainView(ViewManager* gvm) : gvm(gvm)
+MainView::MainView(ViewManager* gvm) : gvm(gvm), input(), recording(false), scripted(true), audio(0)
 {
+  /* texture content is undefined until every line has been uploaded once */
+  stale.set();
+
   mouse = { -1, -1 };
 
-  machine.reset();
-  machine.screen().fill(Color::ccc(27, 89, 156));
+  demo::setup(emulator.machine());
 
 
   printf("Total memory: %s\n", readableBytes(Specs::MEMORY_SIZE).c_str());
@@ -53,6 +214,10 @@ MainView::MainView(ViewManager* gvm) : gvm(gvm)
 
   std::vector<std::pair<std::string, addr_t>> addresses;
   addresses.emplace_back(std::make_pair("tile-map", Address::TILE_MAP));
+  addresses.emplace_back(std::make_pair("tile-map-infos", Address::TILE_MAP_INFOS));
+  addresses.emplace_back(std::make_pair("video-registers", Address::VIDEO_REGISTERS));
+  addresses.emplace_back(std::make_pair("input", Address::INPUT));
+  addresses.emplace_back(std::make_pair("sound-registers", Address::SOUND_REGISTERS));
   addresses.emplace_back(std::make_pair("palettes", Address::PALETTES));
   addresses.emplace_back(std::make_pair("sprite-infos", Address::SPRITE_INFOS));
   addresses.emplace_back(std::make_pair("sprite-map", Address::SPRITE_MAP));
@@ -61,6 +226,15 @@ MainView::MainView(ViewManager* gvm) : gvm(gvm)
   for (const auto& entry : addresses)
     printf("Address %08x: %s\n", entry.second, entry.first.c_str());
 
+  /* the machine belongs to the emulation thread from now on */
+  emulator.start([this](Machine& machine) {
+    if (scripted)
+      demo::update(machine);
+
+    if (recording)
+      log.record(static_cast<const Machine&>(machine).input(), hashFramebuffer(machine.screen()));
+  });
+
 }
 
 void MainView::render()
@@ -69,104 +243,84 @@ void MainView::render()
 
   gvm->clear(20, 20, 20);
 
-  auto& screen = machine.screen();
+  constexpr coord_t width = Specs::SCREEN_WIDTH, height = Specs::SCREEN_HEIGHT;
 
   if (!surface)
   {
-    surface = gvm->allocate(screen.width(), screen.height());
-
-    auto& info = machine.spriteInfos()[0];
-    info.flags |= SpriteFlag::Enabled;
-    info.flags |= SpriteFlag::FlippedY;
-    info.x = 10;
-    info.y = 10;
-    info.width = SpriteSize::_16;
-    info.height = SpriteSize::_16;
-
-    machine.palettes()[0][1] = Color::ccc(200, 76, 12);
-    machine.palettes()[0][2] = Color::ccc(252, 188, 176);
-    machine.palettes()[0][3] = Color::ccc(0, 0, 0);
-
-    Sprite& sprite = machine.sprites()[0];
-    sprite.setRow(0, { 0, 0, 0, 0, 0, 0, 1, 1 });
-    sprite.setRow(1, { 0, 0, 0, 0, 0, 1, 1, 1 });
-    sprite.setRow(2, { 0, 0, 0, 0, 1, 1, 1, 1 });
-    sprite.setRow(3, { 0, 0, 0, 3, 3, 1, 1, 1 });
-    sprite.setRow(4, { 0, 0, 1, 1, 2, 3, 1, 1 });
-    sprite.setRow(5, { 0, 1, 1, 1, 2, 3, 1, 1 });
-    sprite.setRow(6, { 0, 1, 1, 1, 2, 3, 3, 3 });
-    sprite.setRowString(7, "11112321");
-
-    Sprite& sprite1 = machine.sprites()[1];
-    sprite1.setRowString(0, "11000000");
-    sprite1.setRowString(1, "11100000");
-    sprite1.setRowString(2, "11110000");
-    sprite1.setRowString(3, "11133000");
-    sprite1.setRowString(4, "11321100");
-    sprite1.setRowString(5, "11321110");
-    sprite1.setRowString(6, "33321110");
-    sprite1.setRowString(7, "12321111");
-
-    Sprite& sprite2 = machine.sprites()[16];
-    sprite2.setString("11112221" "11111111" "01111222" "00002222" "00002222" "00033222" "00033322" "00003330");
-
-    Sprite& sprite3 = machine.sprites()[17];
-    sprite3.setString("12221111" "11111111" "22211110" "22220000" "22223300" "22333330" "23333330" "03333300" );
-  }
-
-  screen.rasterizeSprites();
-
-  static u64 counter = 0;
-
-  ++counter;
-
-  if (counter % 4 == 0)
-  {
-    machine.spriteInfos()[0].flags.flip(SpriteFlag::FlippedY);
-    ++machine.spriteInfos()[0].x;
-
+    surface = gvm->allocate(width, height);
   }
 
-  if (counter % 16 == 0)
-  {
-    col_t* buffer = machine.memory().addr<col_t>(Address::VRAM);
-
-    for (int i = 0; i < Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT; ++i)
-    {
-      color_t c = Color::ccc(buffer[i]);
-      color_t d = { 27, 89, 156 };
-
-      buffer[i] = Color::ccc((c.r + d.r) / 2, (c.g + d.g) / 2, (c.b + d.b) / 2);
-    }
-  }
+  /* emulation runs on its own thread, only its latest frame is presented and older ones are dropped */
+  if (emulator.acquire() || stale.any())
+    blitFramebuffer(emulator.frame());
 
   /*screen.rect(10, 10, 16, 16, rand() % 0xFFFF);
   screen.line(1, 1, 30, 30, screen.ccc(255, 0, 0));
   screen.line(1, 2, 30, 31, screen.ccc(0, 255, 0));
   screen.line(1, 3, 30, 32, screen.ccc(0, 0, 255));*/
 
-  blitFramebuffer();
-  surface.update();
-
-  gvm->blit(surface, 0, 0, screen.width(), screen.height(), 10, 10, screen.width()*3, screen.height()*3);
+  gvm->blit(surface, 0, 0, width, height, SCREEN_OFFSET, SCREEN_OFFSET, width * SCREEN_SCALE, height * SCREEN_SCALE);
 }
 
 void MainView::handleKeyboardEvent(const SDL_Event& event)
 {
-  if (event.type == SDL_KEYDOWN)
+  const Button button = buttonForKey(event.key.keysym.sym);
+
+  if (u16(button))
+  {
+    input.buttons.set(button, event.type == SDL_KEYDOWN);
+    emulator.setInput(input);
+  }
+
+  if (event.type == SDL_KEYDOWN && !event.key.repeat)
   {
     switch (event.key.keysym.sym)
     {
     case SDLK_ESCAPE: gvm->exit(); break;
+    case SDLK_F1:
+      gvm->setFullBrightness(!gvm->colorLUT().fullBrightness());
+      stale.set();
+      break;
+    case SDLK_F2: toggleRecording(); break;
+    case SDLK_F3: replayRecording(); break;
+    case SDLK_F4:
+      Profiler::setEnabled(!Profiler::enabled());
+      Profiler::reset();
+      printf("Profiler %s\n", Profiler::enabled() ? "enabled" : "disabled");
+      break;
+    case SDLK_F5:
+      Profiler::write(stdout, Profiler::Format::Text);
+      if (Profiler::save(PROFILE_FILE, Profiler::Format::Json))
+        printf("Profile saved into %s\n", PROFILE_FILE.c_str());
+      break;
     }
   }
 }
 
 void MainView::handleMouseEvent(const SDL_Event& event)
 {
-  if (event.type == SDL_MOUSEMOTION)
+  const bool motion = event.type == SDL_MOUSEMOTION;
+
+  if (!motion && event.type != SDL_MOUSEBUTTONDOWN && event.type != SDL_MOUSEBUTTONUP)
+    return;
+
+  /* buttons carry the position too, so a click lands where it happened even without motion before it */
+  mouse.x = motion ? event.motion.x : event.button.x;
+  mouse.y = motion ? event.motion.y : event.button.y;
+
+  /* the machine sees the pointer in its own pixels */
+  input.mouseX = s16(std::floor((mouse.x - SCREEN_OFFSET) / float(SCREEN_SCALE)));
+  input.mouseY = s16(std::floor((mouse.y - SCREEN_OFFSET) / float(SCREEN_SCALE)));
+
+  if (!motion)
   {
-    mouse.x = event.motion.x;
-    mouse.y = event.motion.y;
+    const u8 bit = event.button.button == SDL_BUTTON_LEFT ? 0x01 : event.button.button == SDL_BUTTON_RIGHT ? 0x02 : event.button.button == SDL_BUTTON_MIDDLE ? 0x04 : 0x00;
+
+    if (event.type == SDL_MOUSEBUTTONDOWN)
+      input.mouseButtons |= bit;
+    else
+      input.mouseButtons &= ~bit;
   }
+
+  emulator.setInput(input);
 }
\ No newline at end of file
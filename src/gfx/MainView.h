@@ -2,7 +2,12 @@
 
 #include "ViewManager.h"
 #include "Common.h"
+#include "Emulator.h"
 #include "Machine.h"
+#include "Cartridge.h"
+#include "Replay.h"
+
+#include <memory>
 
 struct ObjectGfx;
 
@@ -14,13 +19,36 @@ namespace ui
     ViewManager* gvm;
     point_t mouse;
 
-    Machine machine;
+    Emulator emulator;
+    std::bitset<Specs::SCREEN_HEIGHT> stale;
+
+    InputState input;
+
+    /* owned by the emulation thread, only touched from commands posted to it */
+    InputLog log;
+    bool recording;
+    bool scripted; // demo::update() runs after every frame, until a cartridge is loaded
+
+    /* replaces the demo when loaded, commands posted to the emulation thread get their own reference */
+    std::shared_ptr<const Cartridge> cartridge;
+
+    SDL_AudioDeviceID audio;
     
-    void blitFramebuffer();
+    void blitFramebuffer(const Emulator::Frame& frame);
+    void toggleRecording();
+    void replayRecording();
+
+    static void setup(Machine& machine, const Cartridge* cartridge);
 
   public:
     MainView(ViewManager* gvm);
 
+    bool loadCartridge(const path& fileName);
+
+    /* sound is pulled from the emulator by the audio callback, without audio everything else still runs */
+    void startAudio();
+    void stopAudio();
+
     void render() override;
     void handleKeyboardEvent(const SDL_Event& event) override;
     void handleMouseEvent(const SDL_Event& event) override;
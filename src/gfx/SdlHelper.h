@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Common.h"
+#include "ColorLUT.h"
+#include "PixelConverter.h"
+#include "Profiler.h"
 
 #include "SDL.h"
 #include "SDL_image.h"
@@ -12,7 +15,7 @@
 #if !_WIN32
 constexpr int32_t WIDTH = 320;
 constexpr int32_t HEIGHT = 240;
-#define MOUSE_ENABLED false
+#define MOUSE_ENABLED true
 #else
 constexpr int32_t WIDTH = 320;
 constexpr int32_t HEIGHT = 240;
@@ -45,6 +48,11 @@ struct Surface
   }
 
   void update() { SDL_UpdateTexture(texture, nullptr, surface->pixels, surface->pitch); }
+  void update(const SDL_Rect& rect)
+  {
+    const u8* pixels = static_cast<const u8*>(surface->pixels) + rect.y * surface->pitch + rect.x * surface->format->BytesPerPixel;
+    SDL_UpdateTexture(texture, &rect, pixels, surface->pitch);
+  }
   inline uint32_t& pixel(size_t index) { return pixels()[index]; }
   inline uint32_t* pixels() { return static_cast<uint32_t*>(surface->pixels); }
 };
@@ -75,6 +83,7 @@ struct Surface
   }
 
   void update() { }
+  void update(const SDL_Rect& rect) { }
   inline uint32_t& pixel(size_t index) { return pixels()[index]; }
   inline uint32_t* pixels() { return static_cast<uint32_t*>(surface->pixels); }
 };
@@ -90,6 +99,17 @@ using SDL_AudioDeviceID = int;
 
 #endif
 
+inline static HostFormat SDL_HostFormat(u32 format)
+{
+  switch (format)
+  {
+    case SDL_PIXELFORMAT_ARGB8888: return HostFormat::ARGB8888;
+    case SDL_PIXELFORMAT_ABGR8888: return HostFormat::ABGR8888;
+    case SDL_PIXELFORMAT_RGB565: return HostFormat::RGB565;
+    default: return HostFormat::Unknown;
+  }
+}
+
 template<typename EventHandler, typename Renderer>
 class SDL
 {
@@ -98,6 +118,8 @@ protected:
   Renderer& loopRenderer;
 
   SDL_PixelFormat* _format;
+  PixelConverter _converter;
+  ColorLUT _lut;
   SDL_Surface* _screen;
   SDL_Window* _window;
   SDL_Renderer* _renderer;
@@ -120,6 +142,10 @@ public:
   Surface allocate(int width, int height);
 
   const SDL_PixelFormat* displayFormat() { return _format; }
+  const PixelConverter& pixelConverter() const { return _converter; }
+  const ColorLUT& colorLUT() const { return _lut; }
+
+  void setFullBrightness(bool fullBrightness);
 
   void setFrameRate(u32 frameRate)
   {
@@ -194,6 +220,14 @@ void SDL<EventHandler, Renderer>::handleEvents()
         break;
 
 #if MOUSE_ENABLED
+      case SDL_MOUSEMOTION:
+#if defined(WINDOW_SCALE)
+        event.motion.x /= WINDOW_SCALE;
+        event.motion.y /= WINDOW_SCALE;
+#endif
+        eventHandler.handleMouseEvent(event);
+        break;
+
       case SDL_MOUSEBUTTONDOWN:
       case SDL_MOUSEBUTTONUP:
 #if defined(WINDOW_SCALE)
@@ -201,6 +235,7 @@ void SDL<EventHandler, Renderer>::handleEvents()
         event.button.y /= WINDOW_SCALE;
 #endif
         eventHandler.handleMouseEvent(event);
+        break;
 #endif
     }
   }
@@ -225,20 +260,40 @@ bool SDL<EventHandler, Renderer>::init()
   SDL_RendererInfo info;
   SDL_GetRendererInfo(_renderer, &info);
   _format = SDL_AllocFormat(info.texture_formats[0]);
+  _converter = PixelConverter(SDL_HostFormat(_format->format));
+  setFullBrightness(false);
 
   return true;
 }
 
+template<typename EventHandler, typename Renderer>
+void SDL<EventHandler, Renderer>::setFullBrightness(bool fullBrightness)
+{
+  /* only rebuilt when the display format or the brightness mode actually changed */
+  const SDL_PixelFormat* format = _format;
+  _lut.build(format->format, format->BytesPerPixel, fullBrightness, [format](u8 r, u8 g, u8 b) { return SDL_MapRGBA(format, r, g, b, 255); });
+}
+
 template<typename EventHandler, typename Renderer>
 void SDL<EventHandler, Renderer>::loop()
 {
   while (!willQuit)
   {
-    loopRenderer.render();
-    SDL_RenderPresent(_renderer);
+    {
+      /* frame covers the work of an iteration, the time spent waiting in capFPS() is left out */
+      ProfileScope frame(Profiler::Stage::Frame);
+
+      loopRenderer.render();
 
-    handleEvents();
+      {
+        ProfileScope present(Profiler::Stage::Present);
+        SDL_RenderPresent(_renderer);
+      }
+
+      handleEvents();
+    }
 
+    Profiler::commit();
     capFPS();
   }
 }
@@ -256,7 +311,7 @@ void SDL<EventHandler, Renderer>::deinit()
 template<typename EventHandler, typename Renderer>
 Surface SDL<EventHandler, Renderer>::allocate(int width, int height)
 {
-  SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, 32, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask);
+  SDL_Surface* surface = SDL_CreateRGBSurface(0, width, height, _format->BytesPerPixel * 8, _format->Rmask, _format->Gmask, _format->Bmask, _format->Amask);
   SDL_Texture* texture = SDL_CreateTexture(_renderer, _format->format, SDL_TEXTUREACCESS_STREAMING, width, width);
   return { surface, texture };
 }
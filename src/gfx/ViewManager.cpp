@@ -12,12 +12,13 @@ _mainView(new MainView(this))
 
 void ui::ViewManager::deinit()
 {
+  _mainView->stopAudio();
   SDL_DestroyTexture(_font);
 
   SDL::deinit();
 }
 
-bool ui::ViewManager::loadData()
+bool ui::ViewManager::loadData(const path& cartridge)
 {
   /*SDL_Surface* font = IMG_Load("font.png");
   assert(font);
@@ -27,6 +28,11 @@ bool ui::ViewManager::loadData()
   SDL_SetTextureBlendMode(_font, SDL_BLENDMODE_BLEND);
   SDL_FreeSurface(font);*/
 
+  if (!cartridge.empty() && !_mainView->loadCartridge(cartridge))
+    return false;
+
+  _mainView->startAudio();
+
   return true;
 }
 
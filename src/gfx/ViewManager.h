@@ -35,7 +35,7 @@ namespace ui
   public:
     ViewManager();
 
-    bool loadData();
+    bool loadData(const path& cartridge);
 
     void handleKeyboardEvent(const SDL_Event& event, bool press);
     void handleMouseEvent(const SDL_Event& event);
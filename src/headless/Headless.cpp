@@ -0,0 +1,520 @@
+#include "Machine.h"
+#include "Cartridge.h"
+#include "ColorLUT.h"
+#include "Cpu.h"
+#include "Demo.h"
+#include "FrameExport.h"
+#include "MachinePool.h"
+#include "Profiler.h"
+#include "Replay.h"
+#include "Rewind.h"
+#include "SoundChip.h"
+#include "Translator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+  struct Options
+  {
+    u64 frames = 600;
+    path dumpFolder;
+    u64 dumpEvery = 1;
+    bool fullBrightness = false;
+    bool rewind = false;
+    size_t instances = 0;
+    size_t threads = 0;
+    bool exportFrames = false;
+    std::string exportName;
+    HostFormat exportFormat = HostFormat::ABGR8888;
+    u32 exportSlots = 3;
+    u32 exportScale = 1;
+    ScaleFilter exportFilter = ScaleFilter::Nearest;
+    path recordFile;
+    path replayFile;
+    bool verify = true;
+    u32 seed = 1;
+    bool profile = false;
+    path profileFile;
+    bool program = false;
+    bool translate = false;
+    path cartridgeFile;
+    path saveCartridgeFile;
+    path wavFile;
+  };
+
+  bool parseFormat(const std::string& name, HostFormat& format)
+  {
+    if (name == "raw")
+    {
+      format = HostFormat::Unknown;
+      return true;
+    }
+
+    for (HostFormat candidate : { HostFormat::ARGB8888, HostFormat::ABGR8888, HostFormat::RGB565 })
+    {
+      if (name == PixelConverter::name(candidate))
+      {
+        format = candidate;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool parseFilter(const std::string& name, ScaleFilter& filter)
+  {
+    for (ScaleFilter candidate : { ScaleFilter::Nearest, ScaleFilter::Scale2x })
+    {
+      if (name == Upscaler::name(candidate))
+      {
+        filter = candidate;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void usage()
+  {
+    printf("usage: miniature-headless [--frames N] [--dump DIR] [--dump-every K] [--full-brightness] [--rewind] [--instances N [--threads T]] [--export NAME] [--record FILE [--seed S]] [--replay FILE [--no-verify]] [--profile] [--profile-json FILE] [--program [--translate]] [--cartridge FILE] [--save-cartridge FILE] [--wav FILE]\n");
+    printf("  --frames N      number of frames to run (default 600)\n");
+    printf("  --dump DIR      write the framebuffer of every dumped frame as a PPM file in DIR\n");
+    printf("  --dump-every K  only dump one frame out of K (default 1)\n");
+    printf("  --full-brightness  expand 5 bit components to the full 8 bit range in dumps\n");
+    printf("  --rewind        snapshot every frame into a rewind buffer and report its cost\n");
+    printf("  --instances N   run N machines on a thread pool instead of a single one\n");
+    printf("  --threads T     worker threads for --instances (default every hardware thread)\n");
+    printf("  --export NAME   publish every frame into the POSIX shared memory object NAME, - for an anonymous memfd\n");
+    printf("  --export-format argb8888, abgr8888 (default), rgb565 or raw for unconverted RGB555\n");
+    printf("  --export-slots K  frames kept in the shared ring (default 3)\n");
+    printf("  --export-scale S  upscale exported frames by an integer factor from 1 to %u (default 1)\n", Upscaler::MAX_FACTOR);
+    printf("  --export-filter nearest (default) or scale2x, which needs an even --export-scale\n");
+    printf("  --record FILE   run the demo with scripted random input and save it with frame hashes as an input log\n");
+    printf("  --seed S        seed of the scripted input for --record (default 1)\n");
+    printf("  --replay FILE   replay an input log as fast as possible, checking every frame against its hash\n");
+    printf("  --no-verify     skip hashing frames while replaying\n");
+    printf("  --profile       time every frame stage and print p50/p99 once done\n");
+    printf("  --profile-json FILE  also save the profile as JSON into FILE\n");
+    printf("  --program       run the demo as a program on the machine cpu instead of native code\n");
+    printf("  --translate     run hot blocks of the program translated instead of interpreted, implies --program\n");
+    printf("  --cartridge FILE  run a cartridge instead of the demo, its program if it has one\n");
+    printf("  --save-cartridge FILE  save the machine as a cartridge once set up, before running any frame\n");
+    printf("  --wav FILE      synthesize the sound of every frame into a wav file instead of playing it\n");
+  }
+
+  bool parse(int argc, char* argv[], Options& options)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+
+      if (arg == "--frames" && hasValue)
+        options.frames = std::strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--dump" && hasValue)
+        options.dumpFolder = argv[++i];
+      else if (arg == "--dump-every" && hasValue)
+        options.dumpEvery = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+      else if (arg == "--full-brightness")
+        options.fullBrightness = true;
+      else if (arg == "--rewind")
+        options.rewind = true;
+      else if (arg == "--instances" && hasValue)
+        options.instances = std::strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--threads" && hasValue)
+        options.threads = std::strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--export" && hasValue)
+      {
+        options.exportFrames = true;
+        options.exportName = argv[++i];
+        if (options.exportName == "-")
+          options.exportName.clear();
+      }
+      else if (arg == "--export-format" && hasValue)
+      {
+        if (!parseFormat(argv[++i], options.exportFormat))
+          return false;
+      }
+      else if (arg == "--export-slots" && hasValue)
+        options.exportSlots = u32(std::strtoul(argv[++i], nullptr, 10));
+      else if (arg == "--export-scale" && hasValue)
+        options.exportScale = u32(std::strtoul(argv[++i], nullptr, 10));
+      else if (arg == "--export-filter" && hasValue)
+      {
+        if (!parseFilter(argv[++i], options.exportFilter))
+          return false;
+      }
+      else if (arg == "--record" && hasValue)
+        options.recordFile = argv[++i];
+      else if (arg == "--seed" && hasValue)
+        options.seed = u32(std::strtoul(argv[++i], nullptr, 10));
+      else if (arg == "--replay" && hasValue)
+        options.replayFile = argv[++i];
+      else if (arg == "--no-verify")
+        options.verify = false;
+      else if (arg == "--program")
+        options.program = true;
+      else if (arg == "--translate")
+        options.program = options.translate = true;
+      else if (arg == "--cartridge" && hasValue)
+        options.cartridgeFile = argv[++i];
+      else if (arg == "--save-cartridge" && hasValue)
+        options.saveCartridgeFile = argv[++i];
+      else if (arg == "--wav" && hasValue)
+        options.wavFile = argv[++i];
+      else if (arg == "--profile")
+        options.profile = true;
+      else if (arg == "--profile-json" && hasValue)
+      {
+        options.profile = true;
+        options.profileFile = argv[++i];
+      }
+      else
+        return false;
+    }
+
+    return true;
+  }
+
+  /* every machine is loaded from the same mapping of the cartridge, which is only paged in once */
+  bool setup(Machine& machine, const Options& options, const Cartridge& cartridge)
+  {
+    if (cartridge)
+    {
+      machine.setTranslation(options.translate);
+      cartridge.load(machine);
+      return true;
+    }
+
+    demo::setup(machine);
+
+    if (!options.program)
+      return true;
+
+    machine.setTranslation(options.translate);
+
+    const std::vector<u32> program = demo::program();
+    return machine.load(program.data(), program.size());
+  }
+
+  /* a loaded program updates the machine by itself, cartridges never run native code */
+  Replay::update_t update(const Options& options)
+  {
+    return options.program || !options.cartridgeFile.empty() ? Replay::update_t() : Replay::update_t(demo::update);
+  }
+
+  bool reportProgram(const Machine& machine, const Options& options)
+  {
+    if (!options.program && options.cartridgeFile.empty())
+      return true;
+
+    const CpuRegisters& cpu = machine.cpu();
+
+    if (cpu.status == CpuStatus::Fault)
+    {
+      printf("Program fault: %s at instruction %u\n", Cpu::name(cpu.fault), (cpu.pc - 1) & (Specs::CODE_SIZE_IN_INSTRUCTIONS - 1));
+      return false;
+    }
+
+    printf("Program cycles in the last frame: %u of %u\n", cpu.cycles, cpu.budget);
+
+    if (const Translator* translator = machine.translator())
+    {
+      const Translator::Stats& stats = translator->stats();
+      const u64 cycles = stats.translatedCycles + stats.interpretedCycles;
+
+      printf("Translated blocks: %llu, invalidated: %llu, cycles run translated: %.1f%%\n",
+        (unsigned long long)stats.translations, (unsigned long long)stats.invalidations, cycles ? 100.0 * stats.translatedCycles / cycles : 0.0);
+
+      for (const Translator::Block* block : translator->hottest(5))
+        printf("  block at %5u: %3u cycles, %llu executions\n", block->start, block->cycles, (unsigned long long)block->executions);
+    }
+
+    return true;
+  }
+
+  bool dumpFramebuffer(const Screen& screen, const ColorLUT& lut, const path& fileName)
+  {
+    FILE* out = fopen(fileName.c_str(), "wb");
+
+    if (!out)
+      return false;
+
+    fprintf(out, "P6\n%d %d\n255\n", screen.width(), screen.height());
+
+    /* lut is built for ABGR8888 so red is the lowest byte of each entry */
+    std::vector<u8> row(screen.width() * 3);
+    for (coord_t y = 0; y < screen.height(); ++y)
+    {
+      for (coord_t x = 0; x < screen.width(); ++x)
+      {
+        const u32 pixel = lut[screen.pixels()[y * screen.width() + x]];
+        row[x * 3] = pixel & 0xFF;
+        row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+        row[x * 3 + 2] = (pixel >> 16) & 0xFF;
+      }
+
+      fwrite(row.data(), 1, row.size(), out);
+    }
+
+    fclose(out);
+    return true;
+  }
+
+  /* holds a random combination of buttons and mouse state for a random amount of frames */
+  class ScriptedInput
+  {
+  private:
+    std::mt19937 rng;
+    InputState state;
+    u32 remaining;
+
+  public:
+    ScriptedInput(u32 seed) : rng(seed), state(), remaining(0) { }
+
+    const InputState& next()
+    {
+      if (remaining-- == 0)
+      {
+        state.buttons = flag_set<Button>(u16(rng() & 0xFF));
+        state.mouseX = s16(rng() % (Specs::SCREEN_WIDTH + 32)) - 16;
+        state.mouseY = s16(rng() % (Specs::SCREEN_HEIGHT + 32)) - 16;
+        state.mouseButtons = u8(rng() & 0x07);
+        remaining = rng() % 60;
+      }
+
+      return state;
+    }
+  };
+
+  bool reportProfile(const Options& options)
+  {
+    if (!options.profile)
+      return true;
+
+    printf("\n");
+    Profiler::write(stdout, Profiler::Format::Text);
+
+    if (!options.profileFile.empty() && !Profiler::save(options.profileFile, Profiler::Format::Json))
+    {
+      printf("Error while writing profile into %s.\n", options.profileFile.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  int replay(const Options& options, const Cartridge& cartridge)
+  {
+    InputLog log;
+
+    if (!log.load(options.replayFile))
+    {
+      printf("Unable to load input log %s.\n", options.replayFile.c_str());
+      return -1;
+    }
+
+    Machine machine;
+    if (!setup(machine, options, cartridge))
+      return -1;
+
+    const ReplayResult result = Replay::run(machine, log, update(options), options.verify);
+
+    printf("Frames: %llu (%zu input changes)\n", (unsigned long long)result.frames, log.changes().size());
+    printf("Time: %.3f ms\n", result.seconds * 1000.0);
+    printf("Frames/sec: %.1f (%.0fx real time)\n", result.framesPerSecond(), result.framesPerSecond() / 60.0);
+    printf("Final hash: %016llx\n", (unsigned long long)result.finalHash);
+
+    if (!reportProfile(options))
+      return -1;
+
+    if (!options.verify)
+      return 0;
+
+    if (!result.matches())
+    {
+      printf("Mismatch: %llu frames differ, first one is frame %llu\n", (unsigned long long)result.mismatches, (unsigned long long)result.firstMismatch);
+      return 1;
+    }
+
+    printf("Every frame matches the log\n");
+    return 0;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options options;
+
+  if (!parse(argc, argv, options))
+  {
+    usage();
+    return -1;
+  }
+
+  /* pooled machines would all add up into the same frames, so pooled runs are never profiled */
+  Profiler::setEnabled(options.profile && !options.instances);
+
+  Cartridge cartridge;
+  if (!options.cartridgeFile.empty() && !cartridge.open(options.cartridgeFile))
+    return -1;
+
+  if (options.instances)
+  {
+    MachinePool pool(options.instances, options.threads);
+    pool.forEach([&options, &cartridge](Machine& machine, size_t) { setup(machine, options, cartridge); });
+
+    const Replay::update_t step = update(options);
+    const PoolStats stats = pool.run(options.frames, [&step](Machine& machine, size_t) { if (step) step(machine); });
+
+    printf("Instances: %zu on %zu threads\n", pool.size(), pool.threads());
+    printf("Frames: %llu\n", (unsigned long long)stats.frames);
+    printf("Time: %.3f ms\n", stats.seconds * 1000.0);
+    printf("Frames/sec: %.1f\n", stats.framesPerSecond());
+    printf("Steals: %llu\n", (unsigned long long)stats.steals);
+    return 0;
+  }
+
+  if (!options.replayFile.empty())
+    return replay(options, cartridge);
+
+  Machine machine;
+  if (!setup(machine, options, cartridge))
+    return -1;
+
+  if (!options.saveCartridgeFile.empty())
+  {
+    if (!Cartridge::save(options.saveCartridgeFile, machine))
+      return -1;
+
+    printf("Saved cartridge %s\n", options.saveCartridgeFile.c_str());
+  }
+
+  const Replay::update_t step = update(options);
+  ScriptedInput script(options.seed);
+  InputLog log;
+
+  ColorLUT lut;
+  lut.build(HostFormat::ABGR8888, options.fullBrightness);
+
+  RewindBuffer history;
+
+  SoundChip sound;
+  WavWriter wav;
+  std::array<s16, Specs::SOUND_SAMPLES_PER_FRAME> samples;
+
+  if (!options.wavFile.empty() && !wav.open(options.wavFile))
+    return -1;
+
+  FrameExport frames;
+  if (options.exportFrames)
+  {
+    if (!frames.open(options.exportName, options.exportFormat, options.exportSlots, options.exportFilter, options.exportScale))
+      return -1;
+
+    if (options.exportName.empty())
+      printf("Exporting frames through memfd %d\n", frames.fd());
+  }
+
+  using clock = std::chrono::steady_clock;
+  clock::duration elapsed = clock::duration::zero(), snapshots = clock::duration::zero();
+
+  for (u64 i = 0; i < options.frames; ++i)
+  {
+    const auto start = clock::now();
+    const InputState input = options.recordFile.empty() ? InputState() : script.next();
+    {
+      ProfileScope scope(Profiler::Stage::Frame);
+      Replay::step(machine, input, step);
+
+      /* exactly a frame of samples every frame, there's no device clock to follow */
+      if (wav)
+      {
+        ProfileScope synthesis(Profiler::Stage::Sound);
+        sound.render(static_cast<const Machine&>(machine).sound(), samples.data(), samples.size());
+      }
+    }
+    Profiler::commit();
+    elapsed += clock::now() - start;
+
+    if (!options.recordFile.empty())
+      log.record(input, hashFramebuffer(machine.screen()));
+
+    if (options.rewind)
+    {
+      const auto start = clock::now();
+      history.push(machine);
+      snapshots += clock::now() - start;
+    }
+
+    frames.publish(machine);
+
+    if (wav && !wav.write(samples.data(), samples.size()))
+    {
+      printf("Error while writing audio into %s.\n", options.wavFile.c_str());
+      return -1;
+    }
+
+    if (!options.dumpFolder.empty() && i % options.dumpEvery == 0)
+    {
+      char name[32];
+      snprintf(name, sizeof(name), "frame%06llu.ppm", (unsigned long long)i);
+
+      if (!dumpFramebuffer(machine.screen(), lut, options.dumpFolder + "/" + name))
+      {
+        printf("Error while writing frame %llu into %s.\n", (unsigned long long)i, options.dumpFolder.c_str());
+        return -1;
+      }
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  printf("Frames: %llu\n", (unsigned long long)options.frames);
+  printf("Time: %.3f ms\n", seconds * 1000.0);
+  printf("Frames/sec: %.1f\n", seconds > 0.0 ? options.frames / seconds : 0.0);
+
+  if (!options.recordFile.empty())
+  {
+    if (!log.save(options.recordFile))
+    {
+      printf("Error while writing input log %s.\n", options.recordFile.c_str());
+      return -1;
+    }
+
+    printf("Recorded %llu frames with %zu input changes into %s\n", (unsigned long long)log.frames(), log.changes().size(), options.recordFile.c_str());
+  }
+
+  if (wav)
+  {
+    const u64 written = wav.samples();
+
+    if (!wav.close())
+    {
+      printf("Error while writing audio into %s.\n", options.wavFile.c_str());
+      return -1;
+    }
+
+    printf("Saved %.2f seconds of audio into %s\n", double(written) / Specs::SOUND_SAMPLE_RATE, options.wavFile.c_str());
+  }
+
+  if (!reportProfile(options) || !reportProgram(machine, options))
+    return -1;
+
+  if (options.rewind && options.frames)
+  {
+    const double snapshotTime = std::chrono::duration<double, std::micro>(snapshots).count() / options.frames;
+    printf("Snapshot time: %.2f us\n", snapshotTime);
+    printf("Rewind history: %zu snapshots in %zu Kb\n", history.size(), history.bytes() / KB1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,258 @@
+#include "Machine.h"
+#include "Cartridge.h"
+#include "Quantizer.h"
+
+#include <png.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  /* sheets are laid out on the rows of the sprite map so that sprites larger than a tile keep their shape */
+  constexpr s32 MAP_COLUMNS = Specs::SPRITE_MAP_WIDTH;
+  constexpr s32 MAP_SPRITES = Specs::SPRITE_MAP_SIZE * Specs::SPRITE_MAPS_COUNT;
+
+  struct Options
+  {
+    path output;
+    path outputFolder;
+    size_t threads = 0;
+    std::vector<path> sheets;
+  };
+
+  struct Sheet
+  {
+    bool valid = false;
+    s32 columns = 0, rows = 0; // in sprites
+    size_t colors = 0; // opaque entries used in the palette
+    Palette palette;
+    std::vector<Sprite> sprites; // a row of columns sprites after the other
+  };
+
+  void usage()
+  {
+    printf("usage: miniature-import [--output FILE | --output-folder DIR] [--threads T] SHEET.png...\n");
+    printf("  --output FILE   pack every sheet into a single cartridge, each one with its own palette\n");
+    printf("  --output-folder DIR  write a cartridge for every sheet into DIR, named after the sheet\n");
+    printf("  --threads T     sheets imported at the same time (default every hardware thread)\n");
+    printf("Sheets are cut in %dx%d sprites and can't be wider than %d pixels, every fully transparent pixel uses entry 0.\n",
+      Specs::SPRITE_WIDTH, Specs::SPRITE_HEIGHT, MAP_COLUMNS * Specs::SPRITE_WIDTH);
+  }
+
+  bool parse(int argc, char* argv[], Options& options)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+
+      if (arg == "--output" && hasValue)
+        options.output = argv[++i];
+      else if (arg == "--output-folder" && hasValue)
+        options.outputFolder = argv[++i];
+      else if (arg == "--threads" && hasValue)
+        options.threads = std::strtoull(argv[++i], nullptr, 10);
+      else if (!arg.empty() && arg[0] != '-')
+        options.sheets.push_back(arg);
+      else
+        return false;
+    }
+
+    return !options.sheets.empty() && options.output.empty() != options.outputFolder.empty();
+  }
+
+  /* decoded as RGBA whatever the format of the file, palette and gray images included */
+  bool loadPng(const path& fileName, std::vector<u8>& pixels, u32& width, u32& height)
+  {
+    png_image image = { };
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_file(&image, fileName.c_str()))
+    {
+      printf("Unable to read %s: %s\n", fileName.c_str(), image.message);
+      return false;
+    }
+
+    image.format = PNG_FORMAT_RGBA;
+    pixels.resize(PNG_IMAGE_SIZE(image));
+
+    if (!png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr))
+    {
+      printf("Unable to decode %s: %s\n", fileName.c_str(), image.message);
+      png_image_free(&image);
+      return false;
+    }
+
+    width = image.width;
+    height = image.height;
+    return true;
+  }
+
+  Sheet import(const path& fileName)
+  {
+    Sheet sheet;
+    std::vector<u8> pixels;
+    u32 width, height;
+
+    if (!loadPng(fileName, pixels, width, height))
+      return sheet;
+
+    if (width % Specs::SPRITE_WIDTH || height % Specs::SPRITE_HEIGHT || width > u32(MAP_COLUMNS * Specs::SPRITE_WIDTH))
+    {
+      printf("Sheet %s of %ux%u is not made of whole sprites or is wider than the sprite map.\n", fileName.c_str(), width, height);
+      return sheet;
+    }
+
+    Quantizer quantizer;
+    quantizer.add(pixels.data(), width * height);
+    sheet.palette = quantizer.build();
+    sheet.colors = std::count_if(sheet.palette.begin(), sheet.palette.end(), Color::isOpaque);
+
+    std::vector<u8> indices(width * height);
+    quantizer.map(pixels.data(), width * height, indices.data());
+
+    sheet.columns = width / Specs::SPRITE_WIDTH;
+    sheet.rows = height / Specs::SPRITE_HEIGHT;
+    sheet.sprites.resize(sheet.columns * sheet.rows);
+
+    for (s32 y = 0; y < s32(height); ++y)
+    {
+      const u8* line = indices.data() + y * width;
+
+      for (s32 x = 0; x < s32(width); x += 2)
+      {
+        Sprite& sprite = sheet.sprites[(y / Specs::SPRITE_HEIGHT) * sheet.columns + x / Specs::SPRITE_WIDTH];
+        sprite.row(y % Specs::SPRITE_HEIGHT)[(x % Specs::SPRITE_WIDTH) / 2] = Sprite::pack(line[x], line[x + 1]);
+      }
+    }
+
+    sheet.valid = true;
+    return sheet;
+  }
+
+  /* places every sheet from sprite 0 and palette 0 on, each one on new rows of the sprite map */
+  bool write(const path& fileName, const std::vector<const Sheet*>& sheets)
+  {
+    s32 rows = 0;
+    for (const Sheet* sheet : sheets)
+      rows += sheet->rows;
+
+    if (rows * MAP_COLUMNS > MAP_SPRITES || sheets.size() > size_t(Specs::PALETTE_COUNT))
+    {
+      printf("Cartridge %s would need %d sprites and %zu palettes, only %d and %d are available.\n",
+        fileName.c_str(), rows * MAP_COLUMNS, sheets.size(), MAP_SPRITES, Specs::PALETTE_COUNT);
+      return false;
+    }
+
+    std::vector<Sprite> sprites(rows * MAP_COLUMNS);
+    std::vector<Palette> palettes;
+    s32 row = 0;
+
+    for (const Sheet* sheet : sheets)
+    {
+      for (s32 y = 0; y < sheet->rows; ++y, ++row)
+        std::copy_n(sheet->sprites.begin() + y * sheet->columns, sheet->columns, sprites.begin() + row * MAP_COLUMNS);
+
+      palettes.push_back(sheet->palette);
+    }
+
+    const std::vector<Cartridge::Source> sources = {
+      { CartridgeSection::SpriteMap, 0, sprites.data(), addr_t(sprites.size() * sizeof(Sprite)) },
+      { CartridgeSection::Palettes, 0, palettes.data(), addr_t(palettes.size() * sizeof(Palette)) }
+    };
+
+    if (!Cartridge::save(fileName, sources))
+    {
+      printf("Error while writing cartridge %s.\n", fileName.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  path cartridgeName(const path& folder, const path& sheet)
+  {
+    const size_t slash = sheet.find_last_of("/\\");
+    path name = slash == path::npos ? sheet : sheet.substr(slash + 1);
+
+    const size_t dot = name.find_last_of('.');
+    if (dot != path::npos && dot > 0)
+      name.resize(dot);
+
+    return folder + "/" + name + ".mcr";
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options options;
+
+  if (!parse(argc, argv, options))
+  {
+    usage();
+    return -1;
+  }
+
+  const size_t count = options.sheets.size();
+  const size_t threads = std::min(count, options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+  const bool separate = !options.outputFolder.empty();
+
+  std::vector<Sheet> sheets(count);
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+
+  const auto start = std::chrono::steady_clock::now();
+
+  /* sheets don't depend on each other, workers take the next one until none are left */
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++)
+    {
+      sheets[i] = import(options.sheets[i]);
+
+      if (!sheets[i].valid || (separate && !write(cartridgeName(options.outputFolder, options.sheets[i]), { &sheets[i] })))
+        failed = true;
+
+      /* once written there's no need to keep every sheet around */
+      if (separate)
+        sheets[i].sprites = std::vector<Sprite>();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; ++t)
+    pool.emplace_back(worker);
+  worker();
+
+  for (std::thread& thread : pool)
+    thread.join();
+
+  if (failed)
+    return -1;
+
+  if (!separate)
+  {
+    std::vector<const Sheet*> packed;
+    s32 row = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      printf("%s: sprites from %d, palette %zu with %zu colors\n", options.sheets[i].c_str(), row * MAP_COLUMNS, i, sheets[i].colors);
+      packed.push_back(&sheets[i]);
+      row += sheets[i].rows;
+    }
+
+    if (!write(options.output, packed))
+      return -1;
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Imported %zu sheets on %zu threads in %.3f ms\n", count, threads, seconds * 1000.0);
+  return 0;
+}
@@ -10,7 +10,8 @@ int main(int argc, char* argv[])
   if (!ui.init())
     return -1;
 
-  if (!ui.loadData())
+  /* an optional cartridge replaces the demo */
+  if (!ui.loadData(argc > 1 ? argv[1] : ""))
   {
     printf("Error while loading and initializing data.\n");
     ui.deinit();
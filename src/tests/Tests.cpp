@@ -0,0 +1,632 @@
+#include "Machine.h"
+#include "Cpu.h"
+#include "Translator.h"
+#include "FrameExport.h"
+#include "MachinePool.h"
+#include "RingBuffer.h"
+#include "SoundChip.h"
+#include "TripleBuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+  /* a test fails on its first false CHECK, which is reported with its location */
+  struct Test
+  {
+    std::string name;
+    std::function<bool()> run;
+  };
+
+#define CHECK(condition) do { if (!(condition)) { printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+  const pix_t INK = Specs::INDEXED_FRAMEBUFFER ? pix_t(Color::indexed(1, 1)) : pix_t(Color::WHITE);
+
+  /* the whole segment walked one pixel at a time, set() drops what falls outside the screen */
+  void referenceLine(Screen& screen, coord_t x0, coord_t y0, coord_t x1, coord_t y1, pix_t color)
+  {
+    const coord_t dx = std::abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    const coord_t dy = -std::abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    coord_t err = dx + dy;
+
+    for (;;)
+    {
+      screen.set(x0, y0, color);
+
+      if (x0 == x1 && y0 == y1)
+        break;
+
+      const coord_t err2 = 2 * err;
+      if (err2 >= dy) { err += dy; x0 += sx; }
+      if (err2 <= dx) { err += dx; y0 += sy; }
+    }
+  }
+
+  bool sameFramebuffer(const Machine& m1, const Machine& m2)
+  {
+    return std::memcmp(m1.screen().vram(), m2.screen().vram(), Specs::FRAMEBUFFER_SIZE_IN_BYTES) == 0;
+  }
+
+  /* runs program on the interpreter and through translator in slices of budget cycles, each slice has to spend the same cycles and leave the same state */
+  bool sameAsInterpreter(const std::vector<u32>& program, u32 budget, u32 slices, Translator& translator)
+  {
+    Machine interpreted, translated;
+    CHECK(interpreted.load(program.data(), program.size()));
+    CHECK(translated.load(program.data(), program.size()));
+
+    for (u32 i = 0; i < slices; ++i)
+    {
+      CHECK(Cpu::run(interpreted, budget) == translator.run(translated, budget));
+      CHECK(std::memcmp(&interpreted.cpu(), &translated.cpu(), sizeof(CpuRegisters)) == 0);
+      CHECK(std::memcmp(interpreted.memory().direct<u8>(0), translated.memory().direct<u8>(0), Specs::MEMORY_SIZE) == 0);
+    }
+
+    return true;
+  }
+
+  std::vector<Test> tests()
+  {
+    std::vector<Test> tests;
+
+    tests.push_back({ "screen/read-only-access-keeps-lines-clean", []() {
+      Machine machine;
+      Screen& screen = machine.screen();
+      screen.set(3, 4, INK);
+      screen.clearDirtyLines();
+
+      const Screen& view = screen;
+      const col_t pixel = view.pixel(4 * Specs::SCREEN_WIDTH + 3);
+      const col_t* pixels = view.pixels();
+      const pix_t* vram = view.vram();
+
+      CHECK(vram[4 * Specs::SCREEN_WIDTH + 3] == INK);
+      CHECK(pixels[4 * Specs::SCREEN_WIDTH + 3] == pixel);
+      CHECK(!view.dirtyLines().any());
+      return true;
+    } });
+
+    tests.push_back({ "memory/span-marks-every-element", []() {
+      Machine machine;
+      Screen& screen = machine.screen();
+      screen.clearDirtyLines();
+
+      constexpr addr_t count = Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT;
+      pix_t* pixels = machine.memory().span<pix_t>(Address::VRAM, count);
+      pixels[count - 1] = INK;
+
+      const Screen& view = screen;
+      CHECK(view.dirtyLines().test(Specs::SCREEN_HEIGHT - 1));
+      return true;
+    } });
+
+    tests.push_back({ "sprites/writes-through-a-reference-kept-across-frames-are-drawn", []() {
+      Machine machine;
+      machine.reset();
+      machine.palettes()[0][1] = Color::WHITE;
+
+      SpriteInfo& info = machine.spriteInfo(0);
+      info.flags |= SpriteFlag::Enabled;
+      info.x = 0;
+      info.y = 0;
+      info.width = SpriteSize::_8;
+      info.height = SpriteSize::_8;
+
+      SpriteRef sprite = machine.sprite(0);
+      machine.frame();
+
+      const Screen& view = machine.screen();
+      CHECK(view.pixel(0) != Color::WHITE);
+
+      /* decoded by the previous frame, the write alone has to bring it back to the cache */
+      sprite.set(0, 0, 1);
+      machine.frame();
+      CHECK(view.pixel(0) == Color::WHITE);
+      CHECK(sprite.get(0, 0) == 1);
+      return true;
+    } });
+
+    tests.push_back({ "sprites/flipped-non-square-sprites-mirror-their-own-tiles", []() {
+      Machine machine;
+      machine.reset();
+      machine.palettes()[0][1] = Color::WHITE;
+      machine.palettes()[0][2] = Color::ccc(255, 0, 0);
+
+      /* tiles 0 and 1 side by side on the first row of the sprite map, 16 below 0 on the second */
+      machine.sprite(0).set(0, 0, 1);
+      machine.sprite(1).set(6, 3, 2);
+      machine.sprite(Specs::SPRITE_MAP_WIDTH).set(1, 7, 2);
+
+      /* sprites 0 and 1 are 8x16 (two tile rows), sprites 2 and 3 are 16x8 (two tile columns), the odd ones flipped */
+      auto place = [&machine](s32 index, coord_t x, coord_t y, SpriteSize width, SpriteSize height, SpriteFlag flip) {
+        SpriteInfo& info = machine.spriteInfo(index);
+        info.flags = flag_set<SpriteFlag>();
+        info.flags |= SpriteFlag::Enabled;
+        info.flags |= flip;
+        info.x = s16(x);
+        info.y = s16(y);
+        info.index = 0;
+        info.width = width;
+        info.height = height;
+      };
+
+      place(0, 0, 0, SpriteSize::_16, SpriteSize::_8, SpriteFlag::Enabled);
+      place(1, 16, 0, SpriteSize::_16, SpriteSize::_8, SpriteFlag::FlippedX);
+      place(2, 0, 32, SpriteSize::_8, SpriteSize::_16, SpriteFlag::Enabled);
+      place(3, 32, 32, SpriteSize::_8, SpriteSize::_16, SpriteFlag::FlippedY);
+      machine.frame();
+
+      const Screen& view = machine.screen();
+      auto at = [&view](coord_t x, coord_t y) { return view.pixel(addr_t(y * Specs::SCREEN_WIDTH + x)); };
+
+      CHECK(at(0, 0) == Color::WHITE && at(1, 15) == Color::ccc(255, 0, 0));
+      for (coord_t y = 0; y < 16; ++y)
+        for (coord_t x = 0; x < 8; ++x)
+          CHECK(at(16 + x, y) == at(x, 15 - y));
+
+      CHECK(at(0, 32) == Color::WHITE && at(14, 35) == Color::ccc(255, 0, 0));
+      for (coord_t y = 0; y < 8; ++y)
+        for (coord_t x = 0; x < 16; ++x)
+          CHECK(at(32 + x, 32 + y) == at(15 - x, 32 + y));
+
+      return true;
+    } });
+
+    tests.push_back({ "screen/clipped-lines-keep-the-pixels-of-the-whole-line", []() {
+      const coord_t lines[][4] = {
+        { 20, 30, 100, 70 }, { 90, 10, 30, 120 }, // on screen
+        { -50, 10, 200, 90 }, { 200, 90, -50, 10 }, { -37, -11, 170, 141 },
+        { 10, -80, 60, 300 }, { 140, 5, -3, 131 }, { -1000, 64, 1000, 65 }, { 63, -999, 66, 999 }
+      };
+
+      for (const auto& l : lines)
+      {
+        Machine clipped, reference;
+        clipped.screen().line(l[0], l[1], l[2], l[3], INK);
+        referenceLine(reference.screen(), l[0], l[1], l[2], l[3], INK);
+        CHECK(sameFramebuffer(clipped, reference));
+      }
+
+      return true;
+    } });
+
+    tests.push_back({ "screen/circles-fully-off-screen-draw-nothing", []() {
+      Machine machine;
+      Screen& screen = machine.screen();
+      screen.clearDirtyLines();
+
+      screen.circle(10, 200, 5, INK);
+      screen.circle(10, -20, 5, INK);
+      screen.fillCircle(10, 200, 5, INK);
+      screen.fillCircle(10, -20, 5, INK);
+
+      CHECK(!static_cast<const Screen&>(screen).dirtyLines().any());
+      return true;
+    } });
+
+    tests.push_back({ "cpu/return-with-a-depth-past-the-call-stack-faults", []() {
+      /* a subroutine which yields, so the frame ends inside it right before its return */
+      const u32 program[] = {
+        Instruction::encodeImm16(Opcode::Call, 0, 2),
+        Instruction::encodeImm16(Opcode::Jmp, 0, 0),
+        Instruction::encode(Opcode::Yield),
+        Instruction::encode(Opcode::Ret)
+      };
+
+      for (bool translated : { false, true })
+      {
+        Machine machine;
+        machine.reset();
+        machine.setTranslation(translated);
+        CHECK(machine.load(program, sizeof(program) / sizeof(program[0])));
+
+        /* enough frames for every block to be translated */
+        for (u32 i = 0; i < 4 * Translator::HOT_THRESHOLD; ++i)
+          machine.frame();
+
+        CHECK(machine.cpu().status == CpuStatus::Running);
+        if (translated)
+        {
+          const auto blocks = machine.translator()->hottest(Specs::CODE_SIZE_IN_INSTRUCTIONS);
+          CHECK(std::any_of(blocks.begin(), blocks.end(), [](const Translator::Block* block) { return block->start == 3; }));
+        }
+
+        machine.cpu().depth = u8(Specs::CPU_CALL_DEPTH + 1);
+        machine.frame();
+
+        CHECK(machine.cpu().status == CpuStatus::Fault);
+        CHECK(machine.cpu().fault == CpuFault::StackOverflow);
+      }
+
+      CHECK(std::string(Cpu::name(CpuFault(0xFF))) == "unknown");
+      CHECK(Cpu::effective<u32>(0x7FFFFFFF, 0x7FFFFFFF) == ((0xFFFFFFFEu) & (Specs::MEMORY_SIZE - sizeof(u32))));
+      return true;
+    } });
+
+    tests.push_back({ "translator/fused-compare-and-branch-pairs-match-the-interpreter", []() {
+      using I = Instruction;
+      const std::vector<u32> program = {
+        I::encodeImm16(Opcode::Ldi, 1, 0),
+        I::encodeImm16(Opcode::Ldi, 2, 100),
+        I::encodeImm8(Opcode::Addi, 1, 1, 1),
+        I::encode(Opcode::Slt, 3, 1, 2),
+        I::encodeImm16(Opcode::Jnz, 3, 2),
+        I::encodeImm16(Opcode::Ldi, 4, 5),
+        I::encodeImm8(Opcode::Addi, 4, 4, -1),
+        I::encodeImm16(Opcode::Jnz, 4, 6),
+        I::encode(Opcode::Seq, 5, 1, 2),
+        I::encodeImm16(Opcode::Jz, 5, 0), // never taken
+        I::encode(Opcode::Sltu, 6, 2, 1),
+        I::encodeImm16(Opcode::Jz, 6, 0), // always taken
+        I::encode(Opcode::Halt)
+      };
+
+      for (u32 budget : { 7u, 1000u })
+      {
+        Translator translator;
+        CHECK(sameAsInterpreter(program, budget, 40000 / budget, translator));
+
+        std::vector<u8> codes;
+        for (const Translator::Block* block : translator.hottest(Specs::CODE_SIZE_IN_INSTRUCTIONS))
+          for (const Translator::Op& op : block->ops)
+            codes.push_back(op.code);
+
+        for (Translator::Fused fused : { Translator::Fused::AddiJnz, Translator::Fused::SltJnz, Translator::Fused::SeqJz, Translator::Fused::SltuJz })
+          CHECK(std::find(codes.begin(), codes.end(), u8(fused)) != codes.end());
+      }
+
+      return true;
+    } });
+
+    tests.push_back({ "translator/code-written-inside-a-block-matches-the-interpreter", []() {
+      using I = Instruction;
+      /*
+        the loop stores an Ldi of its counter: in RAM for its first 19 iterations, long enough to be translated,
+        then over the instruction at 12, right after the store in the same block
+      */
+      const std::vector<u32> program = {
+        I::encodeImm16(Opcode::Ldi, 1, 0),
+        I::encodeImm16(Opcode::Ldi, 3, 16),
+        I::encodeImm16(Opcode::Ldi, 4, I::encodeImm16(Opcode::Ldi, 7, 0)),
+        I::encodeImm16(Opcode::Ldi, 10, 20),
+        I::encodeImm16(Opcode::Ldi, 11, 15),
+        I::encodeImm8(Opcode::Addi, 1, 1, 1),
+        I::encode(Opcode::Shl, 2, 1, 3),
+        I::encode(Opcode::Or, 2, 2, 4),
+        I::encode(Opcode::Slt, 9, 1, 10),
+        I::encode(Opcode::Shl, 9, 9, 11),
+        I::encodeImm8(Opcode::Addi, 5, 9, 12 * sizeof(u32)),
+        I::encodeImm8(Opcode::Stw, 2, 5, 0),
+        I::encodeImm16(Opcode::Ldi, 7, 0),
+        I::encode(Opcode::Add, 6, 6, 7),
+        I::encodeImm16(Opcode::Jmp, 0, 5)
+      };
+      static_assert(Address::RAM == 1 << 15);
+
+      for (u32 budget : { 5u, 1000u })
+      {
+        Translator translator;
+        CHECK(sameAsInterpreter(program, budget, 20000 / budget, translator));
+        CHECK(translator.stats().invalidations > 0);
+      }
+
+      return true;
+    } });
+
+    tests.push_back({ "translator/fault-inside-a-chained-block-matches-the-interpreter", []() {
+      using I = Instruction;
+      /* the block at 4 is entered through the link of the loop at 2 and divides by zero on its 20th execution */
+      const std::vector<u32> program = {
+        I::encodeImm16(Opcode::Ldi, 1, 40),
+        I::encodeImm16(Opcode::Ldi, 2, 1),
+        I::encodeImm8(Opcode::Addi, 1, 1, -1),
+        I::encodeImm16(Opcode::Jnz, 1, 2),
+        I::encodeImm8(Opcode::Addi, 3, 3, 1),
+        I::encodeImm16(Opcode::Ldi, 1, 40),
+        I::encodeImm16(Opcode::Ldi, 4, 20),
+        I::encode(Opcode::Sub, 5, 4, 3),
+        I::encode(Opcode::Div, 6, 2, 5),
+        I::encodeImm16(Opcode::Jmp, 0, 2)
+      };
+
+      Translator translator;
+      CHECK(sameAsInterpreter(program, 100000, 2, translator));
+      CHECK(translator.stats().translatedCycles > 0);
+
+      const auto blocks = translator.hottest(Specs::CODE_SIZE_IN_INSTRUCTIONS);
+      CHECK(std::any_of(blocks.begin(), blocks.end(), [](const Translator::Block* block) { return block->start == 4 && block->executions > 0; }));
+
+      Machine machine;
+      CHECK(machine.load(program.data(), program.size()));
+      translator.flush();
+      translator.run(machine, 100000);
+      CHECK(machine.cpu().status == CpuStatus::Fault);
+      CHECK(machine.cpu().fault == CpuFault::DivideByZero);
+      CHECK(machine.cpu().pc == 9);
+      return true;
+    } });
+
+    tests.push_back({ "translator/budget-running-out-inside-a-block-matches-the-interpreter", []() {
+      using I = Instruction;
+      /* the loop at 2 costs 41 cycles, two of them drawing */
+      const std::vector<u32> program = {
+        I::encodeImm16(Opcode::Ldi, 1, 1),
+        I::encodeImm16(Opcode::Ldi, 2, 2),
+        I::encode(Opcode::Add, 3, 1, 2),
+        I::encode(Opcode::Pset, 1, 2, 3),
+        I::encode(Opcode::Mul, 4, 3, 3),
+        I::encodeImm8(Opcode::Addi, 1, 1, 3),
+        I::encode(Opcode::Xor, 2, 2, 1),
+        I::encode(Opcode::Pset, 2, 1, 4),
+        I::encode(Opcode::Sub, 5, 4, 1),
+        I::encodeImm8(Opcode::Addi, 6, 6, 1),
+        I::encodeImm16(Opcode::Jmp, 0, 2)
+      };
+
+      for (u32 budget : { 7u, 13u, 20u, 40u, 41u, 45u, 100u })
+      {
+        Translator translator;
+        CHECK(sameAsInterpreter(program, budget, 20000 / budget, translator));
+        CHECK(translator.stats().translatedCycles > 0);
+      }
+
+      return true;
+    } });
+
+    tests.push_back({ "export/reader-gets-the-latest-frame-with-its-sequence", []() {
+      const std::string name = "/miniature-tests-" + std::to_string(getpid());
+      FrameExport exporter;
+      FrameReader reader;
+      CHECK(exporter.open(name, HostFormat::Unknown, 3));
+      CHECK(reader.open(name));
+
+      std::vector<u8> frame(reader.frameSize());
+      CHECK(reader.read(frame.data()) == 0);
+
+      /* more frames than slots, so every slot is rewritten with newer frames */
+      Machine machine;
+      for (coord_t i = 1; i <= 7; ++i)
+      {
+        machine.screen().set(i, 0, INK);
+        machine.screen().scanOut();
+        exporter.publish(machine);
+
+        CHECK(reader.read(frame.data()) == u64(i));
+        CHECK(std::memcmp(frame.data(), machine.screen().pixels(), Specs::SCREEN_WIDTH * Specs::SCREEN_HEIGHT * sizeof(col_t)) == 0);
+      }
+
+      return true;
+    } });
+
+    tests.push_back({ "export/reader-gives-up-on-a-writer-stopped-inside-a-frame", []() {
+      const std::string name = "/miniature-tests-stalled-" + std::to_string(getpid());
+      FrameExport exporter;
+      FrameReader reader;
+      CHECK(exporter.open(name, HostFormat::Unknown, 3));
+      CHECK(reader.open(name));
+
+      Machine machine;
+      exporter.publish(machine);
+      std::vector<u8> frame(reader.frameSize());
+      CHECK(reader.read(frame.data()) == 1);
+
+      /* leaves the slot of the latest frame odd, as a writer killed while rewriting it would */
+      const int fd = shm_open(name.c_str(), O_RDWR, 0);
+      CHECK(fd >= 0);
+      void* region = mmap(nullptr, sizeof(FrameExportHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+      CHECK(region != MAP_FAILED);
+
+      FrameExportHeader* header = static_cast<FrameExportHeader*>(region);
+      header->slotSequences[0].store(1);
+      const u64 sequence = reader.read(frame.data());
+      header->slotSequences[0].store(2);
+      munmap(region, sizeof(FrameExportHeader));
+
+      CHECK(sequence == 0);
+      CHECK(reader.read(frame.data()) == 1);
+      return true;
+    } });
+
+    tests.push_back({ "pool/workers-without-chunks-wait-for-the-others", []() {
+      /* more workers than chunks, so most of them sleep through every job */
+      MachinePool pool(MachinePool::CHUNK_SIZE * 2 + 1, 8);
+
+      for (u64 frames : { 1, 50, 3 })
+        pool.run(frames);
+
+      for (size_t i = 0; i < pool.size(); ++i)
+        CHECK(pool.machine(i).frames() == 54);
+      return true;
+    } });
+
+    tests.push_back({ "triple-buffer/publish-tells-if-the-previous-value-was-skipped", []() {
+      TripleBuffer<int> buffer;
+
+      buffer.back() = 1;
+      CHECK(buffer.publish());
+      buffer.back() = 2;
+      CHECK(!buffer.publish());
+
+      CHECK(buffer.update());
+      CHECK(buffer.front() == 2);
+      CHECK(!buffer.update());
+
+      buffer.back() = 3;
+      CHECK(buffer.publish());
+      return true;
+    } });
+
+    tests.push_back({ "ring-buffer/wraps-around-and-cuts-short-what-doesnt-fit", []() {
+      RingBuffer<int, 8> buffer;
+      const int values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+      int read[16] = { };
+
+      CHECK(buffer.write(values, 5) == 5);
+      CHECK(buffer.read(read, 3) == 3);
+      CHECK(read[0] == 0 && read[2] == 2);
+
+      /* 2 queued, 6 more fill it past the end of the storage, then nothing fits */
+      CHECK(buffer.write(values + 5, 6) == 6);
+      CHECK(buffer.size() == 8);
+      CHECK(buffer.write(values + 11, 2) == 0);
+
+      /* asking for more than what's queued returns what there is, in order across the wraparound */
+      CHECK(buffer.read(read, 16) == 8);
+      CHECK(std::equal(read, read + 8, values + 3));
+      CHECK(buffer.read(read, 1) == 0);
+
+      CHECK(buffer.write(values, 7) == 7);
+      CHECK(buffer.read(read, 7) == 7);
+      CHECK(std::equal(read, read + 7, values));
+      CHECK(buffer.size() == 0);
+      return true;
+    } });
+
+    tests.push_back({ "sound/fixed-registers-render-the-same-samples", []() {
+      SoundRegisters registers = SoundRegisters();
+      registers.volume = 15;
+      /* an eighth of the sample rate, the square is high for 4 samples and low for 4 */
+      registers.channel(SoundChannelType::Square) = { Specs::SOUND_SAMPLE_RATE / 8, 15, 0 };
+
+      constexpr size_t COUNT = Specs::SOUND_SAMPLES_PER_FRAME * 3 + 17;
+      std::vector<s16> whole(COUNT), blocks(COUNT), again(COUNT);
+
+      SoundChip chip;
+      chip.render(registers, whole.data(), 8);
+      CHECK(std::all_of(whole.begin(), whole.begin() + 4, [](s16 sample) { return sample == 15 * 15 * 2 * 15; }));
+      CHECK(std::all_of(whole.begin() + 4, whole.begin() + 8, [](s16 sample) { return sample == -15 * 15 * 2 * 15; }));
+
+      registers.channel(SoundChannelType::Triangle) = { 440, 9, 0 };
+      registers.channel(SoundChannelType::Noise) = { 3000, 5, 1 };
+      registers.channel(SoundChannelType::Wave) = { 220, 12, 0 };
+      for (size_t i = 0; i < registers.wave.size(); ++i)
+        registers.wave[i] = u8(i * 0x11 + 3);
+
+      chip.reset();
+      chip.render(registers, whole.data(), COUNT);
+
+      /* the same registers give the same samples however they are split in blocks, and again after a reset */
+      SoundChip other;
+      for (size_t done = 0, length = 1; done < COUNT; done += length, length *= 3)
+        other.render(registers, blocks.data() + done, std::min(length, COUNT - done));
+      CHECK(whole == blocks);
+
+      chip.reset();
+      chip.render(registers, again.data(), COUNT);
+      CHECK(whole == again);
+      CHECK(std::any_of(whole.begin(), whole.end(), [&whole](s16 sample) { return sample != whole[0]; }));
+      return true;
+    } });
+
+    tests.push_back({ "sound/wav-sizes-are-written-on-close", []() {
+      const std::string name = "/tmp/miniature-tests-" + std::to_string(getpid()) + ".wav";
+      std::vector<s16> samples(1000);
+      for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = s16(i * 37);
+
+      WavWriter writer;
+      CHECK(writer.open(name));
+      CHECK(writer.write(samples.data(), 600));
+      CHECK(writer.write(samples.data() + 600, 400));
+      CHECK(writer.samples() == 1000);
+      CHECK(writer.close());
+      CHECK(!writer);
+
+      std::vector<u8> data(44 + 2000 + 1);
+      FILE* file = fopen(name.c_str(), "rb");
+      CHECK(file);
+      const size_t size = fread(data.data(), 1, data.size(), file);
+      fclose(file);
+      std::remove(name.c_str());
+
+      auto field = [&data](size_t offset) { u32 value; std::memcpy(&value, data.data() + offset, sizeof(value)); return value; };
+
+      CHECK(size == 44 + 2000);
+      CHECK(std::memcmp(data.data(), "RIFF", 4) == 0 && std::memcmp(data.data() + 36, "data", 4) == 0);
+      CHECK(field(4) == 36 + 2000);
+      CHECK(field(24) == u32(Specs::SOUND_SAMPLE_RATE));
+      CHECK(field(40) == 2000);
+      CHECK(std::memcmp(data.data() + 44, samples.data(), 2000) == 0);
+      return true;
+    } });
+
+    tests.push_back({ "snapshot/only-written-pages-are-copied", []() {
+      Machine machine;
+      const Snapshot first = machine.snapshot();
+      const Snapshot unchanged = machine.snapshot(&first);
+      CHECK(unchanged.pagesNotSharedWith(first) == 0);
+
+      machine.memory().byte(Address::CODE) = 0x42;
+      machine.screen().set(3, 4, INK);
+      const Snapshot second = machine.snapshot(&unchanged);
+      CHECK(second.pagesNotSharedWith(unchanged) == 2);
+
+      /* pages written since a base other than the last snapshot aren't known, everything is copied */
+      const Snapshot stale = machine.snapshot(&first);
+      CHECK(stale.pagesNotSharedWith(first) == Specs::SNAPSHOT_PAGE_COUNT);
+
+      machine.restore(first);
+      CHECK(static_cast<const Machine&>(machine).memory().byte(Address::CODE) == 0);
+      /* the code page was handed out by reference during this frame, it's copied until the next one */
+      CHECK(machine.snapshot(&first).pagesNotSharedWith(first) == 1);
+      machine.frame();
+      const Snapshot afterFrame = machine.snapshot();
+      CHECK(machine.snapshot(&afterFrame).pagesNotSharedWith(afterFrame) == 0);
+      return true;
+    } });
+
+    tests.push_back({ "snapshot/writes-through-a-reference-held-across-a-snapshot-are-kept", []() {
+      Machine machine;
+      machine.reset();
+      machine.frame();
+
+      const size_t page = Address::RAM / Specs::SNAPSHOT_PAGE_SIZE, offset = Address::RAM % Specs::SNAPSHOT_PAGE_SIZE;
+      u8& value = machine.memory().byte(Address::RAM);
+      const Snapshot first = machine.snapshot();
+
+      value = 0x5A;
+      const Snapshot second = machine.snapshot(&first);
+      CHECK(second.page(page)[offset] == 0x5A);
+
+      value = 0;
+      machine.restore(second);
+      CHECK(static_cast<const Machine&>(machine).memory().byte(Address::RAM) == 0x5A);
+      return true;
+    } });
+
+    return tests;
+  }
+}
+
+/* runs every test, or only the ones whose name contains the first argument */
+int main(int argc, char* argv[])
+{
+  const std::string filter = argc > 1 ? argv[1] : "";
+  size_t run = 0, failed = 0;
+
+  for (const Test& test : tests())
+  {
+    if (test.name.find(filter) == std::string::npos)
+      continue;
+
+    ++run;
+    const bool passed = test.run();
+    printf("%s %s\n", passed ? "pass" : "FAIL", test.name.c_str());
+
+    if (!passed)
+      ++failed;
+  }
+
+  printf("%zu of %zu tests passed\n", run - failed, run);
+  return failed ? 1 : 0;
+}